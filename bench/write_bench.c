@@ -0,0 +1,185 @@
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tgapi.h"
+
+/**
+ * @file
+ * @brief Round trip check and benchmark of the type writers.
+ *
+ * Parses a batch of updates, writes every update back with update_to_json
+ * and checks that the output parses into the json it came from. Then times
+ * the writer against json_dumps of the same updates. Exits with 1 if the
+ * check fails.
+ */
+
+//! Updates in the batch
+#define BENCH_UPDATES 1000
+
+//! Times each writer goes over the batch
+#define BENCH_ROUNDS 50
+
+//! One update, formatted with its index
+#define BENCH_UPDATE "{\"update_id\":%d,\"message\":{\"message_id\":%d,"\
+    "\"from\":{\"id\":%d,\"first_name\":\"Jos\\u00e9\",\"username\":\"user%d\"},"\
+    "\"date\":1500000000,\"chat\":{\"id\":-%d,\"type\":\"group\",\"title\":\"T\\\"ab\\tle\"},"\
+    "\"text\":\"/start caf\\u00e9 \\ud83d\\ude00 line\\nbreak\",\"entities\":[{\"type\":\"bot_command\","\
+    "\"offset\":0,\"length\":6}],\"location\":{\"longitude\":13.404954,\"latitude\":-52.520007}}}"
+
+double bench_now (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Builds the json text of the batch.
+ */
+
+char *bench_batch (void)
+{
+    size_t size = BENCH_UPDATES * (sizeof (BENCH_UPDATE) + 64), length = 0;
+    char *text = malloc (size);
+
+    if (!text)
+        return NULL;
+
+    text[length++] = '[';
+    for (int i = 0; i < BENCH_UPDATES; i++)
+    {
+        if (i)
+            text[length++] = ',';
+        length += snprintf (text + length, size - length, BENCH_UPDATE, i, i, i, i, i);
+    }
+
+    memcpy (text + length, "]", 2);
+    return text;
+}
+
+/*
+ * Checks that every written update parses back into its json.
+ */
+
+_Bool bench_round_trip (json_t *root, Update_s *updates, size_t count, tg_buffer *buf)
+{
+    json_t *written;
+    tg_res res = { 0 };
+
+    for (size_t i = 0; i < count; i++)
+    {
+        buf->size = 0;
+        if (update_to_json (&updates[i], buf, &res))
+        {
+            fprintf (stderr, "update %zu: writer failed with %d\n", i, res.ok);
+            return 1;
+        }
+
+        written = json_loadb (buf->data, buf->size, 0, NULL);
+        if (!written || !json_equal (written, json_array_get (root, i)))
+        {
+            fprintf (stderr, "update %zu: wrote %s\n", i, buf->data);
+            json_decref (written);
+            return 1;
+        }
+
+        json_decref (written);
+    }
+
+    return 0;
+}
+
+/*
+ * Checks that a real without a json form is written as null.
+ */
+
+_Bool bench_non_finite (Update_s *update, tg_buffer *buf)
+{
+    double *latitude = update->message->extras->location->latitude;
+    double saved = *latitude;
+    json_t *written, *value;
+    tg_res res = { 0 };
+    _Bool failed;
+
+    *latitude = NAN;
+    buf->size = 0;
+    failed = update_to_json (update, buf, &res);
+    *latitude = saved;
+
+    written = failed ? NULL : json_loadb (buf->data, buf->size, 0, NULL);
+    value = json_object_get (json_object_get (json_object_get (written, "message"), "location"),
+        "latitude");
+
+    failed = !json_is_null (value);
+    if (failed)
+        fprintf (stderr, "NaN latitude: wrote %s\n", buf->data);
+
+    json_decref (written);
+    return failed;
+}
+
+int main (void)
+{
+    char *text = bench_batch (), *dump;
+    json_t *root;
+    Update_s *updates = NULL;
+    tg_buffer buf = { NULL };
+    tg_res res = { 0 };
+    size_t count = 0;
+    double start, writer, dumps;
+    int status = 1;
+
+    root = text ? json_loads (text, 0, NULL) : NULL;
+    if (!root)
+    {
+        fprintf (stderr, "malformed batch\n");
+        goto cleanup;
+    }
+
+    count = update_parse (root, &updates, &res);
+    if (res.ok != TG_OKAY || count != BENCH_UPDATES)
+    {
+        fprintf (stderr, "parse failed with %d\n", res.ok);
+        goto cleanup;
+    }
+
+    if (bench_round_trip (root, updates, count, &buf) || bench_non_finite (&updates[0], &buf))
+        goto cleanup;
+
+    printf ("round trip: %zu updates ok\n", count);
+
+    start = bench_now ();
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+        for (size_t i = 0; i < count; i++)
+        {
+            buf.size = 0;
+            update_to_json (&updates[i], &buf, &res);
+        }
+    writer = bench_now () - start;
+
+    start = bench_now ();
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+        for (size_t i = 0; i < count; i++)
+        {
+            dump = json_dumps (json_array_get (root, i), JSON_COMPACT);
+            free (dump);
+        }
+    dumps = bench_now () - start;
+
+    printf ("update_to_json: %.0f ns/update\n", writer * 1e9 / (BENCH_ROUNDS * count));
+    printf ("json_dumps:     %.0f ns/update\n", dumps * 1e9 / (BENCH_ROUNDS * count));
+    printf ("speedup:        %.2fx\n", dumps / writer);
+    status = 0;
+
+cleanup:
+    if (updates)
+        Update_free (updates, count);
+    tg_buffer_free (&buf);
+    json_decref (root);
+    free (text);
+    return status;
+}
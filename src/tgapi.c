@@ -3,7 +3,7 @@
 #include <string.h>
 #include <curl/curl.h>
 #include <jansson.h>
-#include "tgapi.h"
+#include "tgraw.h"
 
 /**
  * @file
@@ -31,6 +31,9 @@ CURLSH *tg_handle;
 struct curl_slist *headers;
 //! Api token
 char tg_token[50];
+//! allowed_updates names, indexed by tgupdate
+const char *update_types[TG_UPDATE_COUNT] = { "message", "edited_message", "channel_post",
+    "edited_channel_post", "inline_query", "chosen_inline_result", "callback_query" };
 
 /**
  * @brief HTTP response object (CURLOPT_WRITEDATA)
@@ -42,6 +45,8 @@ typedef struct
     char *data;
     //! The size of response
     size_t size;
+    //! Set if the response exceeded tg_limits.response_size
+    _Bool too_large;
 } http_response;
 
 _Bool tg_init (const char *api_token, tg_res *res)
@@ -85,10 +90,101 @@ curl_error:
 
 void tg_cleanup (void)
 {
+    tg_dispatch_stop ();
+    tg_webhook_stop ();
+    parse_pool_stop ();
     curl_share_cleanup (tg_handle);
     curl_slist_free_all (headers);
 }
 
+void tg_set_lazy (const _Bool lazy)
+{
+    tg_lazy = lazy;
+}
+
+void tg_set_dedup (const _Bool dedup)
+{
+    tg_dedup = dedup;
+}
+
+_Bool tg_set_mask (const tg_mask *mask)
+{
+    if (!mask)
+    {
+        tg_parse_mask = (tg_mask){ TG_MASK_ALL, TG_MASK_ALL, TG_MASK_ALL, TG_MASK_ALL };
+        return 0;
+    }
+
+    if (!(mask->updates & (TG_BIT (TG_UPDATE_COUNT) - 1)))
+        return 1;
+
+    tg_parse_mask = *mask;
+    return 0;
+}
+
+_Bool tg_set_parse_threads (const size_t threads, const size_t min_batch, tg_res *res)
+{
+    *res = (tg_res){ 0 };
+
+    return parse_pool_start (threads, min_batch, res);
+}
+
+void tg_set_limits (const tg_limits *limits)
+{
+    if (limits)
+        tg_parse_limits = *limits;
+    else
+        tg_parse_limits = (tg_limits){ 0 };
+}
+
+void tg_set_pool_retain (const size_t retain)
+{
+    pool_retain = retain;
+}
+
+void tg_get_pool_stats (tg_pool_stats *stats)
+{
+    *stats = pool_stats;
+}
+
+void tg_get_pool_totals (tg_pool_stats *stats)
+{
+    pool_totals (stats);
+}
+
+/*
+ * Jansson allocation hooks forwarding to the active allocator.
+ */
+
+void *jansson_alloc (size_t size)
+{
+    return tg_malloc (size);
+}
+
+void jansson_free (void *ptr)
+{
+    tg_free (ptr);
+}
+
+void tg_set_allocator (const tg_allocator *hooks)
+{
+    if (hooks)
+    {
+        tg_active_allocator = *hooks;
+        json_set_alloc_funcs (jansson_alloc, jansson_free);
+    }
+    else
+    {
+        tg_active_allocator = (tg_allocator){ tg_libc_alloc, tg_libc_realloc, tg_libc_free, NULL };
+        json_set_alloc_funcs (malloc, free);
+    }
+}
+
+void tg_set_thread_alloc_ctx (void *ctx)
+{
+    tg_thread_alloc_ctx = ctx;
+}
+
 /**
  * @brief Writes response to http_response (CURLOPT_WRITEFUNCTION)
  * @see http_response
@@ -101,16 +197,22 @@ size_t write_response (void *response, size_t size, size_t nmemb, void *write_st
     char *old_data = NULL;
     http_response *mem = (http_response *) write_struct;
 
+    if (tg_parse_limits.response_size && mem->size + real_size > tg_parse_limits.response_size)
+    {
+        mem->too_large = 1;
+        return 0;
+    }
+
     if (mem->data)
     {
         old_data = mem->data;
-        mem->data = realloc (old_data, mem->size + real_size + 1);
+        mem->data = tg_realloc (old_data, mem->size + 1, mem->size + real_size + 1);
     } else
-        mem->data = malloc (real_size + 1);
+        mem->data = tg_malloc (real_size + 1);
 
     if (!mem->data)
     {
-        free (old_data);
+        tg_free (old_data);
         return 0;
     }
 
@@ -122,23 +224,26 @@ size_t write_response (void *response, size_t size, size_t nmemb, void *write_st
 }
 
 /**
- * @brief Wrapper for Telegram http requests
- * 
+ * @brief Performs a Telegram http request with a serialized body
+ * @see tg_request
+ *
  * @param response Stores the response here
  * @param method Method appended to the base Telegram url
- * @param post_json Optional post json object
+ * @param body Optional json body
+ * @param length Length of \p body
  * @param res Error Object
  *
  * @returns 0 on success and 1 on error.
  */
-_Bool tg_request (http_response *response, char *method, json_t *post_json, tg_res *res)
+_Bool tg_request_body (http_response *response, const char *method, const char *body,
+        size_t length, tg_res *res)
 {
     CURL *curl_handle;
     char url[200] = { 0 };
-    char *post_data = NULL;
 
     response->data = NULL;
     response->size = 0;
+    response->too_large = 0;
 
     snprintf (url, 199, "%s%s%s", "https://api.telegram.org/bot", tg_token, method);
 
@@ -147,21 +252,12 @@ _Bool tg_request (http_response *response, char *method, json_t *post_json, tg_r
     {
         res->ok = TG_CURLFAIL;
         res->error_code = CURLE_FAILED_INIT;
-        json_decref (post_json);
         return 1;
     }
 
-    if (post_json) {
-        post_data = json_dumps (post_json, 0);
-
-        if (!post_data)
-        {
-            res->ok = TG_JSONFAIL;
-            json_decref (post_json);
-            return 1;
-        }
-
-        CURLE_CHECK(res->error_code, curl_easy_setopt (curl_handle, CURLOPT_POSTFIELDS, post_data));
+    if (body) {
+        CURLE_CHECK(res->error_code, curl_easy_setopt (curl_handle, CURLOPT_POSTFIELDSIZE, (long) length));
+        CURLE_CHECK(res->error_code, curl_easy_setopt (curl_handle, CURLOPT_POSTFIELDS, body));
         CURLE_CHECK(res->error_code, curl_easy_setopt (curl_handle, CURLOPT_HTTPHEADER, headers));
     }
 
@@ -173,19 +269,48 @@ _Bool tg_request (http_response *response, char *method, json_t *post_json, tg_r
     CURLE_CHECK(res->error_code, curl_easy_perform (curl_handle));
     
     curl_easy_cleanup (curl_handle);
-    json_decref (post_json);
-    free (post_data);
     return 0;
 
 curl_error:
-    free (response->data);
-    json_decref (post_json);
-    free (post_data);
+    tg_free (response->data);
+    response->data = NULL;
     curl_easy_cleanup (curl_handle);
-    res->ok = TG_CURLFAIL;
+    res->ok = response->too_large ? TG_LIMITFAIL : TG_CURLFAIL;
     return 1;
 }
 
+/**
+ * @brief Wrapper for Telegram http requests
+ * 
+ * @param response Stores the response here
+ * @param method Method appended to the base Telegram url
+ * @param post_json Optional post json object, released before returning
+ * @param res Error Object
+ *
+ * @returns 0 on success and 1 on error.
+ */
+_Bool tg_request (http_response *response, char *method, json_t *post_json, tg_res *res)
+{
+    char *post_data = NULL;
+    _Bool failed;
+
+    if (post_json) {
+        post_data = json_dumps (post_json, 0);
+        json_decref (post_json);
+
+        if (!post_data)
+        {
+            res->ok = TG_JSONFAIL;
+            return 1;
+        }
+    }
+
+    failed = tg_request_body (response, method, post_data, post_data ? strlen (post_data) : 0, res);
+
+    tg_free (post_data);
+    return failed;
+}
+
 
 /**
  * @brief Checks if Telegram responds with ok:true
@@ -245,7 +370,7 @@ json_t *tg_load (char **data, json_t **resp_obj, tg_res *res)
     json_t *result;
 
     *resp_obj = json_loads (*data, 0, &res->json_err);
-    free (*data);
+    tg_free (*data);
 
     if (!*resp_obj)
     {
@@ -269,6 +394,269 @@ json_t *tg_load (char **data, json_t **resp_obj, tg_res *res)
     return result;
 }
 
+/**
+ * @brief Checks a raw Telegram response and locates its result.
+ *
+ * Like is_okay and tg_load, but scans the response instead of loading it.
+ *
+ * @param raw Response to check, data and size set
+ * @param res Error Object
+ *
+ * @returns 0 on success and 1 on error.
+ */
+_Bool tg_raw_load (tg_raw *raw, tg_res *res)
+{
+    tg_slice root = { raw->data, raw->size }, ok, value;
+    long long error_code;
+    size_t length;
+
+    if (!raw_member (root, "ok", &ok))
+    {
+        res->ok = TG_JSONFAIL;
+        return 1;
+    }
+
+    if (ok.len != 4 || memcmp (ok.ptr, "true", 4))
+    {
+        res->ok = TG_NOTOKAY;
+
+        if (raw_member (root, "error_code", &value) && !raw_integer (value, &error_code))
+            res->error_code = error_code;
+
+        /* The decoded description is never longer than its json text */
+        if (raw_member (root, "description", &value) && value.len >= 2 && value.len - 2 < 100)
+        {
+            length = text_decode (value.ptr + 1, value.len - 2, res->description);
+            res->description[length == TEXT_INVALID ? 0 : length] = '\0';
+        }
+
+        return 1;
+    }
+
+    if (!raw_member (root, "result", &raw->result))
+    {
+        res->ok = TG_JSONFAIL;
+        return 1;
+    }
+
+    return 0;
+}
+
+void tg_raw_free (tg_raw *raw)
+{
+    tg_free (raw->data);
+    tg_free (raw->updates);
+    *raw = (tg_raw){ NULL };
+}
+
+_Bool tg_method_raw (const char *method, const char *body, const size_t length, tg_raw *raw,
+        tg_res *res)
+{
+    http_response response;
+    char path[100];
+    *res = (tg_res){ 0 };
+    *raw = (tg_raw){ NULL };
+
+    snprintf (path, sizeof (path), "/%s", method);
+
+    if (tg_request_body (&response, path, body, length, res))
+        return 1;
+
+    raw->data = response.data;
+    raw->size = response.size;
+
+    if (!raw->data || tg_raw_load (raw, res))
+    {
+        if (!raw->data)
+            res->ok = TG_JSONFAIL;
+        tg_raw_free (raw);
+        return 1;
+    }
+
+    return 0;
+}
+
+_Bool sendMessageRaw (const char *body, const size_t length, tg_raw *raw, tg_res *res)
+{
+    return tg_method_raw ("sendMessage", body, length, raw, res);
+}
+
+_Bool getUpdatesRaw (const long long offset, const size_t limit, const int timeout, tg_raw *raw,
+        tg_res *res)
+{
+    char body[300];
+    size_t length, capacity = 0;
+    tg_slice update, id;
+    raw_iter iter;
+    tg_raw_update *grown;
+
+    length = snprintf (body, sizeof (body), "{\"offset\":%lld,\"limit\":%zu,\"timeout\":%d,"
+            "\"allowed_updates\":[", offset, limit, timeout);
+
+    for (int i = 0; i < TG_UPDATE_COUNT; i++)
+        if (tg_parse_mask.updates & TG_BIT (i))
+            length += snprintf (body + length, sizeof (body) - length, "%s\"%s\"",
+                    body[length - 1] == '[' ? "" : ",", update_types[i]);
+
+    length += snprintf (body + length, sizeof (body) - length, "]}");
+
+    if (tg_method_raw ("getUpdates", body, length, raw, res))
+        return 1;
+
+    if (raw_array_begin (raw->result, &iter))
+        goto json_error;
+
+    while (raw_array_next (&iter, &update))
+    {
+        if (raw->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            grown = tg_realloc (raw->updates, sizeof (tg_raw_update) * raw->count,
+                    sizeof (tg_raw_update) * capacity);
+            if (!grown)
+            {
+                res->ok = TG_ALLOCFAIL;
+                tg_raw_free (raw);
+                return 1;
+            }
+            raw->updates = grown;
+        }
+
+        raw->updates[raw->count].json = update;
+
+        if (!raw_member (update, "update_id", &id)
+                || raw_integer (id, &raw->updates[raw->count].update_id))
+            goto json_error;
+
+        raw->count++;
+    }
+
+    if (!iter.pos)
+        goto json_error;
+
+    return 0;
+
+json_error:
+    res->ok = TG_JSONFAIL;
+    tg_raw_free (raw);
+    return 1;
+}
+
+/*
+ * Parses what it can of accepted updates that failed to parse for good.
+ * Returns the updates before the first one that fails on its own, or none
+ * if that is the first one, leaving res at its error so it's skipped and
+ * reported. Sets last to the identifier of the last update returned or
+ * skipped.
+ */
+
+size_t filtered_recover (const tg_slice *accepted, const size_t count, const tg_raw *raw,
+        Update_s **api_s, long long *last, tg_res *res)
+{
+    tg_res status = { 0 };
+    Update_s *single;
+    size_t bad, parsed;
+
+    for (bad = 0; bad < count; bad++)
+    {
+        status = (tg_res){ 0 };
+        parsed = update_parse_raw (&accepted[bad], 1, &single, &status);
+        Update_free (single, parsed);
+
+        if (status.ok != TG_OKAY)
+            break;
+    }
+
+    *res = status;
+    *api_s = NULL;
+    parsed = 0;
+    if (status.ok == TG_ALLOCFAIL || !count)
+        return 0;
+
+    if (bad)
+    {
+        /* Together the updates before it may still outgrow the batch budget */
+        parsed = update_parse_raw (accepted, bad, api_s, res);
+        if (res->ok != TG_OKAY)
+        {
+            Update_free (*api_s, parsed);
+            *res = (tg_res){ 0 };
+            parsed = update_parse_raw (accepted, 1, api_s, res);
+        }
+
+        if (res->ok != TG_OKAY)
+        {
+            Update_free (*api_s, parsed);
+            *api_s = NULL;
+            return 0;
+        }
+    }
+
+    for (size_t i = 0; i < raw->count; i++)
+        if (raw->updates[i].json.ptr == accepted[parsed ? parsed - 1 : 0].ptr)
+            *last = raw->updates[i].update_id;
+
+    return parsed;
+}
+
+Update_s *getUpdatesFiltered (const long long offset, size_t *limit, const int timeout,
+        tg_filter filter, void *ctx, long long *next_offset, tg_res *res)
+{
+    long long last = offset - 1;
+    tg_raw raw;
+    tg_slice *accepted;
+    size_t count = 0;
+    Update_s *api_s = NULL;
+
+    *next_offset = offset;
+
+    if (getUpdatesRaw (offset, *limit, timeout, &raw, res))
+    {
+        *limit = 0;
+        return NULL;
+    }
+
+    *limit = 0;
+
+    accepted = tg_malloc (sizeof (tg_slice) * (raw.count ? raw.count : 1));
+    if (!accepted)
+    {
+        res->ok = TG_ALLOCFAIL;
+        tg_raw_free (&raw);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < raw.count; i++)
+        if (!filter || filter (raw.updates[i].json, ctx))
+            accepted[count++] = raw.updates[i].json;
+
+    /* Parsed from the response text, strings go straight into the updates */
+    *limit = update_parse_raw (accepted, count, &api_s, res);
+
+    if (res->ok == TG_OKAY)
+    {
+        for (size_t i = 0; i < raw.count; i++)
+            if (raw.updates[i].update_id >= *next_offset)
+                *next_offset = raw.updates[i].update_id + 1;
+    }
+    else
+    {
+        /* Running out of memory passes, everything else would fail again */
+        Update_free (api_s, *limit);
+        *limit = res->ok == TG_ALLOCFAIL ? 0
+            : filtered_recover (accepted, count, &raw, &api_s, &last, res);
+
+        if (res->ok == TG_ALLOCFAIL)
+            api_s = NULL;
+        else if (last >= *next_offset)
+            *next_offset = last + 1;
+    }
+
+    tg_free (accepted);
+    tg_raw_free (&raw);
+    return api_s;
+}
+
 User_s getMe (tg_res *res)
 {
     http_response response;
@@ -292,21 +680,30 @@ User_s getMe (tg_res *res)
 Update_s *getUpdates (const long long offset, size_t *limit, const int timeout, tg_res *res)
 {
     http_response response;
-    json_t *post, *response_obj, *result;
+    json_t *post, *allowed_updates, *response_obj, *result;
     Update_s *api_s = NULL;
     *res = (tg_res){ 0 };
     
     post = json_object();
+    allowed_updates = json_array();
     
-    if (!post)
+    if (!post || !allowed_updates)
     {
         res->ok = TG_JSONFAIL;
+        json_decref (post);
+        json_decref (allowed_updates);
         return NULL;
     }
+
+    for (int i = 0; i < TG_UPDATE_COUNT; i++)
+        if (tg_parse_mask.updates & TG_BIT (i))
+            json_array_append_new (allowed_updates, json_string (update_types[i]));
+
     json_object_set_new (post, "offset", json_integer (offset));
     json_object_set_new (post, "limit", json_integer (*limit));
     *limit = 0;
     json_object_set_new (post, "timeout", json_integer (timeout));
+    json_object_set_new (post, "allowed_updates", allowed_updates);
     
     if (tg_request (&response, "/getUpdates", post, res))
         return NULL;
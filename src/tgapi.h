@@ -35,7 +35,13 @@ typedef enum tgcode
     /*! Check tg_res.json_err for more information */
     TG_JSONFAIL,
     //! Failed to allocate memory (OOM).
-    TG_ALLOCFAIL
+    TG_ALLOCFAIL,
+    //! An offset points outside of a text or into the middle of a character.
+    TG_RANGEFAIL,
+    //! A response exceeded one of the tg_limits.
+    TG_LIMITFAIL,
+    //! Binary data is not in the expected format.
+    TG_FORMATFAIL
 } tgcode;
 
 /**
@@ -65,6 +71,39 @@ struct tg_res
 typedef struct tg_res tg_res;
 #endif
 
+/**
+ * @brief An update of a raw getUpdates result.
+ * @see getUpdatesRaw
+ */
+typedef struct tg_raw_update
+{
+    //! Json object of the update, points into tg_raw.data
+    tg_slice json;
+    //! Identifier of the update
+    long long update_id;
+} tg_raw_update;
+
+/**
+ * @brief Unparsed response of a Telegram method.
+ * @see tg_raw_free
+ *
+ * Returned by the raw methods, which verify the response and locate its
+ * result without building a json tree or any Telegram type.
+ */
+typedef struct tg_raw
+{
+    //! Response body
+    char *data;
+    //! Length of the response body
+    size_t size;
+    //! Json text of the result, points into data
+    tg_slice result;
+    //! Updates of a getUpdatesRaw result, NULL otherwise
+    tg_raw_update *updates;
+    //! Number of updates
+    size_t count;
+} tg_raw;
+
 /**
  * @brief Initialize the library.
  * @see tg_cleanup
@@ -85,6 +124,220 @@ _Bool tg_init (const char *api_token, tg_res *res);
  * program continues to run.
  */
 void tg_cleanup (void);
+
+/**
+ * @brief Routes every allocation of the library and jansson through \p hooks.
+ * @see tg_set_thread_alloc_ctx
+ *
+ * Parsed objects, their members, responses and jansson's json objects are
+ * all allocated and freed through the hooks, so jemalloc arenas, thread
+ * local slabs or counting allocators can be plugged in. Memory allocated
+ * before the switch must not be freed after it, so call this before
+ * tg_init.
+ *
+ * @param hooks Allocator to use. Pass NULL to go back to malloc/free.
+ */
+void tg_set_allocator (const tg_allocator *hooks);
+
+/**
+ * @brief Sets the allocator context of the calling thread.
+ * @see tg_set_allocator
+ *
+ * The context is passed to the allocator hooks instead of tg_allocator.ctx
+ * for allocations made on this thread, e.g. to pin a worker's memory to its
+ * NUMA node. Frees pass the context of the freeing thread, see tg_allocator.
+ *
+ * @param ctx Context for this thread. Pass NULL to use tg_allocator.ctx.
+ */
+void tg_set_thread_alloc_ctx (void *ctx);
+
+/**
+ * @brief Enables or disables lazy parsing of messages.
+ * @see group9
+ *
+ * When enabled only the scalar members of a Message_s are parsed. Nested
+ * objects (from, chat, reply_to_message, media, entities, ...) are kept as
+ * json and parsed on first access through the message accessors, so replies
+ * to replies don't pay for subtrees nobody reads. Members of lazily parsed
+ * messages must be read through the accessors. Disabled by default.
+ *
+ * Set this before polling, it is not synchronized with running requests.
+ *
+ * @param lazy 1 to parse lazily, 0 to parse everything up front.
+ */
+void tg_set_lazy (const _Bool lazy);
+
+/**
+ * @brief Enables or disables sharing of identical users and chats.
+ *
+ * When enabled every distinct User_s and Chat_s is parsed once per batch
+ * of updates and shared by all the messages that reference it, so a busy
+ * group doesn't cost a copy of its chat and sender per update. Shared
+ * instances are reference counted and released by the last Update_free.
+ * Instances are compared by id and content, a user whose name changed
+ * within the batch still gets its own copy. Parse workers keep separate
+ * tables, so each worker shares within the part of the batch it parsed.
+ * Shared instances must not be modified. Disabled by default.
+ *
+ * Set this before polling, it is not synchronized with running requests.
+ *
+ * @param dedup 1 to share identical instances, 0 to parse each one.
+ */
+void tg_set_dedup (const _Bool dedup);
+
+/**
+ * @brief Selects the updates and fields the library parses.
+ * @see tg_mask
+ *
+ * tg_mask.updates is sent to Telegram as allowed_updates by getUpdates, and
+ * update types outside of it are skipped by the parser as well. The field
+ * masks make the parser skip every Message_s, User_s and Chat_s member that
+ * isn't selected, leaving it NULL. By default everything is parsed.
+ *
+ * Telegram reads an empty allowed_updates as every type, so a mask selecting
+ * no update type is rejected.
+ *
+ * Set this before polling, it is not synchronized with running requests.
+ *
+ * @param mask The new mask. Pass NULL to parse everything again.
+ *
+ * @returns 0 on success, 1 if \p mask selects no update type, in which case
+ * the mask is left unchanged.
+ */
+_Bool tg_set_mask (const tg_mask *mask);
+
+/**
+ * @brief Parses large getUpdates batches on a pool of worker threads.
+ *
+ * Batches of at least \p min_batch updates are split across the workers and
+ * the polling thread, and parsed in parallel into the returned Update_s array,
+ * which keeps the order Telegram sent. Smaller batches, and batches arriving
+ * while the pool is busy with another thread's batch, are parsed on the
+ * calling thread. The pool is stopped by tg_cleanup.
+ *
+ * Set this before polling, it is not synchronized with running requests.
+ *
+ * @param threads Number of worker threads. Pass 0 to stop the pool.
+ * @param min_batch Smallest batch that is parsed in parallel.
+ * @param res Error object.
+ *
+ * @returns 0 on success and 1 on failure.
+ */
+_Bool tg_set_parse_threads (const size_t threads, const size_t min_batch, tg_res *res);
+
+/**
+ * @brief Bounds the memory a response can make the library allocate.
+ * @see tg_limits
+ *
+ * Responses larger than tg_limits.response_size are aborted while they are
+ * received. Objects nested deeper than tg_limits.depth are left out, arrays
+ * are cut to tg_limits.array_len elements and a batch stops allocating once
+ * it used tg_limits.batch_bytes. In each case tg_res.ok is set to
+ * TG_LIMITFAIL and what was parsed so far is returned, to be freed as
+ * usual. Unlimited by default.
+ *
+ * Set this before polling, it is not synchronized with running requests.
+ *
+ * @param limits Limits to apply, NULL removes all limits.
+ */
+void tg_set_limits (const tg_limits *limits);
+
+/**
+ * @brief Sets how many freed objects of each size class a thread keeps for reuse.
+ * @see tg_get_pool_stats
+ *
+ * The parsers take their objects from a thread local pool, and the freers
+ * put them back, so a steady poll loop stops going through malloc. Objects
+ * are grouped in 16 byte size classes up to 512 bytes, larger ones such as
+ * long arrays are never pooled. Each thread keeps at most \p retain objects
+ * per class, about 8 KiB per unit of \p retain; the pool is freed when the
+ * thread exits. Defaults to 128, 0 disables pooling.
+ *
+ * Set this before polling, it is not synchronized with running requests.
+ *
+ * @param retain Objects kept per object size and thread.
+ */
+void tg_set_pool_retain (const size_t retain);
+
+/**
+ * @brief Returns the object pool statistics of the calling thread.
+ * @see tg_set_pool_retain
+ *
+ * @param stats Filled in with the statistics.
+ */
+void tg_get_pool_stats (tg_pool_stats *stats);
+
+/**
+ * @brief Returns the object pool statistics summed over every thread.
+ * @see tg_get_pool_stats
+ *
+ * Includes the parse pool's workers and threads that already exited.
+ *
+ * @param stats Filled in with the statistics.
+ */
+void tg_get_pool_totals (tg_pool_stats *stats);
+
+/**
+ * @brief Decides whether an update is parsed.
+ * @see getUpdatesFiltered
+ *
+ * Called with the json text of each update before it is parsed. Use the
+ * tg_raw extractors to inspect it cheaply.
+ *
+ * @param update Json text of the update.
+ * @param ctx Context passed to getUpdatesFiltered.
+ *
+ * @returns 1 to parse the update, 0 to drop it.
+ */
+typedef _Bool (*tg_filter) (tg_slice update, void *ctx);
+
+/**
+ * @brief Returns the type of a raw update.
+ *
+ * @param update Json text of the update.
+ *
+ * @returns The type, TG_UPDATE_COUNT if it is unknown.
+ */
+tgupdate tg_raw_update_type (tg_slice update);
+
+/**
+ * @brief Returns the chat id of a raw update.
+ *
+ * Found for messages, channel posts, their edits and callback queries on a
+ * message.
+ *
+ * @param update Json text of the update.
+ * @param chat_id Set to the chat id.
+ *
+ * @returns 0 on success, 1 if the update has no chat.
+ */
+_Bool tg_raw_chat_id (tg_slice update, long long *chat_id);
+
+/**
+ * @brief Returns the sender id of a raw update.
+ *
+ * @param update Json text of the update.
+ * @param user_id Set to the id of the sending user.
+ *
+ * @returns 0 on success, 1 if the update has no sender.
+ */
+_Bool tg_raw_from_id (tg_slice update, long long *user_id);
+
+/**
+ * @brief Checks whether a raw update is a message starting with '/'.
+ *
+ * @param update Json text of the update.
+ *
+ * @returns 1 for commands, 0 otherwise.
+ */
+_Bool tg_raw_is_command (tg_slice update);
+
+/**
+ * @brief Frees the response of a raw method.
+ *
+ * @param raw Response to free, may be empty.
+ */
+void tg_raw_free (tg_raw *raw);
 /**@}
  * @defgroup group2 Telegram Methods
  * @brief Methods to interact with the Telegram bot api.
@@ -128,6 +381,85 @@ User_s getMe (tg_res *res);
  */
 Update_s *getUpdates (const long long offset, size_t *limit, const int timeout, tg_res *res);
 
+/**
+ * @brief getUpdates without parsing.
+ * @see tg_raw_free getUpdates
+ *
+ * For proxies that pass updates on as json. The request is written and the
+ * response scanned without a json tree: each update of the result is
+ * returned as a slice of the response along with its update_id.
+ *
+ * @param offset Identifier of the first update to be returned.
+ * @param limit Number of updates you want to retrieve.
+ * @param timeout Timeout for long polling.
+ * @param raw Filled in with the response and its updates.
+ * @param res Error object.
+ *
+ * @returns 0 on success, 1 on error. Use tg_raw_free afterwards to cleanup.
+ */
+_Bool getUpdatesRaw (const long long offset, const size_t limit, const int timeout, tg_raw *raw,
+        tg_res *res);
+
+/**
+ * @brief getUpdates that only parses the updates a filter accepts.
+ * @see tg_filter getUpdates
+ *
+ * The response is scanned without loading it and \p filter runs on the
+ * json text of each update. Only accepted updates are loaded and parsed,
+ * so the cost follows the relevant traffic rather than the total.
+ *
+ * Only complete updates are returned. If the batch fails to parse for any
+ * reason but TG_ALLOCFAIL, the updates before the first one that fails on
+ * its own are returned. When that update comes first it is skipped
+ * instead: nothing is returned and \p res is set to its error, such as
+ * TG_LIMITFAIL or TG_JSONFAIL, so a bad update is reported once and
+ * doesn't block the ones after it.
+ *
+ * @param offset Identifier of the first update to be returned.
+ * @param limit Number of updates you want to retrieve. Set to the number of
+ * updates returned.
+ * @param timeout Timeout for long polling.
+ * @param filter Filter to apply, NULL accepts every update.
+ * @param ctx Context passed to \p filter.
+ * @param next_offset Set to the offset of the next poll, past the updates
+ * returned, dropped by \p filter or skipped. Left at \p offset if nothing
+ * was received or the request failed, and on TG_ALLOCFAIL, so the updates
+ * are polled again.
+ * @param res Error object.
+ *
+ * @returns The accepted updates. Use Update_free afterwards to cleanup.
+ */
+Update_s *getUpdatesFiltered (const long long offset, size_t *limit, const int timeout,
+        tg_filter filter, void *ctx, long long *next_offset, tg_res *res);
+
+/**
+ * @brief Calls a Telegram method with a serialized body.
+ * @see tg_raw_free
+ *
+ * @param method Name of the method, e.g. "sendMessage".
+ * @param body Json body of the request, NULL for none.
+ * @param length Length of \p body.
+ * @param raw Filled in with the response.
+ * @param res Error object.
+ *
+ * @returns 0 on success, 1 on error. Use tg_raw_free afterwards to cleanup.
+ */
+_Bool tg_method_raw (const char *method, const char *body, const size_t length, tg_raw *raw,
+        tg_res *res);
+
+/**
+ * @brief sendMessage with a serialized body.
+ * @see tg_method_raw sendMessage
+ *
+ * @param body Json body of the request.
+ * @param length Length of \p body.
+ * @param raw Filled in with the response, the sent message in tg_raw.result.
+ * @param res Error object.
+ *
+ * @returns 0 on success, 1 on error. Use tg_raw_free afterwards to cleanup.
+ */
+_Bool sendMessageRaw (const char *body, const size_t length, tg_raw *raw, tg_res *res);
+
 /**
  * @brief sendMessage
  * @see Message_free
@@ -170,3 +502,626 @@ Message_s forwardMessage (const char *chat_id, const char *from_chat_id,
 
 /**@}*/
 
+/**
+ * @defgroup group19 Dispatcher
+ * @brief Polling loop handing updates to a pool of worker threads.
+ *
+ * One thread long polls getUpdates and passes each update to a worker. The
+ * updates are split into shards by the id of their chat, or of their sender
+ * if they have no chat, and every shard has a lock free queue that only one
+ * worker drains at a time. Updates of a chat are therefore handled one by
+ * one in the order Telegram sent them, while different chats are handled in
+ * parallel. Each worker drains its own shards first and takes over the
+ * shards of busy workers when it runs out of work, so one slow chat only
+ * holds up the chats of its shard.
+ *
+ * The next poll is sent as soon as a batch is handed to the workers, but
+ * with the offset of the oldest update not handled yet. Telegram thus only
+ * drops handled updates, and updates still being handled are sent again and
+ * skipped by the poller. Delivery is at least once: after a crash, polling
+ * from the last tg_dispatch_offset redelivers every update that wasn't
+ * handled, and possibly some that were. When every update of a poll was
+ * already in flight, the poller waits for the workers before polling again,
+ * at most a second, so new updates of other chats still get through while
+ * a handler is slow.
+ * @{
+ */
+
+/**
+ * @brief Bounds of the polls of the dispatcher.
+ * @see tg_set_dispatch_bounds
+ *
+ * The dispatcher requests as many updates as fit in the queue, no more
+ * than the workers handled in the last second, within the limit bounds.
+ * It long polls with the timeout given to tg_dispatch_start while the
+ * workers are idle and with min_timeout while updates are queued.
+ */
+typedef struct tg_dispatch_bounds
+{
+    //! Fewest updates requested per poll, at least 1
+    size_t min_limit;
+    //! Most updates requested per poll, at most 100
+    size_t max_limit;
+    //! Long poll timeout while updates are queued
+    int min_timeout;
+    //! Updates queued at most, at least min_limit. Polling pauses while the queue is full
+    size_t max_queued;
+} tg_dispatch_bounds;
+
+/**
+ * @brief Sets the bounds of the polls of the dispatcher.
+ * @see tg_dispatch_bounds
+ *
+ * By default a poll requests 1 to 100 updates, uses a timeout of 0 while
+ * updates are queued and keeps at most 1000 updates queued.
+ *
+ * Set this before tg_dispatch_start, it is not synchronized with the
+ * running dispatcher.
+ *
+ * @param bounds Bounds to apply, NULL restores the defaults.
+ */
+void tg_set_dispatch_bounds (const tg_dispatch_bounds *bounds);
+
+/**
+ * @brief Handler of a dispatched update.
+ *
+ * Runs on a worker thread. The update is freed after the handler returns,
+ * along with the rest of its batch once every update of it was handled.
+ *
+ * @param update The update.
+ * @param ctx Context given to tg_dispatch_start.
+ */
+typedef void (*tg_handler) (Update_s *update, void *ctx);
+
+/**
+ * @brief Starts polling and dispatching updates.
+ * @see tg_dispatch_stop
+ *
+ * Updates are polled with getUpdatesFiltered. Failed polls, including those
+ * that ran out of memory, are retried after a second. An update that can
+ * never be parsed, e.g. because it exceeds tg_limits, is skipped and counted
+ * by tg_dispatch_skipped, so it doesn't hold up the ones after it. The
+ * dispatcher is stopped by tg_cleanup.
+ *
+ * @param offset Identifier of the first update to poll.
+ * @param timeout Timeout for long polling while the workers are idle.
+ * @param workers Number of worker threads, at least 1.
+ * @param handler Function handling each update.
+ * @param ctx Context passed to \p handler.
+ * @param res Error object, TG_NOTOKAY if the dispatcher already runs.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_dispatch_start (const long long offset, const int timeout, const size_t workers,
+        tg_handler handler, void *ctx, tg_res *res);
+
+/**
+ * @brief Stops the dispatcher.
+ *
+ * Waits for the running poll to return, which may take up to its timeout,
+ * and for the workers to handle every update polled so far.
+ *
+ * @returns The offset to resume polling from.
+ */
+long long tg_dispatch_stop (void);
+
+/**
+ * @brief Returns the offset every update before which was handled.
+ *
+ * Store it to resume from after a crash, see group19.
+ */
+long long tg_dispatch_offset (void);
+
+/**
+ * @brief Returns how many updates the dispatcher skipped since it started.
+ *
+ * These are the updates that getUpdatesFiltered failed to parse for any
+ * reason but running out of memory. They never reach the handler.
+ */
+size_t tg_dispatch_skipped (void);
+/**@}*/
+
+/**
+ * @defgroup group20 Update journal
+ * @brief Durable log of received updates.
+ *
+ * A journal is a memory mapped file the raw json of each update is
+ * appended to before it is handled. Updates are durable once
+ * tg_journal_append returns, so Telegram can be polled past them right
+ * away, and a checkpoint records up to which update they were handled.
+ * After a crash tg_journal_replay hands back the updates after the
+ * checkpoint instead of polling them again:
+ *
+ *     tg_journal_open (&journal, "bot.journal", &res);
+ *     tg_journal_replay (&journal, handle, ctx, &res);
+ *     while (getUpdatesRaw (tg_journal_offset (&journal), 100, 60, &raw, &res) == 0)
+ *     {
+ *         tg_journal_append (&journal, &raw, &res);
+ *         for (size_t i = 0; i < raw.count; i++)
+ *             handle (raw.updates[i].json, raw.updates[i].update_id, ctx);
+ *         if (raw.count)
+ *             tg_journal_checkpoint (&journal, raw.updates[raw.count - 1].update_id, &res);
+ *         tg_raw_free (&raw);
+ *     }
+ *
+ * Every checkpoint is a sync of the journal, so the loop sets one per
+ * batch rather than per update. A crash in the middle of a batch then
+ * replays the updates of the batch that were already handled, which at
+ * least once delivery allows for.
+ *
+ * Records carry a checksum, so a record torn by a crash ends the journal
+ * when it is opened again. Once the checkpoint reaches the last record the
+ * journal is rewound and its space reused. While handling lags behind,
+ * the records after the checkpoint are moved to the front as soon as the
+ * handled ones before them take more than 512 KiB and more room than they
+ * do. The records thus take at most about twice the size of the updates
+ * not handled yet plus 512 KiB and a batch, and the file, which grows by
+ * doubling, at most twice that or 1 MiB.
+ * @{
+ */
+
+/**
+ * @brief An open journal.
+ * @see tg_journal_open
+ */
+typedef struct tg_journal
+{
+    //! File descriptor of the journal
+    int fd;
+    //! Mapping of the journal
+    unsigned char *map;
+    //! Size of the file and the mapping
+    size_t capacity;
+    //! Start of the first record that may not be handled yet
+    size_t start;
+    //! End of the last record
+    size_t end;
+    //! Identifier of the last record, the checkpoint if there is none
+    long long last_id;
+    //! Identifier of the last handled update
+    long long checkpoint;
+} tg_journal;
+
+/**
+ * @brief Receives the updates of a journal that weren't handled yet.
+ * @see tg_journal_replay
+ *
+ * @param update Json text of the update, valid during the call.
+ * @param update_id Identifier of the update.
+ * @param ctx Context given to tg_journal_replay.
+ */
+typedef void (*tg_replay) (tg_slice update, long long update_id, void *ctx);
+
+/**
+ * @brief Opens a journal, creating it if it doesn't exist.
+ * @see tg_journal_close
+ *
+ * The file is locked with flock while it is open, so a second process or
+ * handle opening the same journal fails instead of interleaving records.
+ *
+ * @param journal Journal to open.
+ * @param path Path of the journal file.
+ * @param res Error object, TG_NOTOKAY if the file can't be opened, locked
+ * or mapped, TG_FORMATFAIL if it isn't a journal.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_journal_open (tg_journal *journal, const char *path, tg_res *res);
+
+/**
+ * @brief Appends the updates of a getUpdatesRaw response to a journal.
+ *
+ * Updates not after the last record are skipped. All records of the call
+ * are flushed to disk with a single sync before it returns.
+ *
+ * @param journal Open journal.
+ * @param raw Response of getUpdatesRaw.
+ * @param res Error object, TG_NOTOKAY if the journal can't be grown or
+ * synced.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_journal_append (tg_journal *journal, const tg_raw *raw, tg_res *res);
+
+/**
+ * @brief Records that every update up to an identifier was handled.
+ *
+ * @param journal Open journal.
+ * @param update_id Identifier of the last handled update.
+ * @param res Error object, TG_NOTOKAY if the checkpoint can't be synced.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_journal_checkpoint (tg_journal *journal, const long long update_id, tg_res *res);
+
+/**
+ * @brief Hands the updates after the checkpoint to a callback, in order.
+ *
+ * The callback may set checkpoints as it goes.
+ *
+ * @param journal Open journal.
+ * @param replay Callback receiving each update.
+ * @param ctx Context passed to \p replay.
+ * @param res Error object.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_journal_replay (tg_journal *journal, tg_replay replay, void *ctx, tg_res *res);
+
+/**
+ * @brief Returns the offset to poll from, past the last journaled update.
+ *
+ * @param journal Open journal.
+ */
+long long tg_journal_offset (const tg_journal *journal);
+
+/**
+ * @brief Closes a journal.
+ *
+ * @param journal Journal to close.
+ */
+void tg_journal_close (tg_journal *journal);
+/**@}*/
+
+/**
+ * @defgroup group21 Update deduplication
+ * @brief Sliding window of seen update identifiers.
+ *
+ * A bitmap of one bit per update_id covers the latest identifiers seen, so
+ * updates delivered again after a restart, a failover or by a second
+ * poller are dropped before they are parsed:
+ *
+ *     tg_seen_init (&seen, 4096, &res);
+ *     updates = getUpdatesFiltered (offset, &limit, 60, tg_seen_filter, &seen, &offset, &res);
+ *     for (size_t i = 0; i < limit; i++)
+ *     {
+ *         handle (&updates[i]);
+ *         tg_seen_mark (&seen, *updates[i].update_id);
+ *     }
+ *
+ * The filter only checks the window. An update is marked once it was
+ * handled, so updates lost to a failed poll or parse come back with the
+ * next poll instead of being dropped as seen.
+ *
+ * The window moves forward with the highest identifier seen. Identifiers
+ * that fell behind it count as already seen, up to one window size behind.
+ * Telegram restarts update_id at a random value after a week without
+ * updates, so an identifier further back is taken as a new sequence: it
+ * passes the filter and marking it restarts the window there. A window
+ * isn't synchronized, use one per poller or guard it.
+ * @{
+ */
+
+/**
+ * @brief Window of seen update identifiers.
+ * @see tg_seen_init
+ */
+typedef struct tg_seen
+{
+    //! Bitmap, word i holds the identifiers 64 * i to 64 * i + 63 modulo the window
+    uint64_t *bits;
+    //! Number of words in the bitmap
+    size_t words;
+    //! Lowest identifier in the window, a multiple of 64
+    long long base;
+    //! Set once the first identifier was seen
+    _Bool started;
+    //! Duplicates dropped within the window
+    unsigned long long duplicates;
+    //! Identifiers dropped for being behind the window
+    unsigned long long expired;
+} tg_seen;
+
+/**
+ * @brief Creates an empty window.
+ * @see tg_seen_free
+ *
+ * @param seen Window to create.
+ * @param window Number of identifiers covered, rounded up to a multiple
+ * of 64.
+ * @param res Error object.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_seen_init (tg_seen *seen, const size_t window, tg_res *res);
+
+/**
+ * @brief Checks an identifier and marks it as seen.
+ *
+ * @param seen Window to check.
+ * @param update_id Identifier of the update.
+ *
+ * @returns 1 if the update is a duplicate or behind the window.
+ */
+_Bool tg_seen_check (tg_seen *seen, const long long update_id);
+
+/**
+ * @brief Marks an identifier as seen.
+ *
+ * Moves the window up if the identifier is past it. Negative identifiers
+ * and those behind the window are ignored.
+ *
+ * @param seen Window to mark in.
+ * @param update_id Identifier of the update.
+ */
+void tg_seen_mark (tg_seen *seen, const long long update_id);
+
+/**
+ * @brief tg_filter dropping duplicate updates.
+ * @see getUpdatesFiltered
+ *
+ * Reads the update_id from the json text without parsing the update and
+ * checks it without marking it, see tg_seen_mark. Updates without one are
+ * accepted.
+ *
+ * @param update Json text of the update.
+ * @param ctx The tg_seen window.
+ *
+ * @returns 1 to keep the update, 0 to drop it.
+ */
+_Bool tg_seen_filter (tg_slice update, void *ctx);
+
+/**
+ * @brief Saves a window to a file.
+ *
+ * The file is written next to \p path, synced and renamed over it, so a
+ * crash leaves either the old or the new window.
+ *
+ * @param seen Window to save.
+ * @param path Path of the file.
+ * @param res Error object, TG_NOTOKAY if the file can't be written.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_seen_save (const tg_seen *seen, const char *path, tg_res *res);
+
+/**
+ * @brief Loads a window saved by tg_seen_save.
+ * @see tg_seen_free
+ *
+ * @param seen Window to create.
+ * @param path Path of the file.
+ * @param res Error object, TG_NOTOKAY if the file can't be read,
+ * TG_FORMATFAIL if it isn't a saved window.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_seen_load (tg_seen *seen, const char *path, tg_res *res);
+
+/**
+ * @brief Frees a window.
+ *
+ * @param seen Window to free.
+ */
+void tg_seen_free (tg_seen *seen);
+/**@}*/
+
+/**
+ * @defgroup group22 Shared memory rings
+ * @brief Hands updates to other processes through shared memory.
+ *
+ * A POSIX shared memory segment holds one bounded ring per consumer
+ * process. A poller pushes the raw json of each update, or any other
+ * bytes such as an update_to_flat encoding, into the ring of the consumer
+ * its chat hashes to, and the consumer reads it in place from the segment
+ * and releases the slot when done. Nothing is copied through the kernel.
+ *
+ * Each ring is a lock free queue that takes several producers and several
+ * consumers, so a consumer may run several readers on its ring. Updates of
+ * a chat always go to the same ring and leave it in order, but readers
+ * sharing a ring may handle them concurrently.
+ *
+ * The segment must be created by one process before others attach to it.
+ * @{
+ */
+
+/**
+ * @brief A mapped shared memory segment.
+ * @see tg_shm_create tg_shm_attach
+ */
+typedef struct tg_shm
+{
+    //! Start of the mapping
+    unsigned char *map;
+    //! Size of the mapping
+    size_t size;
+    //! Number of consumer rings
+    size_t consumers;
+    //! Slots per ring
+    size_t slots;
+    //! Bytes a slot holds
+    size_t slot_size;
+} tg_shm;
+
+/**
+ * @brief A message read from a ring.
+ * @see tg_shm_pop tg_shm_release
+ */
+typedef struct tg_shm_msg
+{
+    //! Bytes of the message, inside the segment
+    tg_slice data;
+    //! Slot holding the message
+    void *slot;
+    //! Position of the slot in its ring
+    size_t pos;
+} tg_shm_msg;
+
+/**
+ * @brief Creates a segment.
+ * @see tg_shm_detach tg_shm_unlink
+ *
+ * @param shm Segment to create.
+ * @param name Name of the segment, starting with a slash.
+ * @param consumers Number of consumer rings.
+ * @param slots Slots per ring, rounded up to a power of 2.
+ * @param slot_size Largest message a slot holds, less than 4 GiB.
+ * @param res Error object, TG_NOTOKAY if the segment exists or can't be
+ * created, TG_LIMITFAIL if \p slot_size is too large or the rings don't
+ * fit in memory.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_shm_create (tg_shm *shm, const char *name, const size_t consumers, const size_t slots,
+        const size_t slot_size, tg_res *res);
+
+/**
+ * @brief Attaches to a segment created by another process.
+ * @see tg_shm_detach
+ *
+ * @param shm Segment to attach.
+ * @param name Name given to tg_shm_create.
+ * @param res Error object, TG_NOTOKAY if the segment can't be opened,
+ * TG_FORMATFAIL if it isn't a ring segment or isn't ready yet.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_shm_attach (tg_shm *shm, const char *name, tg_res *res);
+
+/**
+ * @brief Pushes a message to the ring of a consumer.
+ *
+ * @param shm Attached segment.
+ * @param consumer Index of the consumer.
+ * @param data Bytes of the message.
+ * @param length Length of \p data.
+ * @param res Error object, TG_LIMITFAIL if the message exceeds the slot
+ * size, TG_NOTOKAY if the ring is full.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_shm_push_to (tg_shm *shm, const size_t consumer, const void *data, const size_t length,
+        tg_res *res);
+
+/**
+ * @brief Returns the consumer an update is routed to.
+ *
+ * Updates go to the consumer their chat hashes to. Updates without a chat
+ * are routed by their sender, and by their update_id if they have neither.
+ *
+ * @param shm Attached segment.
+ * @param update Json text of the update.
+ */
+size_t tg_shm_consumer (const tg_shm *shm, tg_slice update);
+
+/**
+ * @brief Pushes an update to the ring of the consumer it is routed to.
+ * @see tg_shm_consumer
+ *
+ * Waits up to a second while the ring is full. When it stays full, the
+ * consumer tg_shm_consumer returns for \p update is stuck or dead, and the
+ * ring is marked stalled: later pushes to it fail at once instead of
+ * holding up the poller again, until the ring takes a message. A reader
+ * that died between tg_shm_pop and tg_shm_release keeps its slot, so its
+ * ring stays stalled until the segment is created again.
+ *
+ * @param shm Attached segment.
+ * @param update Json text of the update, e.g. from getUpdatesRaw.
+ * @param res Error object, TG_LIMITFAIL if the update exceeds the slot
+ * size, TG_NOTOKAY if the ring stayed full or is stalled.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_shm_push (tg_shm *shm, tg_slice update, tg_res *res);
+
+/**
+ * @brief Takes the next message of a ring without waiting.
+ *
+ * Messages claiming to be longer than a slot, which only a corrupt
+ * segment holds, are dropped.
+ *
+ * @param shm Attached segment.
+ * @param consumer Index of the ring.
+ * @param msg Set to the message, to be released with tg_shm_release.
+ *
+ * @returns 1 if a message was taken, 0 if the ring is empty.
+ */
+_Bool tg_shm_pop (tg_shm *shm, const size_t consumer, tg_shm_msg *msg);
+
+/**
+ * @brief Hands the slot of a message back to the producers.
+ *
+ * @param shm Attached segment.
+ * @param msg Message from tg_shm_pop, its data is invalid afterwards.
+ */
+void tg_shm_release (tg_shm *shm, tg_shm_msg *msg);
+
+/**
+ * @brief Unmaps a segment.
+ *
+ * @param shm Segment to detach.
+ */
+void tg_shm_detach (tg_shm *shm);
+
+/**
+ * @brief Removes a segment once every process detached.
+ *
+ * @param name Name given to tg_shm_create.
+ */
+void tg_shm_unlink (const char *name);
+/**@}*/
+
+
+/**
+ * @defgroup group23 Webhook
+ * @brief Receives updates pushed by Telegram instead of polling for them.
+ *
+ * An embedded HTTP/1.1 server accepts the updates Telegram posts to the
+ * webhook set with setWebhook. Every server thread listens on its own
+ * socket bound to the same port with SO_REUSEPORT, so the kernel spreads
+ * the connections over the threads, and serves its connections from one
+ * epoll loop. Connections are kept alive between requests.
+ *
+ * The body of each request is parsed in place from the receive buffer by
+ * update_parse_raw and passed to the same tg_handler as the dispatcher, on
+ * the thread that received it. No jansson tree is built unless lazy parsing
+ * or shared objects are on, see tg_set_lazy and tg_set_dedup. Telegram is
+ * answered once the handler returns and sends the update again if it gets
+ * no answer, so delivery is at least once. A slow handler holds up the
+ * other connections of its thread; hand long work to a queue such as
+ * tg_shm.
+ *
+ * Only failures that may pass are answered with 500, so Telegram retries
+ * them: running out of memory. A body that isn't an update is answered
+ * with 400, and an update exceeding the tg_limits is answered with 200 and
+ * dropped, since retrying either would fail the same way.
+ *
+ * A thread keeps at most 1024 connections open. At that limit, or when the
+ * process runs out of descriptors, it stops accepting for a second and new
+ * connections wait in the backlog of its socket.
+ *
+ * Telegram only posts to HTTPS webhooks, put a TLS terminating proxy in
+ * front of the server.
+ * @{
+ */
+
+/**
+ * @brief Starts the webhook server.
+ * @see tg_webhook_stop
+ *
+ * The server is stopped by tg_cleanup.
+ *
+ * @param address IPv4 address to listen on, NULL for every address.
+ * @param port Port to listen on.
+ * @param secret Secret token given to setWebhook, requests without it in
+ * X-Telegram-Bot-Api-Secret-Token are refused. NULL accepts every request.
+ * @param threads Number of server threads, at least 1.
+ * @param handler Function handling each update.
+ * @param ctx Context passed to \p handler.
+ * @param res Error object, TG_NOTOKAY if the server already runs or can't
+ * listen on the address, TG_LIMITFAIL if the secret exceeds 256 bytes.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_webhook_start (const char *address, const unsigned short port, const char *secret,
+        const size_t threads, tg_handler handler, void *ctx, tg_res *res);
+
+/**
+ * @brief Stops the webhook server.
+ *
+ * Waits for the running handlers to return and closes every connection.
+ * Does nothing when called from a handler, which would wait for itself;
+ * signal another thread to stop the server instead.
+ */
+void tg_webhook_stop (void);
+/**@}*/
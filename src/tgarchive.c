@@ -0,0 +1,592 @@
+#include <stdio.h>
+#include <string.h>
+#include <jansson.h>
+#include "tgschema.h"
+
+/**
+ * @file
+ * @brief Column chunked archives of updates.
+ */
+
+//! Columns holding json_int_t values
+#define ARCHIVE_INTS (TG_BIT (TG_COLUMN_UPDATE_ID) | TG_BIT (TG_COLUMN_CHAT_ID)\
+    | TG_BIT (TG_COLUMN_FROM_ID) | TG_BIT (TG_COLUMN_MESSAGE_ID) | TG_BIT (TG_COLUMN_DATE))
+
+//! Columns holding one byte per row
+#define ARCHIVE_BYTES (TG_BIT (TG_COLUMN_TYPE) | TG_BIT (TG_COLUMN_CHAT_TYPE))
+
+//! Most chunks a row group may have, one per column id
+#define ARCHIVE_CHUNKS 256
+
+/**
+ * @brief Read position in a chunk.
+ */
+typedef struct archive_in
+{
+    //! Next byte to read
+    const unsigned char *pos;
+    //! End of the chunk
+    const unsigned char *end;
+} archive_in;
+
+/*
+ * Returns the json_int_t column of a tgcolumn.
+ */
+
+json_int_t **archive_int_column (tg_columns *cols, int column)
+{
+    switch (column)
+    {
+        case TG_COLUMN_UPDATE_ID: return &cols->update_id;
+        case TG_COLUMN_CHAT_ID: return &cols->chat_id;
+        case TG_COLUMN_FROM_ID: return &cols->from_id;
+        case TG_COLUMN_MESSAGE_ID: return &cols->message_id;
+        default: return &cols->date;
+    }
+}
+
+_Bool archive_varint (tg_buffer *buf, uint64_t value, tg_res *res)
+{
+    char bytes[10];
+    size_t length = 0;
+
+    do
+    {
+        bytes[length++] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+        value >>= 7;
+    } while (value);
+
+    return buffer_put (buf, bytes, length, res);
+}
+
+_Bool archive_get (archive_in *in, uint64_t *value)
+{
+    unsigned int shift = 0;
+
+    *value = 0;
+
+    while (in->pos < in->end && shift < 64)
+    {
+        *value |= (uint64_t)(*in->pos & 0x7f) << shift;
+        if (!(*in->pos++ & 0x80))
+            return 0;
+        shift += 7;
+    }
+
+    return 1;
+}
+
+/*
+ * Reads a varint straight from the file.
+ */
+
+_Bool archive_read_varint (FILE *file, uint64_t *value)
+{
+    unsigned int shift = 0;
+    int c;
+
+    *value = 0;
+
+    while (shift < 64 && (c = getc (file)) != EOF)
+    {
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 0;
+        shift += 7;
+    }
+
+    return 1;
+}
+
+/*
+ * Ids are mostly close to the previous row, so deltas are zigzag encoded to
+ * keep small negative steps short.
+ */
+
+_Bool archive_put_ints (tg_buffer *buf, const json_int_t *column, size_t count, tg_res *res)
+{
+    uint64_t prev = 0, delta;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        delta = (uint64_t) column[i] - prev;
+        prev = column[i];
+
+        if (archive_varint (buf, (delta << 1) ^ (0 - (delta >> 63)), res))
+            return 1;
+    }
+
+    return 0;
+}
+
+_Bool archive_get_ints (archive_in *in, json_int_t *column, size_t count)
+{
+    uint64_t prev = 0, zigzag;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (archive_get (in, &zigzag))
+            return 1;
+
+        prev += (zigzag >> 1) ^ (0 - (zigzag & 1));
+        column[i] = prev;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the dictionary of the tgstr values in types followed by the
+ * dictionary index of each value, 0 for unknown values.
+ */
+
+_Bool archive_put_dict (tg_buffer *buf, const unsigned char *types, size_t count, tg_res *res)
+{
+    unsigned int index[TG_STR_COUNT] = { 0 }, used = 0;
+
+    for (size_t i = 0; i < count; i++)
+        if (types[i] < TG_STR_COUNT && !index[types[i]])
+            index[types[i]] = ++used;
+
+    if (archive_varint (buf, used, res))
+        return 1;
+
+    for (unsigned int i = 1; i <= used; i++)
+    {
+        for (int str = 0; str < TG_STR_COUNT; str++)
+        {
+            if (index[str] != i)
+                continue;
+
+            if (archive_varint (buf, strlen (tg_strings[str]), res)
+                    || buffer_put (buf, tg_strings[str], strlen (tg_strings[str]), res))
+                return 1;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+        if (archive_varint (buf, types[i] < TG_STR_COUNT ? index[types[i]] : 0, res))
+            return 1;
+
+    return 0;
+}
+
+/*
+ * Reads a dictionary into the tgstr of each of its entries.
+ */
+
+_Bool archive_get_dict (archive_in *in, unsigned char *dict, uint64_t *size)
+{
+    char str[64];
+    uint64_t length;
+
+    if (archive_get (in, size) || *size > 255)
+        return 1;
+
+    dict[0] = TG_STR_COUNT;
+
+    for (uint64_t i = 1; i <= *size; i++)
+    {
+        if (archive_get (in, &length) || length > (size_t)(in->end - in->pos))
+            return 1;
+
+        /* Strings the library doesn't know decode as unknown */
+        if (length < sizeof (str))
+        {
+            memcpy (str, in->pos, length);
+            str[length] = '\0';
+            dict[i] = tg_str_id (str);
+        }
+        else
+            dict[i] = TG_STR_COUNT;
+
+        in->pos += length;
+    }
+
+    return 0;
+}
+
+_Bool archive_get_types (archive_in *in, const unsigned char *dict, uint64_t size,
+        unsigned char *types, size_t count)
+{
+    uint64_t index;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (archive_get (in, &index) || index > size)
+            return 1;
+        types[i] = dict[index];
+    }
+
+    return 0;
+}
+
+/*
+ * Appends the chunk of a column to a row group.
+ */
+
+_Bool archive_put_column (tg_buffer *group, tg_buffer *chunk, const tg_columns *cols, int column,
+        tg_res *res)
+{
+    char id = column;
+    size_t count = cols->count;
+
+    chunk->size = 0;
+
+    switch (column)
+    {
+        case TG_COLUMN_TYPE:
+            if (buffer_put (chunk, (const char *) cols->type, count, res))
+                return 1;
+            break;
+
+        case TG_COLUMN_CHAT_TYPE:
+            if (archive_put_dict (chunk, cols->chat_type, count, res))
+                return 1;
+            break;
+
+        case TG_COLUMN_TEXT:
+            for (size_t i = 0; i < count; i++)
+                if (archive_varint (chunk, cols->text_offset[i + 1] - cols->text_offset[i], res))
+                    return 1;
+            if (buffer_put (chunk, cols->text, cols->text_offset[count], res))
+                return 1;
+            break;
+
+        case TG_COLUMN_ENTITY_TYPE:
+            for (size_t i = 0; i < count; i++)
+                if (archive_varint (chunk, cols->entity_offset[i + 1] - cols->entity_offset[i], res))
+                    return 1;
+            if (archive_put_dict (chunk, cols->entity_type, cols->entity_offset[count], res))
+                return 1;
+            break;
+
+        default:
+            if (archive_put_ints (chunk, *archive_int_column ((tg_columns *) cols, column), count, res))
+                return 1;
+    }
+
+    return buffer_put (group, &id, 1, res) || archive_varint (group, chunk->size, res)
+        || buffer_put (group, chunk->data, chunk->size, res);
+}
+
+_Bool tg_archive_append (const char *path, Update_s *api_s, size_t count, tg_res *res)
+{
+    tg_buffer group = { NULL }, chunk = { NULL };
+    tg_columns cols;
+    FILE *file;
+    _Bool failed = 1;
+
+    if (!count)
+        return 0;
+
+    if (update_columns (api_s, count, &cols, res))
+        return 1;
+
+    if (archive_varint (&group, count, res) || archive_varint (&group, TG_COLUMN_COUNT, res))
+        goto done;
+
+    for (int column = 0; column < TG_COLUMN_COUNT; column++)
+        if (archive_put_column (&group, &chunk, &cols, column, res))
+            goto done;
+
+    file = fopen (path, "ab");
+    if (!file)
+    {
+        res->ok = TG_NOTOKAY;
+        goto done;
+    }
+
+    /* A new archive starts with the magic */
+    fseek (file, 0, SEEK_END);
+    failed = (ftell (file) == 0 && fwrite (TG_ARCHIVE_MAGIC, 4, 1, file) != 1)
+        || fwrite (group.data, group.size, 1, file) != 1;
+    failed |= fclose (file) != 0;
+
+    if (failed)
+        res->ok = TG_NOTOKAY;
+
+done:
+    tg_buffer_free (&group);
+    tg_buffer_free (&chunk);
+    tg_columns_free (&cols);
+    return failed;
+}
+
+_Bool tg_archive_open (tg_archive *archive, const char *path, tg_res *res)
+{
+    char magic[4];
+
+    archive->file = fopen (path, "rb");
+    if (!archive->file)
+    {
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    if (fread (magic, 4, 1, archive->file) != 1 || memcmp (magic, TG_ARCHIVE_MAGIC, 4))
+    {
+        tg_archive_close (archive);
+        res->ok = TG_FORMATFAIL;
+        return 1;
+    }
+
+    return 0;
+}
+
+void tg_archive_close (tg_archive *archive)
+{
+    if (archive->file)
+        fclose (archive->file);
+
+    archive->file = NULL;
+}
+
+/*
+ * Adds count values of width bytes to size. Returns 1 if it overflows.
+ */
+
+_Bool archive_grow (size_t *size, size_t count, size_t width)
+{
+    return __builtin_mul_overflow (count, width, &count) || __builtin_add_overflow (*size, count, size);
+}
+
+/*
+ * Sizes the columns of a row group from its chunks. The totals of the
+ * text and entity chunks are only known after reading their lengths.
+ */
+
+_Bool archive_layout (archive_in *chunks, uint64_t columns, size_t count, size_t *text_size,
+        size_t *entity_count)
+{
+    archive_in in;
+    uint64_t length;
+    size_t *total;
+
+    *text_size = *entity_count = 0;
+
+    for (int column = TG_COLUMN_TEXT; column <= TG_COLUMN_ENTITY_TYPE; column++)
+    {
+        if (!(columns & TG_BIT (column)))
+            continue;
+
+        total = column == TG_COLUMN_TEXT ? text_size : entity_count;
+        in = chunks[column];
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (archive_get (&in, &length) || length > SIZE_MAX
+                    || archive_grow (total, length, 1))
+                return 1;
+        }
+
+        /* Every text byte and entity index takes at least a byte of what follows */
+        if (*total > (size_t)(in.end - in.pos))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Decodes the projected chunks into columns laid out like update_columns.
+ */
+
+_Bool archive_decode (archive_in *chunks, uint64_t columns, size_t count, tg_columns *cols,
+        tg_res *res)
+{
+    unsigned char dict[256];
+    uint64_t dict_size, length;
+    size_t text_size, entity_count, size = 0;
+    archive_in *in;
+    char *block;
+
+    if (archive_layout (chunks, columns, count, &text_size, &entity_count))
+        goto malformed;
+
+    for (int column = 0; column < TG_COLUMN_COUNT; column++)
+        if ((columns & TG_BIT (column) & ARCHIVE_INTS) && archive_grow (&size, count, sizeof (json_int_t)))
+            goto malformed;
+
+    if (((columns & TG_BIT (TG_COLUMN_TEXT))
+                && (archive_grow (&size, count + 1, sizeof (size_t)) || archive_grow (&size, text_size, 1)))
+            || ((columns & TG_BIT (TG_COLUMN_ENTITY_TYPE))
+                && (archive_grow (&size, count + 1, sizeof (size_t)) || archive_grow (&size, entity_count, 1)))
+            || ((columns & TG_BIT (TG_COLUMN_TYPE)) && archive_grow (&size, count, 1))
+            || ((columns & TG_BIT (TG_COLUMN_CHAT_TYPE)) && archive_grow (&size, count, 1)))
+        goto malformed;
+
+    block = tg_malloc (size ? size : 1);
+    if (!block)
+    {
+        res->ok = TG_ALLOCFAIL;
+        return 1;
+    }
+
+    *cols = (tg_columns){ count, .block = block };
+
+    /* Word sized columns first, so every column stays aligned */
+    for (int column = 0; column < TG_COLUMN_COUNT; column++)
+    {
+        if (!(columns & TG_BIT (column) & ARCHIVE_INTS))
+            continue;
+
+        *archive_int_column (cols, column) = (json_int_t *) block;
+        block += sizeof (json_int_t) * count;
+
+        if (archive_get_ints (&chunks[column], *archive_int_column (cols, column), count))
+            goto malformed;
+    }
+
+    if (columns & TG_BIT (TG_COLUMN_TEXT))
+    {
+        cols->text_offset = (size_t *) block;
+        block += sizeof (size_t) * (count + 1);
+    }
+
+    if (columns & TG_BIT (TG_COLUMN_ENTITY_TYPE))
+    {
+        cols->entity_offset = (size_t *) block;
+        block += sizeof (size_t) * (count + 1);
+    }
+
+    if (columns & TG_BIT (TG_COLUMN_TYPE))
+    {
+        cols->type = (unsigned char *) block;
+        block += count;
+        memcpy (cols->type, chunks[TG_COLUMN_TYPE].pos, count);
+        for (size_t i = 0; i < count; i++)
+            if (cols->type[i] > TG_UPDATE_COUNT)
+                goto malformed;
+    }
+
+    if (columns & TG_BIT (TG_COLUMN_CHAT_TYPE))
+    {
+        cols->chat_type = (unsigned char *) block;
+        block += count;
+        in = &chunks[TG_COLUMN_CHAT_TYPE];
+        if (archive_get_dict (in, dict, &dict_size)
+                || archive_get_types (in, dict, dict_size, cols->chat_type, count))
+            goto malformed;
+    }
+
+    if (columns & TG_BIT (TG_COLUMN_ENTITY_TYPE))
+    {
+        cols->entity_type = (unsigned char *) block;
+        block += entity_count;
+        in = &chunks[TG_COLUMN_ENTITY_TYPE];
+        cols->entity_offset[0] = 0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            archive_get (in, &length);
+            cols->entity_offset[i + 1] = cols->entity_offset[i] + length;
+        }
+
+        if (archive_get_dict (in, dict, &dict_size)
+                || archive_get_types (in, dict, dict_size, cols->entity_type, entity_count))
+            goto malformed;
+    }
+
+    if (columns & TG_BIT (TG_COLUMN_TEXT))
+    {
+        cols->text = block;
+        in = &chunks[TG_COLUMN_TEXT];
+        cols->text_offset[0] = 0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            archive_get (in, &length);
+            cols->text_offset[i + 1] = cols->text_offset[i] + length;
+        }
+
+        memcpy (cols->text, in->pos, text_size);
+    }
+
+    return 0;
+
+malformed:
+    tg_columns_free (cols);
+    res->ok = TG_FORMATFAIL;
+    return 1;
+}
+
+_Bool tg_archive_next (tg_archive *archive, uint64_t columns, tg_columns *cols, tg_res *res)
+{
+    archive_in chunks[TG_COLUMN_COUNT] = { { NULL } };
+    unsigned char *data[TG_COLUMN_COUNT] = { NULL };
+    uint64_t count, chunk_count, length;
+    uint64_t found = 0;
+    long pos, end;
+    int id;
+    _Bool failed = 1;
+
+    *cols = (tg_columns){ 0 };
+
+    /* A clean end of file ends the archive */
+    if ((id = getc (archive->file)) == EOF)
+        return 0;
+
+    ungetc (id, archive->file);
+
+    /* Chunk lengths are checked against the rest of the file before use */
+    if ((pos = ftell (archive->file)) < 0 || fseek (archive->file, 0, SEEK_END)
+            || (end = ftell (archive->file)) < 0 || fseek (archive->file, pos, SEEK_SET))
+        goto malformed;
+
+    /* Column ids are bytes, so a row group has at most one chunk per id */
+    if (archive_read_varint (archive->file, &count) || archive_read_varint (archive->file, &chunk_count)
+            || chunk_count > ARCHIVE_CHUNKS)
+        goto malformed;
+
+    for (uint64_t i = 0; i < chunk_count; i++)
+    {
+        if ((id = getc (archive->file)) == EOF || archive_read_varint (archive->file, &length)
+                || (pos = ftell (archive->file)) < 0 || length > (uint64_t)(end - pos))
+            goto malformed;
+
+        /* Columns outside the projection, or unknown ones, are never read */
+        if (id >= TG_COLUMN_COUNT || !(columns & TG_BIT (id)) || data[id])
+        {
+            if (fseek (archive->file, length, SEEK_CUR))
+                goto malformed;
+            continue;
+        }
+
+        data[id] = tg_malloc (length ? length : 1);
+        if (!data[id])
+        {
+            res->ok = TG_ALLOCFAIL;
+            goto done;
+        }
+
+        if (length && fread (data[id], length, 1, archive->file) != 1)
+            goto malformed;
+
+        chunks[id] = (archive_in){ data[id], data[id] + length };
+        found |= TG_BIT (id);
+    }
+
+    columns &= TG_BIT (TG_COLUMN_COUNT) - 1;
+
+    if (found != columns || count > SIZE_MAX || ((columns & TG_BIT (TG_COLUMN_TYPE))
+                && (uint64_t)(chunks[TG_COLUMN_TYPE].end - chunks[TG_COLUMN_TYPE].pos) != count))
+        goto malformed;
+
+    /* Every column takes at least a byte per row, which bounds the count by the file */
+    for (int i = 0; i < TG_COLUMN_COUNT; i++)
+        if ((columns & TG_BIT (i)) && count > (uint64_t)(chunks[i].end - chunks[i].pos))
+            goto malformed;
+
+    failed = archive_decode (chunks, columns, count, cols, res);
+    goto done;
+
+malformed:
+    res->ok = TG_FORMATFAIL;
+
+done:
+    for (int i = 0; i < TG_COLUMN_COUNT; i++)
+        tg_free (data[i]);
+
+    return failed;
+}
@@ -0,0 +1,178 @@
+#include <string.h>
+#include <jansson.h>
+#include "tgapi.h"
+
+/**
+ * @file
+ * @brief Columnar view over batches of updates.
+ */
+
+//! Number of json_int_t columns
+#define COLUMN_INTS 5
+
+/*
+ * Returns the type of an update, TG_UPDATE_COUNT if it has no known object.
+ */
+
+tgupdate column_type (const Update_s *update)
+{
+    if (update->message)
+        return TG_UPDATE_MESSAGE;
+    if (update->edited_message)
+        return TG_UPDATE_EDITED_MESSAGE;
+    if (update->channel_post)
+        return TG_UPDATE_CHANNEL_POST;
+    if (update->edited_channel_post)
+        return TG_UPDATE_EDITED_CHANNEL_POST;
+    if (update->inline_query)
+        return TG_UPDATE_INLINE_QUERY;
+    if (update->chosen_inline_result)
+        return TG_UPDATE_CHOSEN_INLINE_RESULT;
+    if (update->callback_query)
+        return TG_UPDATE_CALLBACK_QUERY;
+
+    return TG_UPDATE_COUNT;
+}
+
+/*
+ * Returns the message of an update, the message a callback query belongs
+ * to included.
+ */
+
+Message_s *column_message (const Update_s *update)
+{
+    switch (column_type (update))
+    {
+        case TG_UPDATE_MESSAGE: return update->message;
+        case TG_UPDATE_EDITED_MESSAGE: return update->edited_message;
+        case TG_UPDATE_CHANNEL_POST: return update->channel_post;
+        case TG_UPDATE_EDITED_CHANNEL_POST: return update->edited_channel_post;
+        case TG_UPDATE_CALLBACK_QUERY: return update->callback_query->message;
+        default: return NULL;
+    }
+}
+
+/*
+ * Returns the sender of the object of an update.
+ */
+
+User_s *column_from (const Update_s *update, Message_s *message, tg_res *res)
+{
+    switch (column_type (update))
+    {
+        case TG_UPDATE_INLINE_QUERY: return update->inline_query->from;
+        case TG_UPDATE_CHOSEN_INLINE_RESULT: return update->chosen_inline_result->from;
+        case TG_UPDATE_CALLBACK_QUERY: return update->callback_query->from;
+        case TG_UPDATE_COUNT: return NULL;
+        default: return message_from (message, res);
+    }
+}
+
+json_int_t column_int (const json_int_t *value)
+{
+    return value ? *value : 0;
+}
+
+_Bool update_columns (Update_s *api_s, size_t count, tg_columns *cols, tg_res *res)
+{
+    size_t text_size = 0, entity_count = 0, size;
+    Message_s *message;
+    MessageEntity_s *entities;
+    Chat_s *chat;
+    User_s *from;
+    char *block;
+
+    *cols = (tg_columns){ 0 };
+
+    for (size_t i = 0; i < count; i++)
+    {
+        message = column_message (&api_s[i]);
+        if (message && message->text)
+            text_size += strlen (message->text);
+        if (message && message_entities (message, res))
+            entity_count += message->entities_len;
+    }
+
+    /* A lazy member that failed to parse would be read as missing */
+    if (res->ok != TG_OKAY)
+        return 1;
+
+    /* Word sized columns first, so every column stays aligned */
+    size = sizeof (json_int_t) * COLUMN_INTS * count + sizeof (size_t) * (count + 1) * 2
+        + count * 2 + entity_count + text_size;
+
+    block = tg_malloc (size);
+    if (!block)
+    {
+        res->ok = TG_ALLOCFAIL;
+        return 1;
+    }
+
+    cols->count = count;
+    cols->block = block;
+    cols->update_id = (json_int_t *) block;
+    cols->chat_id = cols->update_id + count;
+    cols->from_id = cols->chat_id + count;
+    cols->message_id = cols->from_id + count;
+    cols->date = cols->message_id + count;
+    cols->text_offset = (size_t *)(cols->date + count);
+    cols->entity_offset = cols->text_offset + count + 1;
+    cols->type = (unsigned char *)(cols->entity_offset + count + 1);
+    cols->chat_type = cols->type + count;
+    cols->entity_type = cols->chat_type + count;
+    cols->text = (char *)(cols->entity_type + entity_count);
+
+    cols->text_offset[0] = 0;
+    cols->entity_offset[0] = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        message = column_message (&api_s[i]);
+        chat = message ? message_chat (message, res) : NULL;
+        from = column_from (&api_s[i], message, res);
+
+        cols->update_id[i] = column_int (api_s[i].update_id);
+        cols->type[i] = column_type (&api_s[i]);
+        cols->chat_id[i] = chat ? column_int (chat->id) : 0;
+        cols->chat_type[i] = chat && chat->type ? tg_str_id (chat->type) : TG_STR_COUNT;
+        cols->from_id[i] = from ? column_int (from->id) : 0;
+        cols->message_id[i] = message ? column_int (message->message_id) : 0;
+        cols->date[i] = message ? column_int (message->date) : 0;
+
+        size = message && message->text ? strlen (message->text) : 0;
+        memcpy (cols->text + cols->text_offset[i], size ? message->text : "", size);
+        cols->text_offset[i + 1] = cols->text_offset[i] + size;
+
+        entities = message ? message->entities : NULL;
+        size = entities ? message->entities_len : 0;
+        for (size_t j = 0; j < size; j++)
+            cols->entity_type[cols->entity_offset[i] + j] =
+                entities[j].type ? tg_str_id (entities[j].type) : TG_STR_COUNT;
+        cols->entity_offset[i + 1] = cols->entity_offset[i] + size;
+    }
+
+    if (res->ok != TG_OKAY)
+    {
+        tg_columns_free (cols);
+        return 1;
+    }
+
+    return 0;
+}
+
+void tg_columns_free (tg_columns *cols)
+{
+    tg_free (cols->block);
+    *cols = (tg_columns){ 0 };
+}
+
+size_t tg_column_count (const json_int_t *column, size_t count, json_int_t value)
+{
+    size_t matches = 0;
+
+    /* Branch free so the loop vectorizes */
+    for (size_t i = 0; i < count; i++)
+        matches += column[i] == value;
+
+    return matches;
+}
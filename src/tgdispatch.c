@@ -0,0 +1,669 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <jansson.h>
+#include "tgapi.h"
+
+/**
+ * @file
+ * @brief Poller and worker pool dispatching updates by chat.
+ */
+
+//! Entries of a shard queue, a power of two
+#define DISPATCH_RING 1024
+
+//! Shards per worker, more shards let idle workers take over more work
+#define DISPATCH_SHARDS 4
+
+//! Most updates Telegram returns per poll
+#define DISPATCH_LIMIT 100
+
+//! Updates queued at most by default
+#define DISPATCH_QUEUED 1000
+
+//! Weight of the latest measurement in the handling rate
+#define DISPATCH_RATE_WEIGHT 0.5
+
+//! Updates a worker handles from a shard before looking at the others
+#define DISPATCH_RUN 16
+
+//! Seconds to wait after a failed poll
+#define DISPATCH_BACKOFF 1
+
+//! Seconds to wait for the watermark when a poll brought nothing new
+#define DISPATCH_STALE 1
+
+/**
+ * @brief Updates of one poll, freed once all of them were handled.
+ */
+typedef struct dispatch_batch
+{
+    //! The updates
+    Update_s *updates;
+    //! Number of updates
+    size_t count;
+    //! Updates not handled yet
+    size_t remaining;
+    //! Identifier of the first update dispatched from the batch
+    long long first_id;
+    //! Set once every dispatched update was handled
+    _Bool finished;
+    //! Next batch in poll order
+    struct dispatch_batch *next;
+} dispatch_batch;
+
+/**
+ * @brief Queued update.
+ */
+typedef struct dispatch_item
+{
+    //! The update
+    Update_s *update;
+    //! Batch it belongs to
+    dispatch_batch *batch;
+} dispatch_item;
+
+/**
+ * @brief Single producer queue of a shard.
+ *
+ * The poller is the only producer. Consumers take turns through owner, so
+ * the queue has a single consumer at any time and keeps its order.
+ */
+typedef struct dispatch_shard
+{
+    //! Next entry to consume
+    size_t head;
+    //! Keeps the producer and consumer indexes on separate cache lines
+    char head_pad[64];
+    //! Next entry to produce
+    size_t tail;
+    //! Keeps the owner off the producer's cache line
+    char tail_pad[64];
+    //! Set while a worker drains the shard
+    int owner;
+    //! Queued updates
+    dispatch_item items[DISPATCH_RING];
+} dispatch_shard;
+
+/**
+ * @brief State of the dispatcher.
+ */
+struct dispatcher
+{
+    //! Guards sleeping workers and the running state
+    pthread_mutex_t lock;
+    //! Signaled when posted is bumped or the dispatcher stops
+    pthread_cond_t work;
+    //! Signaled when the watermark advances or the dispatcher stops
+    pthread_cond_t progress;
+    //! Set while the dispatcher runs
+    _Bool running;
+    //! Set to stop the poller
+    int stop;
+    //! Set once the poller stopped, the workers leave when no shard is left to drain
+    int done;
+    //! The poller
+    pthread_t poller;
+    //! The workers
+    pthread_t *threads;
+    //! Number of workers
+    size_t count;
+    //! The shards
+    dispatch_shard *shards;
+    //! Number of shards
+    size_t shard_count;
+    //! Bumped whenever a shard may have become free to drain
+    size_t posted;
+    //! Updates queued and not yet handled
+    size_t queued;
+    //! Updates handled since the start
+    size_t handled;
+    //! Updates skipped since the start because they can't be parsed
+    size_t skipped;
+    //! Bounds of the polls
+    tg_dispatch_bounds bounds;
+    //! Every update before it was handled, the offset of the next poll
+    long long watermark;
+    //! One past the last dispatched update
+    long long next_id;
+    //! Batches in flight, oldest first
+    dispatch_batch *oldest;
+    //! Newest batch in flight
+    dispatch_batch *newest;
+    //! Timeout of the polls
+    int timeout;
+    //! Update handler
+    tg_handler handler;
+    //! Context of the handler
+    void *ctx;
+} dispatcher = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    .bounds = { 1, DISPATCH_LIMIT, 0, DISPATCH_QUEUED } };
+
+/**
+ * @brief Measured handling rate of the workers.
+ */
+typedef struct dispatch_rate
+{
+    //! Updates handled per second, 0 until measured
+    double per_second;
+    //! Time of the last measurement
+    struct timespec when;
+    //! tg_dispatcher.handled at the last measurement
+    size_t handled;
+} dispatch_rate;
+
+void tg_set_dispatch_bounds (const tg_dispatch_bounds *bounds)
+{
+    dispatcher.bounds = bounds ? *bounds : (tg_dispatch_bounds){ 1, DISPATCH_LIMIT, 0, DISPATCH_QUEUED };
+
+    if (!dispatcher.bounds.min_limit)
+        dispatcher.bounds.min_limit = 1;
+    if (dispatcher.bounds.max_limit > DISPATCH_LIMIT)
+        dispatcher.bounds.max_limit = DISPATCH_LIMIT;
+    if (dispatcher.bounds.max_limit < dispatcher.bounds.min_limit)
+        dispatcher.bounds.max_limit = dispatcher.bounds.min_limit;
+
+    /* A smaller queue could never take a poll */
+    if (dispatcher.bounds.max_queued < dispatcher.bounds.min_limit)
+        dispatcher.bounds.max_queued = dispatcher.bounds.min_limit;
+}
+
+void dispatch_sleep (long nanoseconds)
+{
+    struct timespec wait = { nanoseconds / 1000000000, nanoseconds % 1000000000 };
+
+    nanosleep (&wait, NULL);
+}
+
+/*
+ * Returns the id updates are sharded by: the chat of the update's message,
+ * else its sender, else the update itself.
+ */
+
+long long dispatch_key (Update_s *update)
+{
+    tg_res res = { 0 };
+    Message_s *message = update->message;
+    User_s *from = NULL;
+    Chat_s *chat;
+
+    if (!message)
+        message = update->edited_message;
+    if (!message)
+        message = update->channel_post;
+    if (!message)
+        message = update->edited_channel_post;
+    if (!message && update->callback_query)
+        message = update->callback_query->message;
+
+    if (message && (chat = message_chat (message, &res)) && chat->id)
+        return *chat->id;
+
+    if (update->inline_query)
+        from = update->inline_query->from;
+    else if (update->chosen_inline_result)
+        from = update->chosen_inline_result->from;
+    else if (update->callback_query)
+        from = update->callback_query->from;
+
+    if (from && from->id)
+        return *from->id;
+
+    return update->update_id ? *update->update_id : 0;
+}
+
+/*
+ * Queues an update on its shard, waiting while the shard is full.
+ */
+
+void dispatch_push (Update_s *update, dispatch_batch *batch)
+{
+    uint64_t hash = (uint64_t) dispatch_key (update) * UINT64_C (0x9e3779b97f4a7c15);
+    dispatch_shard *shard = &dispatcher.shards[(hash >> 32) % dispatcher.shard_count];
+    size_t tail = shard->tail;
+
+    /* Backpressure: a full shard holds up the poller, not the handlers */
+    while (tail - __atomic_load_n (&shard->head, __ATOMIC_ACQUIRE) == DISPATCH_RING)
+        dispatch_sleep (100000);
+
+    shard->items[tail % DISPATCH_RING] = (dispatch_item){ update, batch };
+    __atomic_store_n (&shard->tail, tail + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch (&dispatcher.queued, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wakes the workers waiting for a shard to drain.
+ */
+
+void dispatch_post (void)
+{
+    pthread_mutex_lock (&dispatcher.lock);
+    __atomic_add_fetch (&dispatcher.posted, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast (&dispatcher.work);
+    pthread_mutex_unlock (&dispatcher.lock);
+}
+
+/*
+ * Counts an update as handled. The last update of a batch advances the
+ * watermark past every finished batch in front of it and frees them.
+ */
+
+void dispatch_release (dispatch_batch *batch)
+{
+    dispatch_batch *done = NULL, *next;
+
+    if (__atomic_sub_fetch (&batch->remaining, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    pthread_mutex_lock (&dispatcher.lock);
+    batch->finished = 1;
+
+    while (dispatcher.oldest && dispatcher.oldest->finished)
+    {
+        next = dispatcher.oldest->next;
+        dispatcher.oldest->next = done;
+        done = dispatcher.oldest;
+        dispatcher.oldest = next;
+    }
+
+    if (!dispatcher.oldest)
+        dispatcher.newest = NULL;
+
+    dispatcher.watermark = dispatcher.oldest ? dispatcher.oldest->first_id : dispatcher.next_id;
+    pthread_cond_broadcast (&dispatcher.progress);
+    pthread_mutex_unlock (&dispatcher.lock);
+
+    for (; done; done = next)
+    {
+        next = done->next;
+        Update_free (done->updates, done->count);
+        tg_free (done);
+    }
+}
+
+/*
+ * Handles up to DISPATCH_RUN updates of a shard if no other worker is at
+ * it. Returns the number of updates handled.
+ */
+
+size_t dispatch_drain (dispatch_shard *shard)
+{
+    size_t head, handled = 0;
+    int idle = 0;
+    dispatch_item item;
+
+    if (__atomic_load_n (&shard->head, __ATOMIC_RELAXED) == __atomic_load_n (&shard->tail, __ATOMIC_ACQUIRE)
+            || !__atomic_compare_exchange_n (&shard->owner, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    head = shard->head;
+
+    while (handled < DISPATCH_RUN && head != __atomic_load_n (&shard->tail, __ATOMIC_ACQUIRE))
+    {
+        item = shard->items[head % DISPATCH_RING];
+        __atomic_store_n (&shard->head, ++head, __ATOMIC_RELEASE);
+
+        dispatcher.handler (item.update, dispatcher.ctx);
+
+        /* Counted before the release wakes the poller, which checks queued */
+        __atomic_sub_fetch (&dispatcher.queued, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch (&dispatcher.handled, 1, __ATOMIC_RELAXED);
+        dispatch_release (item.batch);
+        handled++;
+    }
+
+    __atomic_store_n (&shard->owner, 0, __ATOMIC_RELEASE);
+
+    /* Updates left behind can go to a waiting worker */
+    if (head != __atomic_load_n (&shard->tail, __ATOMIC_ACQUIRE))
+        dispatch_post ();
+
+    return handled;
+}
+
+void *dispatch_worker (void *arg)
+{
+    size_t id = (size_t) arg, home = id * DISPATCH_SHARDS, handled, posted;
+    int done;
+
+    while (1)
+    {
+        /* Read before looking at the shards, so work posted meanwhile ends the wait below */
+        posted = __atomic_load_n (&dispatcher.posted, __ATOMIC_ACQUIRE);
+        done = __atomic_load_n (&dispatcher.done, __ATOMIC_ACQUIRE);
+
+        /* Own shards first, then whatever other workers left behind */
+        handled = 0;
+        for (size_t i = 0; i < dispatcher.shard_count; i++)
+            handled += dispatch_drain (&dispatcher.shards[(home + i) % dispatcher.shard_count]);
+
+        if (handled)
+            continue;
+
+        /* Nothing is queued any more but on shards other workers are at, they finish those */
+        if (done)
+            return NULL;
+
+        /* Shards owned by busy workers are posted once they are let go with updates left */
+        pthread_mutex_lock (&dispatcher.lock);
+        while (dispatcher.posted == posted && !dispatcher.done)
+            pthread_cond_wait (&dispatcher.work, &dispatcher.lock);
+        pthread_mutex_unlock (&dispatcher.lock);
+    }
+}
+
+/*
+ * Returns the identifier of an update, -1 if it has none.
+ */
+
+long long dispatch_id (const Update_s *update)
+{
+    return update->update_id ? *update->update_id : -1;
+}
+
+/*
+ * Updates the handling rate, averaged over the polls.
+ */
+
+void dispatch_measure (dispatch_rate *rate)
+{
+    struct timespec now;
+    size_t handled = __atomic_load_n (&dispatcher.handled, __ATOMIC_RELAXED);
+    double elapsed;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - rate->when.tv_sec) + (now.tv_nsec - rate->when.tv_nsec) / 1e9;
+
+    /* Short intervals say little about the rate */
+    if (elapsed < 0.1)
+        return;
+
+    /* Idle workers say nothing about how fast they are */
+    if (handled != rate->handled || __atomic_load_n (&dispatcher.queued, __ATOMIC_RELAXED))
+        rate->per_second = rate->per_second ? DISPATCH_RATE_WEIGHT * (handled - rate->handled) / elapsed
+            + (1 - DISPATCH_RATE_WEIGHT) * rate->per_second : (handled - rate->handled) / elapsed;
+
+    rate->when = now;
+    rate->handled = handled;
+}
+
+/*
+ * Picks the limit and timeout of the next poll from the queue depth and
+ * the handling rate. Waits while the queue is full. Returns 1 if the
+ * dispatcher is stopping.
+ */
+
+_Bool dispatch_plan (dispatch_rate *rate, long long *offset, size_t *limit, int *timeout)
+{
+    const tg_dispatch_bounds *bounds = &dispatcher.bounds;
+    size_t queued, wanted;
+
+    pthread_mutex_lock (&dispatcher.lock);
+
+    /* Backpressure: no polling until the workers make room */
+    while ((queued = __atomic_load_n (&dispatcher.queued, __ATOMIC_ACQUIRE)) + bounds->min_limit
+            > bounds->max_queued && queued && !dispatcher.stop)
+        pthread_cond_wait (&dispatcher.progress, &dispatcher.lock);
+
+    *offset = dispatcher.watermark;
+    wanted = bounds->max_queued > queued ? bounds->max_queued - queued : 0;
+
+    /* About a second of work, so a burst doesn't outrun the workers */
+    if (rate->per_second && rate->per_second < wanted)
+        wanted = rate->per_second;
+
+    /* Updates in flight come back first and don't count */
+    wanted += dispatcher.next_id - dispatcher.watermark;
+
+    *limit = wanted < bounds->min_limit ? bounds->min_limit
+        : wanted > bounds->max_limit ? bounds->max_limit : wanted;
+
+    /* Idle workers want the next update as soon as it arrives, busy ones
+     * want the poller back soon to adjust the limit */
+    *timeout = queued ? bounds->min_timeout : dispatcher.timeout;
+
+    pthread_mutex_unlock (&dispatcher.lock);
+    return __atomic_load_n (&dispatcher.stop, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Moves past an update getUpdatesFiltered skipped, unless a poll from an
+ * older watermark skipped it again.
+ */
+
+void dispatch_skip (const long long next_offset)
+{
+    pthread_mutex_lock (&dispatcher.lock);
+
+    if (next_offset > dispatcher.next_id)
+    {
+        dispatcher.skipped++;
+        dispatcher.next_id = next_offset;
+
+        if (!dispatcher.oldest)
+            dispatcher.watermark = next_offset;
+    }
+
+    pthread_mutex_unlock (&dispatcher.lock);
+}
+
+/*
+ * Polls from the watermark rather than past the last dispatched update, so
+ * Telegram only drops updates that were handled. Updates still in flight
+ * come back and are skipped. If nothing new came back the poller waits for
+ * the watermark to move before asking again, but not longer than
+ * DISPATCH_STALE so that a slow handler doesn't hold up the other chats.
+ */
+
+void *dispatch_poller (void *arg)
+{
+    tg_res res;
+    Update_s *updates;
+    dispatch_batch *batch;
+    dispatch_rate rate = { 0 };
+    struct timespec deadline;
+    long long offset, next_offset;
+    size_t limit, fresh;
+    int timeout;
+
+    (void) arg;
+
+    clock_gettime (CLOCK_MONOTONIC, &rate.when);
+
+    while (!dispatch_plan (&rate, &offset, &limit, &timeout))
+    {
+        updates = getUpdatesFiltered (offset, &limit, timeout, NULL, NULL, &next_offset, &res);
+        dispatch_measure (&rate);
+
+        if (res.ok != TG_OKAY)
+        {
+            Update_free (updates, limit);
+
+            /* An update that can never parse was skipped, anything else is polled again */
+            if (next_offset == offset)
+                dispatch_sleep (DISPATCH_BACKOFF * 1000000000L);
+            else
+                dispatch_skip (next_offset);
+            continue;
+        }
+
+        if (!limit)
+            continue;
+
+        fresh = 0;
+        for (size_t i = 0; i < limit; i++)
+            fresh += dispatch_id (&updates[i]) >= dispatcher.next_id;
+
+        batch = fresh ? tg_malloc (sizeof (dispatch_batch)) : NULL;
+        if (!batch)
+        {
+            Update_free (updates, limit);
+
+            if (fresh)
+                dispatch_sleep (DISPATCH_BACKOFF * 1000000000L);
+            else
+            {
+                clock_gettime (CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += DISPATCH_STALE;
+
+                pthread_mutex_lock (&dispatcher.lock);
+                while (dispatcher.watermark == offset && !dispatcher.stop)
+                    if (pthread_cond_timedwait (&dispatcher.progress, &dispatcher.lock, &deadline))
+                        break;
+                pthread_mutex_unlock (&dispatcher.lock);
+            }
+            continue;
+        }
+
+        *batch = (dispatch_batch){ updates, limit, fresh, -1 };
+
+        /* The batch is in flight before its first update can finish */
+        pthread_mutex_lock (&dispatcher.lock);
+        for (size_t i = 0; i < limit; i++)
+        {
+            if (dispatch_id (&updates[i]) < dispatcher.next_id)
+                continue;
+            if (batch->first_id < 0)
+                batch->first_id = dispatch_id (&updates[i]);
+            dispatcher.next_id = dispatch_id (&updates[i]) + 1;
+        }
+
+        if (dispatcher.newest)
+            dispatcher.newest->next = batch;
+        else
+            dispatcher.oldest = batch;
+        dispatcher.newest = batch;
+        pthread_mutex_unlock (&dispatcher.lock);
+
+        for (size_t i = 0; i < limit; i++)
+            if (dispatch_id (&updates[i]) >= batch->first_id)
+                dispatch_push (&updates[i], batch);
+
+        dispatch_post ();
+    }
+
+    return NULL;
+}
+
+/*
+ * Lets the workers finish the queued updates and joins them.
+ */
+
+void dispatch_join_workers (void)
+{
+    pthread_mutex_lock (&dispatcher.lock);
+    __atomic_store_n (&dispatcher.done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast (&dispatcher.work);
+    pthread_mutex_unlock (&dispatcher.lock);
+
+    for (size_t i = 0; i < dispatcher.count; i++)
+        pthread_join (dispatcher.threads[i], NULL);
+
+    tg_free (dispatcher.threads);
+    tg_free (dispatcher.shards);
+    dispatcher.threads = NULL;
+    dispatcher.shards = NULL;
+    dispatcher.count = 0;
+    dispatcher.running = 0;
+}
+
+_Bool tg_dispatch_start (const long long offset, const int timeout, const size_t workers,
+        tg_handler handler, void *ctx, tg_res *res)
+{
+    pthread_mutex_lock (&dispatcher.lock);
+
+    if (dispatcher.running || !workers)
+    {
+        pthread_mutex_unlock (&dispatcher.lock);
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    dispatcher.shard_count = workers * DISPATCH_SHARDS;
+    dispatcher.shards = tg_malloc (sizeof (dispatch_shard) * dispatcher.shard_count);
+    dispatcher.threads = tg_malloc (sizeof (pthread_t) * workers);
+
+    if (!dispatcher.shards || !dispatcher.threads)
+    {
+        tg_free (dispatcher.shards);
+        tg_free (dispatcher.threads);
+        pthread_mutex_unlock (&dispatcher.lock);
+        res->ok = TG_ALLOCFAIL;
+        return 1;
+    }
+
+    memset (dispatcher.shards, 0, sizeof (dispatch_shard) * dispatcher.shard_count);
+    dispatcher.running = 1;
+    dispatcher.stop = 0;
+    dispatcher.done = 0;
+    dispatcher.posted = 0;
+    dispatcher.queued = 0;
+    dispatcher.handled = 0;
+    dispatcher.skipped = 0;
+    dispatcher.watermark = offset;
+    dispatcher.next_id = offset;
+    dispatcher.oldest = NULL;
+    dispatcher.newest = NULL;
+    dispatcher.timeout = timeout;
+    dispatcher.handler = handler;
+    dispatcher.ctx = ctx;
+
+    for (dispatcher.count = 0; dispatcher.count < workers; dispatcher.count++)
+        if (pthread_create (&dispatcher.threads[dispatcher.count], NULL, dispatch_worker,
+                (void *) dispatcher.count))
+            break;
+
+    pthread_mutex_unlock (&dispatcher.lock);
+
+    if (dispatcher.count < workers || pthread_create (&dispatcher.poller, NULL, dispatch_poller, NULL))
+    {
+        dispatch_join_workers ();
+        res->ok = TG_ALLOCFAIL;
+        return 1;
+    }
+
+    return 0;
+}
+
+long long tg_dispatch_stop (void)
+{
+    pthread_mutex_lock (&dispatcher.lock);
+
+    if (!dispatcher.running)
+    {
+        pthread_mutex_unlock (&dispatcher.lock);
+        return dispatcher.watermark;
+    }
+
+    __atomic_store_n (&dispatcher.stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast (&dispatcher.progress);
+    pthread_mutex_unlock (&dispatcher.lock);
+
+    pthread_join (dispatcher.poller, NULL);
+    dispatch_join_workers ();
+    return dispatcher.watermark;
+}
+
+long long tg_dispatch_offset (void)
+{
+    long long watermark;
+
+    pthread_mutex_lock (&dispatcher.lock);
+    watermark = dispatcher.watermark;
+    pthread_mutex_unlock (&dispatcher.lock);
+
+    return watermark;
+}
+
+size_t tg_dispatch_skipped (void)
+{
+    size_t skipped;
+
+    pthread_mutex_lock (&dispatcher.lock);
+    skipped = dispatcher.skipped;
+    pthread_mutex_unlock (&dispatcher.lock);
+
+    return skipped;
+}
@@ -0,0 +1,426 @@
+#include <string.h>
+#include <jansson.h>
+#include "tgschema.h"
+
+/**
+ * @file
+ * @brief Flat binary encoding of update batches.
+ */
+
+//! Size of the batch header and of a table slot
+#define FLAT_HEADER 8
+#define FLAT_SLOT 8
+
+//! Largest encoded batch, offsets are 32 bits
+#define FLAT_MAX UINT32_MAX
+
+//! Deepest nesting tg_flat_open accepts
+#define FLAT_DEPTH 64
+
+//! Address of a member of an object
+#define MEMBER_PTR(api_s, offset) ((void *)((char *)(api_s) + (offset)))
+
+/*
+ * Appends zeroed bytes at a multiple of align and sets pos to their offset.
+ */
+
+_Bool flat_alloc (tg_buffer *buf, size_t length, size_t align, size_t *pos, tg_res *res)
+{
+    size_t start = (buf->size + align - 1) & ~(align - 1);
+
+    if (start + length > FLAT_MAX)
+    {
+        res->ok = TG_LIMITFAIL;
+        return 1;
+    }
+
+    if (buffer_reserve (buf, start + length - buf->size, res))
+        return 1;
+
+    memset (buf->data + buf->size, 0, start + length - buf->size);
+    buf->size = start + length;
+    buf->data[buf->size] = '\0';
+    *pos = start;
+    return 0;
+}
+
+void flat_put32 (tg_buffer *buf, size_t pos, uint32_t value)
+{
+    memcpy (buf->data + pos, &value, sizeof (value));
+}
+
+uint32_t flat_get32 (const unsigned char *pos)
+{
+    uint32_t value;
+
+    memcpy (&value, pos, sizeof (value));
+    return value;
+}
+
+/*
+ * Returns the member of a field, parsing it first if the object is lazy and
+ * the member wasn't accessed yet. base is set to the object holding it. A
+ * failed parse sets res.
+ */
+
+void *flat_member (tg_schema *schema, const tg_field *field, void *api_s, void **base, tg_res *res)
+{
+    json_t *raw = schema->lazy ? *(json_t **) MEMBER_PTR (api_s, schema->raw_offset) : NULL;
+    json_t *value;
+    size_t depth;
+
+    *base = field_base (schema, field, api_s, 0, NULL);
+    if (*base && *(void **) MEMBER_PTR (*base, field->offset))
+        return *(void **) MEMBER_PTR (*base, field->offset);
+
+    if (!raw || (field->kind != FIELD_OBJ && field->kind != FIELD_ARR)
+            || !(value = json_object_get (raw, field->name)))
+        return NULL;
+
+    *base = field_base (schema, field, api_s, 1, res);
+    if (!*base)
+        return NULL;
+
+    /* Members nest as deep as they would have when parsed eagerly */
+    depth = depth_set (*(size_t *) MEMBER_PTR (api_s, schema->depth_offset));
+    schema_parse_value (field, value, *base, res);
+    depth_set (depth);
+
+    return *(void **) MEMBER_PTR (*base, field->offset);
+}
+
+/*
+ * Appends the table of an object followed by the data of its members and
+ * sets table to its offset.
+ */
+
+_Bool flat_table (tg_schema *schema, const void *api_s, tg_buffer *buf, size_t *table, tg_res *res)
+{
+    const tg_field *field;
+    void *base, *member;
+    uint64_t mask = 0;
+    size_t slots = 0, slot, pos, child, length;
+
+    /* Lazy members are parsed up front so the table size is known */
+    for (size_t i = 0; i < schema->count; i++)
+    {
+        if (flat_member (schema, &schema->fields[i], (void *) api_s, &base, res))
+        {
+            mask |= (uint64_t) 1 << i;
+            slots++;
+        }
+
+        /* A member that failed to parse can't be encoded in full */
+        if (res->ok != TG_OKAY)
+            return 1;
+    }
+
+    if (flat_alloc (buf, FLAT_SLOT + slots * FLAT_SLOT, 8, table, res))
+        return 1;
+
+    memcpy (buf->data + *table, &mask, sizeof (mask));
+    slot = *table + FLAT_SLOT;
+
+    for (size_t i = 0; i < schema->count; i++)
+    {
+        if (!(mask & (uint64_t) 1 << i))
+            continue;
+
+        field = &schema->fields[i];
+        member = flat_member (schema, field, (void *) api_s, &base, res);
+        if (res->ok != TG_OKAY)
+            return 1;
+
+        switch (field->kind)
+        {
+            case FIELD_INT:
+                memcpy (buf->data + slot, member, sizeof (json_int_t));
+                break;
+
+            case FIELD_BOOL:
+                buf->data[slot] = *(const _Bool *) member;
+                break;
+
+            case FIELD_REAL:
+                memcpy (buf->data + slot, member, sizeof (double));
+                break;
+
+            case FIELD_STR:
+            case FIELD_ISTR:
+                length = strlen (member);
+                if (flat_alloc (buf, length + 1, 1, &pos, res))
+                    return 1;
+                memcpy (buf->data + pos, member, length);
+                flat_put32 (buf, slot, pos - slot);
+                flat_put32 (buf, slot + 4, length);
+                break;
+
+            case FIELD_OBJ:
+                if (flat_table (field->schema, member, buf, &child, res))
+                    return 1;
+                flat_put32 (buf, slot, child - slot);
+                break;
+
+            case FIELD_ARR:
+                length = *(const size_t *) MEMBER_PTR (base, field->len_offset);
+                if (flat_alloc (buf, length * 4, 4, &pos, res))
+                    return 1;
+                flat_put32 (buf, slot, pos - slot);
+                flat_put32 (buf, slot + 4, length);
+
+                /* Elements are tables of their own, pointed to from the vector */
+                for (size_t j = 0; j < length; j++)
+                {
+                    if (flat_table (field->schema, (const char *) member + field->schema->size * j,
+                            buf, &child, res))
+                        return 1;
+                    flat_put32 (buf, pos + 4 * j, child - (pos + 4 * j));
+                }
+                break;
+        }
+
+        slot += FLAT_SLOT;
+    }
+
+    return 0;
+}
+
+_Bool update_to_flat (const Update_s *api_s, size_t count, tg_buffer *buf, tg_res *res)
+{
+    size_t header, table;
+
+    buf->size = 0;
+
+    if (count > (FLAT_MAX - FLAT_HEADER) / 4)
+    {
+        res->ok = TG_LIMITFAIL;
+        return 1;
+    }
+
+    if (flat_alloc (buf, FLAT_HEADER + count * 4, 8, &header, res))
+        return 1;
+
+    memcpy (buf->data, TG_FLAT_MAGIC, 4);
+    flat_put32 (buf, 4, count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (flat_table (&Update_schema, &api_s[i], buf, &table, res))
+            return 1;
+        flat_put32 (buf, FLAT_HEADER + 4 * i, table);
+    }
+
+    return 0;
+}
+
+/*
+ * Checks a table and everything it points to. budget is the number of
+ * tables the batch can still hold, so offsets that are shared or cyclic
+ * can't make the walk longer than the batch.
+ */
+
+_Bool flat_verify (const unsigned char *bytes, size_t size, size_t table, const tg_schema *schema,
+        size_t depth, size_t *budget)
+{
+    const tg_field *field;
+    uint64_t mask;
+    size_t slot, target, length, element;
+
+    if (!*budget || depth > FLAT_DEPTH || table % 8 || table < FLAT_HEADER || table > size - FLAT_SLOT)
+        return 1;
+
+    (*budget)--;
+
+    memcpy (&mask, bytes + table, sizeof (mask));
+    if ((schema->count < 64 && mask >> schema->count)
+            || (size_t) __builtin_popcountll (mask) > (size - table) / FLAT_SLOT - 1)
+        return 1;
+
+    slot = table + FLAT_SLOT;
+
+    for (size_t i = 0; i < schema->count; i++)
+    {
+        if (!(mask & (uint64_t) 1 << i))
+            continue;
+
+        field = &schema->fields[i];
+        target = slot + flat_get32 (bytes + slot);
+        length = flat_get32 (bytes + slot + 4);
+
+        switch (field->kind)
+        {
+            case FIELD_INT:
+            case FIELD_BOOL:
+            case FIELD_REAL:
+                break;
+
+            case FIELD_STR:
+            case FIELD_ISTR:
+                if (target > size || length >= size - target || bytes[target + length])
+                    return 1;
+                break;
+
+            case FIELD_OBJ:
+                if (flat_verify (bytes, size, target, field->schema, depth + 1, budget))
+                    return 1;
+                break;
+
+            case FIELD_ARR:
+                if (target % 4 || target > size || length > (size - target) / 4)
+                    return 1;
+
+                for (size_t j = 0; j < length; j++)
+                {
+                    element = target + 4 * j;
+                    if (flat_verify (bytes, size, element + flat_get32 (bytes + element), field->schema,
+                            depth + 1, budget))
+                        return 1;
+                }
+                break;
+        }
+
+        slot += FLAT_SLOT;
+    }
+
+    return 0;
+}
+
+_Bool tg_flat_open (const void *data, size_t size, size_t *count, tg_res *res)
+{
+    const unsigned char *bytes = data;
+    size_t budget = size / FLAT_SLOT;
+
+    if (size < FLAT_HEADER || size > FLAT_MAX || memcmp (bytes, TG_FLAT_MAGIC, 4))
+        goto malformed;
+
+    *count = flat_get32 (bytes + 4);
+    if (*count > (size - FLAT_HEADER) / 4)
+        goto malformed;
+
+    for (size_t i = 0; i < *count; i++)
+    {
+        if (flat_verify (bytes, size, flat_get32 (bytes + FLAT_HEADER + 4 * i), &Update_schema, 0, &budget))
+            goto malformed;
+    }
+
+    return 0;
+
+malformed:
+    res->ok = TG_FORMATFAIL;
+    return 1;
+}
+
+tg_flat tg_flat_update (const void *data, size_t index)
+{
+    const unsigned char *bytes = data;
+
+    return (tg_flat){ bytes + flat_get32 (bytes + FLAT_HEADER + 4 * index), &Update_schema };
+}
+
+/*
+ * Returns the slot of a member and sets field to its field, NULL if the
+ * object doesn't have the member.
+ */
+
+const unsigned char *flat_slot (tg_flat obj, const char *name, const tg_field **field)
+{
+    uint64_t mask, bit;
+
+    if (!obj.table || !(*field = schema_field ((tg_schema *) obj.schema, name)))
+        return NULL;
+
+    memcpy (&mask, obj.table, sizeof (mask));
+    bit = (uint64_t) 1 << (*field - obj.schema->fields);
+
+    if (!(mask & bit))
+        return NULL;
+
+    /* Only present members have a slot */
+    return obj.table + FLAT_SLOT + FLAT_SLOT * __builtin_popcountll (mask & (bit - 1));
+}
+
+_Bool tg_flat_has (tg_flat obj, const char *name)
+{
+    const tg_field *field;
+
+    return flat_slot (obj, name, &field) != NULL;
+}
+
+json_int_t tg_flat_int (tg_flat obj, const char *name)
+{
+    const tg_field *field;
+    const unsigned char *slot = flat_slot (obj, name, &field);
+    json_int_t value;
+
+    if (!slot || field->kind != FIELD_INT)
+        return 0;
+
+    memcpy (&value, slot, sizeof (value));
+    return value;
+}
+
+_Bool tg_flat_bool (tg_flat obj, const char *name)
+{
+    const tg_field *field;
+    const unsigned char *slot = flat_slot (obj, name, &field);
+
+    return slot && field->kind == FIELD_BOOL && *slot;
+}
+
+double tg_flat_real (tg_flat obj, const char *name)
+{
+    const tg_field *field;
+    const unsigned char *slot = flat_slot (obj, name, &field);
+    double value;
+
+    if (!slot || field->kind != FIELD_REAL)
+        return 0;
+
+    memcpy (&value, slot, sizeof (value));
+    return value;
+}
+
+const char *tg_flat_str (tg_flat obj, const char *name, size_t *length)
+{
+    const tg_field *field;
+    const unsigned char *slot = flat_slot (obj, name, &field);
+
+    if (!slot || (field->kind != FIELD_STR && field->kind != FIELD_ISTR))
+        return NULL;
+
+    if (length)
+        *length = flat_get32 (slot + 4);
+
+    return (const char *) slot + flat_get32 (slot);
+}
+
+tg_flat tg_flat_obj (tg_flat obj, const char *name)
+{
+    const tg_field *field;
+    const unsigned char *slot = flat_slot (obj, name, &field);
+
+    if (!slot || field->kind != FIELD_OBJ)
+        return (tg_flat){ NULL };
+
+    return (tg_flat){ slot + flat_get32 (slot), field->schema };
+}
+
+size_t tg_flat_len (tg_flat obj, const char *name)
+{
+    const tg_field *field;
+    const unsigned char *slot = flat_slot (obj, name, &field);
+
+    return slot && field->kind == FIELD_ARR ? flat_get32 (slot + 4) : 0;
+}
+
+tg_flat tg_flat_at (tg_flat obj, const char *name, size_t index)
+{
+    const tg_field *field;
+    const unsigned char *slot = flat_slot (obj, name, &field), *element;
+
+    if (!slot || field->kind != FIELD_ARR || index >= flat_get32 (slot + 4))
+        return (tg_flat){ NULL };
+
+    element = slot + flat_get32 (slot) + 4 * index;
+    return (tg_flat){ element + flat_get32 (element), field->schema };
+}
@@ -0,0 +1,386 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <jansson.h>
+#include "tgapi.h"
+
+/**
+ * @file
+ * @brief Memory mapped journal of raw updates.
+ */
+
+//! First bytes of a journal
+#define JOURNAL_MAGIC "TGJ2"
+
+//! Offset of the checkpoint in the header
+#define JOURNAL_CHECKPOINT 8
+
+//! Offset of the first record to scan in the header
+#define JOURNAL_START 16
+
+//! Size of the header, records start after it
+#define JOURNAL_HEADER 24
+
+//! Length, checksum and update_id in front of each record
+#define JOURNAL_RECORD 16
+
+//! Size of a new journal
+#define JOURNAL_MIN (1 << 20)
+
+//! Records start at multiples of this
+#define JOURNAL_ALIGN 8
+
+//! Bytes of handled records after which the others are moved to the front
+#define JOURNAL_COMPACT (1 << 19)
+
+/*
+ * FNV-1a over the identifier and the json of a record, to spot records torn
+ * by a crash.
+ */
+
+uint32_t journal_checksum (long long update_id, const char *json, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    unsigned char id[8];
+
+    memcpy (id, &update_id, sizeof (id));
+
+    for (size_t i = 0; i < sizeof (id); i++)
+        hash = (hash ^ id[i]) * 16777619u;
+
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char) json[i]) * 16777619u;
+
+    return hash;
+}
+
+size_t journal_record_size (size_t length)
+{
+    return (JOURNAL_RECORD + length + JOURNAL_ALIGN - 1) & ~(size_t)(JOURNAL_ALIGN - 1);
+}
+
+/*
+ * Writes the dirty pages between start and end to disk.
+ */
+
+_Bool journal_sync (tg_journal *journal, size_t start, size_t end)
+{
+    size_t page = sysconf (_SC_PAGESIZE);
+
+    start -= start % page;
+    return msync (journal->map + start, end - start, MS_SYNC) != 0;
+}
+
+/*
+ * Grows the file and its mapping to hold at least size bytes.
+ */
+
+_Bool journal_grow (tg_journal *journal, size_t size)
+{
+    size_t capacity = journal->capacity;
+    unsigned char *map;
+
+    while (capacity < size)
+        capacity *= 2;
+
+    if (capacity == journal->capacity)
+        return 0;
+
+    if (ftruncate (journal->fd, capacity))
+        return 1;
+
+    map = mmap (NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+    if (map == MAP_FAILED)
+        return 1;
+
+    munmap (journal->map, journal->capacity);
+    journal->map = map;
+    journal->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Finds the end of the journal: the first record that is empty, torn, or
+ * not after the one before it, which is left over from before a rewind.
+ */
+
+void journal_scan (tg_journal *journal)
+{
+    uint32_t length, checksum;
+    long long update_id;
+    size_t pos = journal->start;
+
+    journal->last_id = journal->checkpoint;
+
+    while (pos + JOURNAL_RECORD <= journal->capacity)
+    {
+        memcpy (&length, journal->map + pos, 4);
+        memcpy (&checksum, journal->map + pos + 4, 4);
+        memcpy (&update_id, journal->map + pos + 8, 8);
+
+        if (!length || length > journal->capacity - pos - JOURNAL_RECORD
+                || (pos > journal->start && update_id <= journal->last_id)
+                || checksum != journal_checksum (update_id, (char *) journal->map + pos + JOURNAL_RECORD, length))
+            break;
+
+        journal->last_id = update_id;
+        pos += journal_record_size (length);
+    }
+
+    journal->end = pos;
+
+    /* Records handled before a rewind aren't after the checkpoint */
+    if (journal->last_id < journal->checkpoint)
+        journal->last_id = journal->checkpoint;
+}
+
+_Bool tg_journal_open (tg_journal *journal, const char *path, tg_res *res)
+{
+    struct stat info;
+
+    *journal = (tg_journal){ -1 };
+
+    journal->fd = open (path, O_RDWR | O_CREAT, 0600);
+
+    /* Two writers would interleave records, the lock goes with the descriptor */
+    if (journal->fd < 0 || flock (journal->fd, LOCK_EX | LOCK_NB) || fstat (journal->fd, &info))
+        goto fail;
+
+    journal->capacity = info.st_size;
+
+    if (!journal->capacity)
+    {
+        journal->capacity = JOURNAL_MIN;
+        if (ftruncate (journal->fd, journal->capacity))
+            goto fail;
+    }
+
+    journal->map = mmap (NULL, journal->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+    if (journal->map == MAP_FAILED)
+    {
+        journal->map = NULL;
+        goto fail;
+    }
+
+    if (!info.st_size)
+    {
+        journal->start = JOURNAL_HEADER;
+        memcpy (journal->map, JOURNAL_MAGIC, 4);
+        memcpy (journal->map + JOURNAL_START, &journal->start, 8);
+        if (journal_sync (journal, 0, JOURNAL_HEADER))
+            goto fail;
+    }
+    else if (journal->capacity < JOURNAL_HEADER + JOURNAL_RECORD || memcmp (journal->map, JOURNAL_MAGIC, 4))
+        goto malformed;
+
+    memcpy (&journal->checkpoint, journal->map + JOURNAL_CHECKPOINT, 8);
+    memcpy (&journal->start, journal->map + JOURNAL_START, 8);
+
+    if (journal->start < JOURNAL_HEADER || journal->start % JOURNAL_ALIGN
+            || journal->start > journal->capacity - JOURNAL_RECORD)
+        goto malformed;
+
+    journal_scan (journal);
+    return 0;
+
+malformed:
+    tg_journal_close (journal);
+    res->ok = TG_FORMATFAIL;
+    return 1;
+
+fail:
+    tg_journal_close (journal);
+    res->ok = TG_NOTOKAY;
+    return 1;
+}
+
+_Bool tg_journal_append (tg_journal *journal, const tg_raw *raw, tg_res *res)
+{
+    size_t start = journal->end, size = journal->end;
+    uint32_t length, checksum;
+    const tg_raw_update *update;
+
+    for (size_t i = 0; i < raw->count; i++)
+        if (raw->updates[i].update_id > journal->last_id)
+            size += journal_record_size (raw->updates[i].json.len);
+
+    /* Room for the empty record marking the end */
+    if (journal_grow (journal, size + JOURNAL_RECORD))
+    {
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    for (size_t i = 0; i < raw->count; i++)
+    {
+        update = &raw->updates[i];
+        if (update->update_id <= journal->last_id)
+            continue;
+
+        length = update->json.len;
+        checksum = journal_checksum (update->update_id, update->json.ptr, length);
+
+        memcpy (journal->map + journal->end, &length, 4);
+        memcpy (journal->map + journal->end + 4, &checksum, 4);
+        memcpy (journal->map + journal->end + 8, &update->update_id, 8);
+        memcpy (journal->map + journal->end + JOURNAL_RECORD, update->json.ptr, length);
+
+        journal->end += journal_record_size (length);
+        journal->last_id = update->update_id;
+    }
+
+    if (journal->end == start)
+        return 0;
+
+    memset (journal->map + journal->end, 0, JOURNAL_RECORD);
+
+    /* One sync for the whole batch */
+    if (journal_sync (journal, start, journal->end + JOURNAL_RECORD))
+    {
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Moves the start past the handled records. Once they take more than
+ * JOURNAL_COMPACT bytes and more than the records after them, those are
+ * copied to the front. The header keeps pointing at the originals until
+ * the copy is on disk, so a crash leaves one complete copy to scan.
+ */
+
+_Bool journal_compact (tg_journal *journal)
+{
+    uint32_t length;
+    long long update_id;
+    size_t rest;
+
+    while (journal->start < journal->end)
+    {
+        memcpy (&length, journal->map + journal->start, 4);
+        memcpy (&update_id, journal->map + journal->start + 8, 8);
+
+        if (update_id > journal->checkpoint)
+            break;
+
+        journal->start += journal_record_size (length);
+    }
+
+    rest = journal->end - journal->start;
+
+    /* The copy mustn't overlap the records it is made from */
+    if (journal->start - JOURNAL_HEADER < JOURNAL_COMPACT
+            || journal->start - JOURNAL_HEADER < rest + JOURNAL_RECORD)
+        return 0;
+
+    memcpy (journal->map + JOURNAL_START, &journal->start, 8);
+    if (journal_sync (journal, 0, JOURNAL_HEADER))
+        return 1;
+
+    memcpy (journal->map + JOURNAL_HEADER, journal->map + journal->start, rest);
+    memset (journal->map + JOURNAL_HEADER + rest, 0, JOURNAL_RECORD);
+    if (journal_sync (journal, JOURNAL_HEADER, JOURNAL_HEADER + rest + JOURNAL_RECORD))
+        return 1;
+
+    journal->start = JOURNAL_HEADER;
+    journal->end = JOURNAL_HEADER + rest;
+    return 0;
+}
+
+_Bool tg_journal_checkpoint (tg_journal *journal, const long long update_id, tg_res *res)
+{
+    if (update_id <= journal->checkpoint)
+        return 0;
+
+    journal->checkpoint = update_id;
+    memcpy (journal->map + JOURNAL_CHECKPOINT, &journal->checkpoint, 8);
+
+    /* Everything was handled, new records may start over at the header */
+    if (update_id >= journal->last_id)
+    {
+        journal->last_id = update_id;
+        journal->start = JOURNAL_HEADER;
+        journal->end = JOURNAL_HEADER;
+        memset (journal->map + JOURNAL_HEADER, 0, JOURNAL_RECORD);
+    }
+    else if (journal_compact (journal))
+    {
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    /* The start moves with the checkpoint, both only skip handled records */
+    memcpy (journal->map + JOURNAL_START, &journal->start, 8);
+
+    if (journal_sync (journal, 0, JOURNAL_HEADER + JOURNAL_RECORD))
+    {
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    return 0;
+}
+
+_Bool tg_journal_replay (tg_journal *journal, tg_replay replay, void *ctx, tg_res *res)
+{
+    uint32_t length;
+    long long update_id, replayed;
+    size_t pos = journal->start, end;
+
+    (void) res;
+
+    while (pos < journal->end)
+    {
+        memcpy (&length, journal->map + pos, 4);
+        memcpy (&update_id, journal->map + pos + 8, 8);
+
+        if (update_id > journal->checkpoint)
+        {
+            end = journal->end;
+            replay ((tg_slice){ (char *) journal->map + pos + JOURNAL_RECORD, length }, update_id, ctx);
+
+            /* A checkpoint set by the callback rewound or compacted the journal,
+             * the records left were moved to its start */
+            if (journal->end < end)
+            {
+                replayed = update_id;
+                for (pos = journal->start; pos < journal->end; pos += journal_record_size (length))
+                {
+                    memcpy (&length, journal->map + pos, 4);
+                    memcpy (&update_id, journal->map + pos + 8, 8);
+                    if (update_id > replayed)
+                        break;
+                }
+                continue;
+            }
+        }
+
+        pos += journal_record_size (length);
+    }
+
+    return 0;
+}
+
+long long tg_journal_offset (const tg_journal *journal)
+{
+    return journal->last_id + 1;
+}
+
+void tg_journal_close (tg_journal *journal)
+{
+    if (journal->map)
+        munmap (journal->map, journal->capacity);
+
+    if (journal->fd >= 0)
+        close (journal->fd);
+
+    journal->map = NULL;
+    journal->fd = -1;
+}
@@ -1,57 +1,200 @@
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <jansson.h>
-#include "tgapi.h"
+#include "tgschema.h"
 
 /*
- * Frees a Telegram type/array.
+ * Defines an accessor that parses a nested member of a lazily parsed message
+ * on first access.
  */
 
-#define OBJ_FREE(obj, obj_freer) if (obj) { obj_freer (*obj); free (obj); }
-
-#define OBJ_ARR_FREE(obj, obj_len, obj_freer)\
-    if (obj_len)\
+#define LAZY_GET(func, field, obj_type)\
+    obj_type *func (Message_s *api_s, tg_res *res)\
     {\
-        for (int i = 0; i < obj_len; i++)\
-            obj_freer (obj[i]);\
-        free (obj);\
-    }\
+        return lazy_get (api_s, #field, res);\
+    }
+
+//! Updates handed to a parse worker at once
+#define PARSE_CHUNK 4
 
 /*
- * Allocated space for and parses a Telegram type within a type.
+ * Worker pool used by update_parse to parse large batches in parallel.
  */
 
-#define OBJ_PARSE(root_json_obj, json_obj, field, obj, obj_type, obj_parser)\
-    json_obj = json_object_get (root_json_obj, field);\
-    if (json_obj)\
-    {\
-        if (!alloc_obj (sizeof (obj_type), &obj, res))\
-            obj_parser (json_obj, obj, res);\
-    } else\
-        obj = NULL
+typedef struct
+{
+    //! Worker threads
+    pthread_t *threads;
+    //! Number of worker threads
+    size_t count;
+    //! Smallest batch parsed in parallel
+    size_t min_batch;
+    //! Guards every member below
+    pthread_mutex_t lock;
+    //! Signaled when a batch is posted or the pool stops
+    pthread_cond_t work;
+    //! Signaled when the last update of a batch was parsed
+    pthread_cond_t done;
+    //! Set while a batch is being parsed
+    _Bool busy;
+    //! Set to stop the workers
+    _Bool stop;
+    //! Json array of the batch
+    json_t *root;
+    //! Target array of the batch
+    Update_s *updates;
+    //! Length of the batch
+    size_t limit;
+    //! Next update to hand out
+    size_t next;
+    //! Updates not parsed yet
+    size_t pending;
+    //! First error encountered in the batch
+    tg_res res;
+    //! Bytes allocated by the batch, see tg_limits.batch_bytes
+    size_t used;
+} parse_pool;
 
-#define OBJ_ARR_PARSE(root_json_obj, json_obj, field, obj, obj_type, obj_parser, obj_length)\
-    {\
-        json_obj = json_object_get (root_json_obj, field);\
-        obj_length = json_array_size (json_obj);\
-        \
-        if (obj_length)\
-        {\
-            if (!alloc_obj (sizeof (obj_type) * obj_length, &obj, res))\
-            {\
-                for (int i = 0; i < obj_length; i++)\
-                    obj_parser (json_array_get (json_obj, i), &obj[i], res);\
-            } else\
-            {\
-                obj = NULL;\
-            }\
-        }\
-    }\
+parse_pool parse_workers = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER };
+
+//! Spacing of the object pool's size classes
+#define POOL_GRANULE 16
+
+//! Size classes kept by each thread's object pool
+#define POOL_CLASSES 32
+
+//! Largest object the pool keeps, larger ones go straight to the allocator
+#define POOL_MAX (POOL_GRANULE * POOL_CLASSES)
+
+/*
+ * Thread local free lists of objects rounded up to POOL_GRANULE bytes, used
+ * by alloc_obj and release_obj. A thread keeps at most pool_retain objects
+ * per class, so at most pool_retain * 8.25 KiB in all.
+ */
+
+typedef struct pool_node
+{
+    //! Next free object of the size class
+    struct pool_node *next;
+} pool_node;
+
+typedef struct
+{
+    //! Objects retained
+    size_t count;
+    //! Free list
+    pool_node *head;
+} pool_class;
+
+/*
+ * Links the statistics of every thread using the pool, so they can be
+ * summed up from any thread.
+ */
+
+typedef struct pool_thread
+{
+    //! Statistics of the thread, NULL until it used the pool
+    tg_pool_stats *stats;
+    //! Neighbors in pool_threads
+    struct pool_thread *prev, *next;
+} pool_thread;
+
+//! Objects retained per size class and thread. Set through tg_set_pool_retain.
+size_t pool_retain = 128;
+//! Key used to drain a thread's pool on exit
+pthread_key_t pool_key;
+//! Guards creation of pool_key
+pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+//! Size classes of the current thread
+__thread pool_class pool_classes[POOL_CLASSES];
+//! Statistics of the current thread
+__thread tg_pool_stats pool_stats;
+//! Entry of the current thread in pool_threads
+__thread pool_thread pool_self;
+//! Threads that used the pool
+pool_thread *pool_threads;
+//! Statistics of the threads that exited
+tg_pool_stats pool_exited;
+//! Guards pool_threads and pool_exited
+pthread_mutex_t pool_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//! Counts in pool_stats, read by other threads through tg_get_pool_totals
+#define POOL_COUNT(field, delta) \
+    __atomic_store_n (&pool_stats.field, pool_stats.field + (delta), __ATOMIC_RELAXED)
+
+//! Allocator context of the current thread
+__thread void *tg_thread_alloc_ctx;
+
+_Bool tg_lazy = 0;
+_Bool tg_dedup = 0;
+
+tg_mask tg_parse_mask = { TG_MASK_ALL, TG_MASK_ALL, TG_MASK_ALL, TG_MASK_ALL };
+
+tg_limits tg_parse_limits = { 0 };
+
+void *tg_libc_alloc (size_t size, void *ctx)
+{
+    (void) ctx;
+    return malloc (size);
+}
+
+void *tg_libc_realloc (void *ptr, size_t size, void *ctx)
+{
+    (void) ctx;
+    return realloc (ptr, size);
+}
+
+void tg_libc_free (void *ptr, void *ctx)
+{
+    (void) ctx;
+    free (ptr);
+}
+
+tg_allocator tg_active_allocator = { tg_libc_alloc, tg_libc_realloc, tg_libc_free, NULL };
+
+/*
+ * Returns the allocator context of the calling thread.
+ */
+
+void *alloc_ctx (void)
+{
+    return tg_thread_alloc_ctx ? tg_thread_alloc_ctx : tg_active_allocator.ctx;
+}
+
+void *tg_malloc (size_t size)
+{
+    return tg_active_allocator.alloc_fn (size, alloc_ctx ());
+}
+
+void *tg_realloc (void *ptr, size_t old_size, size_t size)
+{
+    void *new_ptr;
+
+    if (tg_active_allocator.realloc_fn)
+        return tg_active_allocator.realloc_fn (ptr, size, alloc_ctx ());
+
+    new_ptr = tg_malloc (size);
+    if (new_ptr && ptr)
+    {
+        memcpy (new_ptr, ptr, old_size < size ? old_size : size);
+        tg_free (ptr);
+    }
+
+    return new_ptr;
+}
+
+void tg_free (void *ptr)
+{
+    if (ptr)
+        tg_active_allocator.free_fn (ptr, alloc_ctx ());
+}
 
 void parse_str (json_t *root, char **target, char *field, tg_res *res)
 {
     json_t *field_obj = json_object_get (root, field);
-    int str_size;
+    size_t str_size;
 
     if (!json_is_string (field_obj))
     {
@@ -59,29 +202,16 @@ void parse_str (json_t *root, char **target, char *field, tg_res *res)
         return;
     }
 
-    const char *tmp_str = json_string_value (field_obj);
+    str_size = json_string_length (field_obj);
+    *target = tg_malloc (str_size + 1);
 
-    if (tmp_str)
+    if (!*target)
     {
-        str_size = strlen (tmp_str) + 1;
-        *target = malloc (str_size);
- 
-        if (*target)
-        {
-            strncpy (*target, tmp_str, str_size);
-            return;
-        }
-        else
-        {
-            res->ok = TG_ALLOCFAIL;
-            return;
-        }
-    }
-    else
-    {
-        *target = NULL;
+        res->ok = TG_ALLOCFAIL;
         return;
     }
+
+    memcpy (*target, json_string_value (field_obj), str_size + 1);
 }
 
 void parse_int (json_t *root, json_int_t **target, char *field, tg_res *res)
@@ -94,7 +224,7 @@ void parse_int (json_t *root, json_int_t **target, char *field, tg_res *res)
         return;
     }
 
-    *target = malloc (sizeof (json_int_t));
+    *target = tg_malloc (sizeof (json_int_t));
 
     if (*target)
     {
@@ -118,7 +248,7 @@ void parse_double (json_t *root, double **target, char *field, tg_res *res)
         return;
     }
 
-    *target = malloc (sizeof (double));
+    *target = tg_malloc (sizeof (double));
 
     if (*target)
     {
@@ -143,7 +273,7 @@ void parse_bool (json_t *root, _Bool **target, char *field, tg_res *res)
         return;
     }
 
-    *target = malloc (sizeof (_Bool));
+    *target = tg_malloc (sizeof (_Bool));
 
     if (*target)
     {
@@ -158,539 +288,457 @@ void parse_bool (json_t *root, _Bool **target, char *field, tg_res *res)
     }
 }
 
-_Bool alloc_obj (size_t obj_size, void *target, tg_res *res)
+void pool_thread_exit (void *arg)
 {
-    *(int **)target = malloc (obj_size);
+    pool_thread *self = arg;
 
-    if (*(int **)target)
-        return 0;
-    else
-    {
-        res->ok = TG_ALLOCFAIL;
-        return 1;
-    }
-}
+    pool_drain ();
 
-size_t update_parse (json_t *root, Update_s **api_s, tg_res *res)
-{
-    json_t *update, *field;
-    size_t limit;
-    
-    limit = json_array_size (root);
-    if (!limit)
-    {
-        *api_s = NULL;
-        return 0;
-    }
+    pthread_mutex_lock (&pool_threads_lock);
+    pool_exited.hits += self->stats->hits;
+    pool_exited.misses += self->stats->misses;
+    pool_exited.released += self->stats->released;
+    pool_exited.dropped += self->stats->dropped;
 
-    *api_s = malloc (sizeof (Update_s) * limit);
-    if (!*api_s)
-    {
-        res->ok = TG_ALLOCFAIL;
-        return 0;
-    }
-
-    for (size_t i = 0; i < limit; i++)
-    {
-        update = json_array_get (root, i);
-        if (!update)
-        {
-            res->ok = TG_JSONFAIL;
-            break;
-        }
+    if (self->prev)
+        self->prev->next = self->next;
+    else
+        pool_threads = self->next;
 
-        parse_int (update, &(*api_s)[i].update_id, "update_id", res);
-        OBJ_PARSE (update, field, "message", (*api_s)[i].message, Message_s, message_parse);
-        OBJ_PARSE (update, field, "edited_message", (*api_s)[i].edited_message, Message_s, message_parse);
-        OBJ_PARSE (update, field, "channel_post", (*api_s)[i].channel_post, Message_s, message_parse);
-        OBJ_PARSE (update, field, "edited_channel_post", 
-                (*api_s)[i].edited_channel_post, Message_s, message_parse);
-        OBJ_PARSE (update, field, "inline_query", (*api_s)[i].inline_query, InlineQuery_s, inlinequery_parse);
-        OBJ_PARSE (update, field, "chosen_inline_result", (*api_s)[i].chosen_inline_result, ChosenInlineResult_s, choseninlineresult_parse);
-        OBJ_PARSE (update, field, "callback_query", (*api_s)[i].callback_query, CallbackQuery_s, callbackquery_parse);
-    }
-    
-    return limit;
+    if (self->next)
+        self->next->prev = self->prev;
+    pthread_mutex_unlock (&pool_threads_lock);
 }
 
-void Update_free (Update_s *api_s, size_t arr_length)
+void pool_key_create (void)
 {
-    for (size_t i = 0; i < arr_length; i++)
-    {
-        free (api_s[i].update_id);
-        OBJ_FREE (api_s[i].message, Message_free);
-        OBJ_FREE (api_s[i].edited_message, Message_free);
-        OBJ_FREE (api_s[i].channel_post, Message_free);
-        OBJ_FREE (api_s[i].edited_channel_post, Message_free);
-        OBJ_FREE (api_s[i].inline_query, InlineQuery_free);
-        OBJ_FREE (api_s[i].chosen_inline_result, ChosenInlineResult_free);
-        OBJ_FREE (api_s[i].callback_query, CallbackQuery_free);
-    }
-
-    free (api_s);
+    pthread_key_create (&pool_key, pool_thread_exit);
 }
 
-void user_parse (json_t *root, User_s *api_s, tg_res *res)
-{
-    parse_int (root, &api_s->id, "id", res);
-    parse_str (root, &api_s->first_name, "first_name", res);
-    parse_str (root, &api_s->last_name, "last_name", res);
-    parse_str (root, &api_s->username, "username", res);
-}
+/*
+ * Makes sure the first use of the pool by a thread gets it drained on exit
+ * and its statistics counted.
+ */
 
-void User_free (User_s api_s)
+void pool_register (void)
 {
-    free (api_s.id);
-    free (api_s.first_name);
-    free (api_s.last_name);
-    free (api_s.username);
-}
+    if (pool_self.stats)
+        return;
 
-void chat_parse (json_t *root, Chat_s *api_s, tg_res *res)
-{
-    parse_int (root, &api_s->id, "id", res);
-    parse_str (root, &api_s->type, "type", res);
-    parse_str (root, &api_s->title, "title", res);
-    parse_str (root, &api_s->username, "username", res);
-    parse_str (root, &api_s->first_name, "first_name", res);
-    parse_str (root, &api_s->last_name, "last_name", res);
-    parse_bool (root, &api_s->all_members_are_administrators, 
-            "all_members_are_administrators", res);
+    pthread_once (&pool_key_once, pool_key_create);
+    pthread_setspecific (pool_key, &pool_self);
+
+    pthread_mutex_lock (&pool_threads_lock);
+    pool_self = (pool_thread){ &pool_stats, NULL, pool_threads };
+    if (pool_threads)
+        pool_threads->prev = &pool_self;
+    pool_threads = &pool_self;
+    pthread_mutex_unlock (&pool_threads_lock);
 }
 
-void Chat_free (Chat_s api_s)
+/*
+ * Returns the size class of obj_size, NULL if it isn't pooled.
+ */
+
+pool_class *pool_find (size_t obj_size)
 {
-    free (api_s.id);
-    free (api_s.type);
-    free (api_s.title);
-    free (api_s.username);
-    free (api_s.first_name);
-    free (api_s.last_name);
-    free (api_s.all_members_are_administrators);
-}
+    if (!obj_size || obj_size > POOL_MAX)
+        return NULL;
 
-void message_parse (json_t *root, Message_s *api_s, tg_res *res)
-{
-    json_t *field;
-
-    parse_int (root, &api_s->message_id, "message_id", res);
-    parse_int (root, &api_s->date, "date", res);
-    parse_int (root, &api_s->forward_from_message_id, "forward_from_message_id", res);
-    parse_int (root, &api_s->forward_date, "forward_date", res);
-    parse_int (root, &api_s->edit_date, "edit_date", res);
-    parse_str (root, &api_s->text, "text", res);
-    parse_str (root, &api_s->caption, "caption", res);
-    parse_str (root, &api_s->new_chat_title, "new_chat_title", res);
-    parse_bool (root, &api_s->delete_chat_photo, "delete_chat_photo", res);
-    parse_bool (root, &api_s->group_chat_created, "group_chat_created", res);
-    parse_bool (root, &api_s->supergroup_chat_created, "supergroup_chat_created", res);
-    parse_bool (root, &api_s->channel_chat_created, "channel_chat_created", res);
-    parse_int (root, &api_s->migrate_to_chat_id, "migrate_to_chat_id", res);
-    parse_int (root, &api_s->migrate_from_chat_id, "migrate_from_chat_id", res);
-    
-    OBJ_ARR_PARSE (root, field, "entities", api_s->entities, MessageEntity_s, messageentity_parse, api_s->entities_len);
-    OBJ_ARR_PARSE (root, field, "photo", api_s->photo, PhotoSize_s, photosize_parse, api_s->photo_len);
-    OBJ_ARR_PARSE (root, field, "new_chat_photo", api_s->new_chat_photo, PhotoSize_s, photosize_parse, api_s->new_chat_photo_len);
-
-    OBJ_PARSE (root, field, "from", api_s->from, User_s, user_parse);
-    OBJ_PARSE (root, field, "chat", api_s->chat, Chat_s, chat_parse);
-    OBJ_PARSE (root, field, "forward_from", api_s->forward_from, User_s, user_parse);
-    OBJ_PARSE (root, field, "forward_from_chat", api_s->forward_from_chat, Chat_s, chat_parse);
-    OBJ_PARSE (root, field, "reply_to_message", api_s->reply_to_message, Message_s, message_parse);
-    OBJ_PARSE (root, field, "audio", api_s->audio, Audio_s, audio_parse);
-    OBJ_PARSE (root, field, "document", api_s->document, Document_s, document_parse);
-    OBJ_PARSE (root, field, "game", api_s->game, Game_s, game_parse);
-    OBJ_PARSE (root, field, "sticker", api_s->sticker, Sticker_s, sticker_parse);
-    OBJ_PARSE (root, field, "video", api_s->video, Video_s, video_parse);
-    OBJ_PARSE (root, field, "voice", api_s->voice, Voice_s, voice_parse);
-    OBJ_PARSE (root, field, "contact", api_s->contact, Contact_s, contact_parse);
-    OBJ_PARSE (root, field, "location", api_s->location, Location_s, location_parse);
-    OBJ_PARSE (root, field, "venue", api_s->venue, Venue_s, venue_parse);
-    OBJ_PARSE (root, field, "new_chat_member", api_s->new_chat_member, User_s, user_parse);
-    OBJ_PARSE (root, field, "left_chat_member", api_s->left_chat_member, User_s, user_parse);
-    OBJ_PARSE (root, field, "pinned_message", api_s->pinned_message, Message_s, message_parse);
+    return &pool_classes[(obj_size - 1) / POOL_GRANULE];
 }
 
-void Message_free (Message_s api_s)
-{
-    free (api_s.message_id);
-    free (api_s.date);
-    free (api_s.forward_from_message_id);
-    free (api_s.forward_date);
-    free (api_s.edit_date);
-    free (api_s.text);
-    free (api_s.caption);
-    free (api_s.new_chat_title);
-    free (api_s.delete_chat_photo);
-    free (api_s.group_chat_created);
-    free (api_s.supergroup_chat_created);
-    free (api_s.channel_chat_created);
-    free (api_s.migrate_to_chat_id);
-    free (api_s.migrate_from_chat_id);
-
-    OBJ_FREE (api_s.from, User_free);
-    OBJ_FREE (api_s.chat, Chat_free);
-    OBJ_FREE (api_s.forward_from, User_free);
-    OBJ_FREE (api_s.forward_from_chat, Chat_free);
-    OBJ_FREE (api_s.reply_to_message, Message_free);
-    OBJ_FREE (api_s.audio, Audio_free);
-    OBJ_FREE (api_s.document, Document_free);
-    OBJ_FREE (api_s.game, Game_free);
-    OBJ_FREE (api_s.sticker, Sticker_free);
-    OBJ_FREE (api_s.video, Video_free);
-    OBJ_FREE (api_s.voice, Voice_free);
-    OBJ_FREE (api_s.contact, Contact_free);
-    OBJ_FREE (api_s.location, Location_free);
-    OBJ_FREE (api_s.venue, Venue_free);
-    OBJ_FREE (api_s.new_chat_member, User_free);
-    OBJ_FREE (api_s.left_chat_member, User_free);
-    OBJ_FREE (api_s.pinned_message, Message_free);
-
-    OBJ_ARR_FREE (api_s.entities, api_s.entities_len, MessageEntity_free);
-    OBJ_ARR_FREE (api_s.photo, api_s.photo_len, PhotoSize_free);
-    OBJ_ARR_FREE (api_s.new_chat_photo, api_s.new_chat_photo_len, PhotoSize_free);
-}
+/*
+ * Size objects of obj_size are allocated with, so any object of its class
+ * may be reused for it.
+ */
 
-void messageentity_parse (json_t *root, MessageEntity_s *api_s, tg_res *res)
+size_t pool_size (size_t obj_size)
 {
-    json_t *user;
+    if (!obj_size || obj_size > POOL_MAX)
+        return obj_size;
 
-    parse_str (root, &api_s->type, "type", res);
-    parse_int (root, &api_s->offset, "offset", res);
-    parse_int (root, &api_s->length, "length", res);
-    parse_str (root, &api_s->url, "url", res);
-    
-    OBJ_PARSE (root, user, "user", api_s->user, User_s, user_parse);
+    return (obj_size + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE;
 }
 
-void MessageEntity_free (MessageEntity_s api_s)
+void release_obj (size_t obj_size, void *obj)
 {
-    free (api_s.type);
-    free (api_s.offset);
-    free (api_s.length);
-    free (api_s.url);
-    
-    OBJ_FREE (api_s.user, User_free);
-}
+    pool_class *class = NULL;
+    pool_node *node = obj;
 
-void photosize_parse (json_t *root, PhotoSize_s *api_s, tg_res *res)
-{
-    parse_str (root, &api_s->file_id, "file_id", res);
-    parse_int (root, &api_s->width, "width", res);
-    parse_int (root, &api_s->height, "height", res);
-    parse_int (root, &api_s->file_size, "file_size", res);
-}
+    if (!obj)
+        return;
 
-void PhotoSize_free (PhotoSize_s api_s)
-{
-    free (api_s.file_id);
-    free (api_s.width);
-    free (api_s.height);
-    free (api_s.file_size);
-}
+    pool_register ();
 
-void audio_parse (json_t *root, Audio_s *api_s, tg_res *res)
-{
-    parse_str (root, &api_s->file_id, "file_id", res);
-    parse_int (root, &api_s->duration, "duration", res);
-    parse_str (root, &api_s->performer, "performer", res);
-    parse_str (root, &api_s->title, "title", res);
-    parse_str (root, &api_s->mime_type, "mime_type", res);
-    parse_int (root, &api_s->file_size, "file_size", res);
-}
+    if (pool_retain)
+        class = pool_find (obj_size);
 
-void Audio_free (Audio_s api_s)
-{
-    free (api_s.file_id);
-    free (api_s.duration);
-    free (api_s.performer);
-    free (api_s.title);
-    free (api_s.mime_type);
-    free (api_s.file_size);
+    if (!class || class->count >= pool_retain)
+    {
+        POOL_COUNT (dropped, 1);
+        tg_free (obj);
+        return;
+    }
+
+    node->next = class->head;
+    class->head = node;
+    class->count++;
+    POOL_COUNT (released, 1);
+    POOL_COUNT (retained, 1);
 }
 
-void document_parse (json_t *root, Document_s *api_s, tg_res *res)
+void pool_drain (void)
 {
-    json_t *thumb;
+    pool_node *node;
 
-    parse_str (root, &api_s->file_id, "file_id", res);
-    parse_str (root, &api_s->file_name, "file_name", res);
-    parse_str (root, &api_s->mime_type, "mime_type", res);
-    parse_int (root, &api_s->file_size, "file_size", res);
-    
-    OBJ_PARSE (root, thumb, "thumb", api_s->thumb, PhotoSize_s, photosize_parse);
-}
+    for (int i = 0; i < POOL_CLASSES; i++)
+    {
+        while (pool_classes[i].head)
+        {
+            node = pool_classes[i].head;
+            pool_classes[i].head = node->next;
+            tg_free (node);
+        }
 
-void Document_free (Document_s api_s)
-{
-    free (api_s.file_id);
-    free (api_s.file_name);
-    free (api_s.mime_type);
-    free (api_s.file_size);
+        pool_classes[i] = (pool_class){ 0 };
+    }
 
-    OBJ_FREE (api_s.thumb, PhotoSize_free);
+    POOL_COUNT (retained, -pool_stats.retained);
 }
 
-void sticker_parse (json_t *root, Sticker_s *api_s, tg_res *res)
+void pool_totals (tg_pool_stats *stats)
 {
-    json_t *thumb;
+    pthread_mutex_lock (&pool_threads_lock);
+    *stats = pool_exited;
 
-    parse_str (root, &api_s->file_id, "file_id", res);
-    parse_int (root, &api_s->width, "width", res);
-    parse_int (root, &api_s->height, "height", res);
-    parse_str (root, &api_s->emoji, "emoji", res);
-    parse_int (root, &api_s->file_size, "file_size", res);
+    for (pool_thread *thread = pool_threads; thread; thread = thread->next)
+    {
+        stats->hits += __atomic_load_n (&thread->stats->hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n (&thread->stats->misses, __ATOMIC_RELAXED);
+        stats->released += __atomic_load_n (&thread->stats->released, __ATOMIC_RELAXED);
+        stats->dropped += __atomic_load_n (&thread->stats->dropped, __ATOMIC_RELAXED);
+        stats->retained += __atomic_load_n (&thread->stats->retained, __ATOMIC_RELAXED);
+    }
 
-    OBJ_PARSE (root, thumb, "thumb", api_s->thumb, PhotoSize_s, photosize_parse);
+    pthread_mutex_unlock (&pool_threads_lock);
 }
 
-void Sticker_free (Sticker_s api_s)
+_Bool alloc_obj (size_t obj_size, void *target, tg_res *res)
 {
-    free (api_s.file_id);
-    free (api_s.width);
-    free (api_s.height);
-    free (api_s.emoji);
-    free (api_s.file_size);
-    
-    OBJ_FREE (api_s.thumb, PhotoSize_free);
-}
+    pool_class *class = pool_find (obj_size);
 
-void video_parse (json_t *root, Video_s *api_s, tg_res *res)
-{
-    json_t *thumb;
+    pool_register ();
 
-    parse_str (root, &api_s->file_id, "file_id", res);
-    parse_int (root, &api_s->width, "width", res);
-    parse_int (root, &api_s->height, "height", res);
-    parse_int (root, &api_s->duration, "duration", res);
-    parse_str (root, &api_s->mime_type, "mime_type", res);
-    parse_int (root, &api_s->file_size, "file_size", res);
+    if (class && class->head)
+    {
+        *(pool_node **)target = class->head;
+        class->head = class->head->next;
+        class->count--;
+        POOL_COUNT (hits, 1);
+        POOL_COUNT (retained, -1);
+        return 0;
+    }
 
-    OBJ_PARSE (root, thumb, "thumb", api_s->thumb, PhotoSize_s, photosize_parse);
-}
+    POOL_COUNT (misses, 1);
+    *(int **)target = tg_malloc (pool_size (obj_size));
 
-void Video_free (Video_s api_s)
-{
-    free (api_s.file_id);
-    free (api_s.width);
-    free (api_s.height);
-    free (api_s.duration);
-    free (api_s.mime_type);
-    free (api_s.file_size);
-    
-    OBJ_FREE (api_s.thumb, PhotoSize_free);
+    if (*(int **)target)
+        return 0;
+    else
+    {
+        res->ok = TG_ALLOCFAIL;
+        return 1;
+    }
 }
 
-void voice_parse (json_t *root, Voice_s *api_s, tg_res *res)
-{
-    parse_str (root, &api_s->file_id, "file_id", res);
-    parse_int (root, &api_s->duration, "duration", res);
-    parse_str (root, &api_s->mime_type, "mime_type", res);
-    parse_int (root, &api_s->file_size, "file_size", res);
-}
+/*
+ * Parses the update at index i of the batch into its slot.
+ */
 
-void Voice_free (Voice_s api_s)
+void update_parse_index (json_t *root, Update_s *api_s, size_t i, tg_res *res)
 {
-    free (api_s.file_id);
-    free (api_s.duration);
-    free (api_s.mime_type);
-    free (api_s.file_size);
-}
+    json_t *update = json_array_get (root, i);
 
-void contact_parse (json_t *root, Contact_s *api_s, tg_res *res)
-{
-    parse_str (root, &api_s->phone_number, "phone_number", res);
-    parse_str (root, &api_s->first_name, "first_name", res);
-    parse_str (root, &api_s->last_name, "last_name", res);
-    parse_int (root, &api_s->user_id, "user_id", res);
-}
+    if (!update)
+    {
+        api_s[i] = (Update_s){ NULL };
+        res->ok = TG_JSONFAIL;
+        return;
+    }
 
-void Contact_free (Contact_s api_s)
-{
-    free (api_s.phone_number);
-    free (api_s.first_name);
-    free (api_s.last_name);
-    free (api_s.user_id);
+    schema_parse (&Update_schema, update, &api_s[i], res);
 }
 
-void location_parse (json_t *root, Location_s *api_s, tg_res *res)
-{
-    parse_double (root, &api_s->longitude, "longitude", res);
-    parse_double (root, &api_s->latitude, "latitude", res);
-}
+/*
+ * Parses chunks of the posted batch until none are left. Called and returns
+ * with parse_workers.lock held.
+ */
 
-void Location_free (Location_s api_s)
+void pool_parse_chunks (void)
 {
-    free (api_s.longitude);
-    free (api_s.latitude);
-}
+    tg_res res = { 0 };
+    size_t start, end;
 
-void venue_parse (json_t *root, Venue_s *api_s, tg_res *res)
-{
-    json_t *location;
+    dedup_begin ();
+    budget_begin (&parse_workers.used);
 
-    parse_str (root, &api_s->title, "title", res);
-    parse_str (root, &api_s->address, "address", res);
-    parse_str (root, &api_s->foursquare_id, "foursquare_id", res);
+    while (parse_workers.next < parse_workers.limit)
+    {
+        start = parse_workers.next;
+        end = start + PARSE_CHUNK < parse_workers.limit ? start + PARSE_CHUNK : parse_workers.limit;
+        parse_workers.next = end;
 
-    OBJ_PARSE (root, location, "location", api_s->location, Location_s, location_parse);
-}
+        pthread_mutex_unlock (&parse_workers.lock);
+        for (size_t i = start; i < end; i++)
+            update_parse_index (parse_workers.root, parse_workers.updates, i, &res);
+        pthread_mutex_lock (&parse_workers.lock);
 
-void Venue_free (Venue_s api_s)
-{
-    free (api_s.title);
-    free (api_s.address);
-    free (api_s.foursquare_id);
+        parse_workers.pending -= end - start;
+    }
+
+    budget_end ();
+    dedup_end ();
+
+    if (res.ok != TG_OKAY && parse_workers.res.ok == TG_OKAY)
+        parse_workers.res = res;
 
-    OBJ_FREE (api_s.location, Location_free);
+    if (!parse_workers.pending)
+        pthread_cond_broadcast (&parse_workers.done);
 }
 
-void userprofilephotos_parse (json_t *root, UserProfilePhotos_s *api_s, tg_res *res)
+void *pool_worker (void *arg)
 {
-    json_t *photos;
+    (void) arg;
 
-    parse_int (root, &api_s->total_count, "total_count", res);
+    pthread_mutex_lock (&parse_workers.lock);
 
-    OBJ_ARR_PARSE (root, photos, "photos", api_s->photos, PhotoSize_s, photosize_parse, api_s->photos_len)
-    
-}
+    while (!parse_workers.stop)
+    {
+        if (parse_workers.next < parse_workers.limit)
+            pool_parse_chunks ();
+        else
+            pthread_cond_wait (&parse_workers.work, &parse_workers.lock);
+    }
 
-void UserProfilePhotos_free (UserProfilePhotos_s api_s)
-{
-    free (api_s.total_count);
-    
-    OBJ_ARR_FREE (api_s.photos, api_s.photos_len, PhotoSize_free);
+    pthread_mutex_unlock (&parse_workers.lock);
+    return NULL;
 }
 
-void file_parse (json_t *root, File_s *api_s, tg_res *res)
-{
-    parse_str (root, &api_s->file_id, "file_id", res);
-    parse_int (root, &api_s->file_size, "file_size", res);
-    parse_str (root, &api_s->file_path, "file_path", res);
-}
+/*
+ * Parses the batch with the worker parse_workers, used being the bytes already
+ * charged to it. The calling thread parses as well.
+ * Returns 1 without parsing if the pool is missing or in use.
+ */
 
-void File_free (File_s api_s)
+_Bool pool_parse (json_t *root, Update_s *api_s, size_t limit, size_t used, tg_res *res)
 {
-    free (api_s.file_id);
-    free (api_s.file_size);
-    free (api_s.file_path);
-}
+    pthread_mutex_lock (&parse_workers.lock);
 
-void callbackquery_parse (json_t *root, CallbackQuery_s *api_s, tg_res *res)
-{
-    json_t *from, *message;
+    if (!parse_workers.count || limit < parse_workers.min_batch || parse_workers.busy)
+    {
+        pthread_mutex_unlock (&parse_workers.lock);
+        return 1;
+    }
 
-    parse_str (root, &api_s->id, "id", res);
-    parse_str (root, &api_s->inline_message_id, "inline_message_id", res);
-    parse_str (root, &api_s->chat_instance, "chat_instance", res);
-    parse_str (root, &api_s->data, "data", res);
-    parse_str (root, &api_s->game_short_name, "game_short_name", res);
+    parse_workers.busy = 1;
+    parse_workers.root = root;
+    parse_workers.updates = api_s;
+    parse_workers.limit = limit;
+    parse_workers.next = 0;
+    parse_workers.pending = limit;
+    parse_workers.res = (tg_res){ 0 };
+    parse_workers.used = used;
 
-    OBJ_PARSE (root, from, "from", api_s->from, User_s, user_parse);
-    OBJ_PARSE (root, message, "message", api_s->message, Message_s, message_parse);
-}
+    pthread_cond_broadcast (&parse_workers.work);
+    pool_parse_chunks ();
 
-void CallbackQuery_free (CallbackQuery_s api_s)
-{
-    free (api_s.id);
-    free (api_s.inline_message_id);
-    free (api_s.chat_instance);
-    free (api_s.data);
-    free (api_s.game_short_name);
+    while (parse_workers.pending)
+        pthread_cond_wait (&parse_workers.done, &parse_workers.lock);
+
+    if (parse_workers.res.ok != TG_OKAY)
+        res->ok = parse_workers.res.ok;
 
-    OBJ_FREE (api_s.from, User_free);
-    OBJ_FREE (api_s.message, Message_free);
+    parse_workers.busy = 0;
+    parse_workers.limit = 0;
+    parse_workers.next = 0;
+    pthread_mutex_unlock (&parse_workers.lock);
+    return 0;
 }
 
-void inlinequery_parse (json_t *root, InlineQuery_s *api_s, tg_res *res)
+void parse_pool_stop (void)
 {
-    json_t *from, *location;
+    pthread_mutex_lock (&parse_workers.lock);
+    parse_workers.stop = 1;
+    pthread_cond_broadcast (&parse_workers.work);
+    pthread_mutex_unlock (&parse_workers.lock);
 
-    parse_str (root, &api_s->id, "id", res);
-    parse_str (root, &api_s->query, "query", res);
-    parse_str (root, &api_s->offset, "offset", res);
+    for (size_t i = 0; i < parse_workers.count; i++)
+        pthread_join (parse_workers.threads[i], NULL);
 
-    OBJ_PARSE (root, from, "from", api_s->from, User_s, user_parse);
-    OBJ_PARSE (root, location, "location", api_s->location, Location_s, location_parse);
+    tg_free (parse_workers.threads);
+    parse_workers.threads = NULL;
+    parse_workers.count = 0;
+    parse_workers.stop = 0;
 }
 
-void InlineQuery_free (InlineQuery_s api_s)
+_Bool parse_pool_start (size_t threads, size_t min_batch, tg_res *res)
 {
-    free (api_s.id);
-    free (api_s.query);
-    free (api_s.offset);
+    parse_pool_stop ();
 
-    OBJ_FREE (api_s.from, User_free);
-    OBJ_FREE (api_s.location, Location_free);
-}
-
-void choseninlineresult_parse (json_t *root, ChosenInlineResult_s *api_s, tg_res *res)
-{
-    json_t *from, *location;
+    if (!threads)
+        return 0;
 
-    parse_str (root, &api_s->result_id, "result_id", res);
-    parse_str (root, &api_s->inline_message_id, "inline_message_id", res);
-    parse_str (root, &api_s->query, "query", res);
+    if (alloc_obj (sizeof (pthread_t) * threads, &parse_workers.threads, res))
+        return 1;
 
-    OBJ_PARSE (root, from, "from", api_s->from, User_s, user_parse);
-    OBJ_PARSE (root, location, "location", api_s->location, Location_s, location_parse);
-}
+    parse_workers.min_batch = min_batch;
 
-void ChosenInlineResult_free (ChosenInlineResult_s api_s)
-{
-    free (api_s.result_id);
-    free (api_s.inline_message_id);
-    free (api_s.query);
+    for (; parse_workers.count < threads; parse_workers.count++)
+    {
+        if (pthread_create (&parse_workers.threads[parse_workers.count], NULL, pool_worker, NULL))
+        {
+            res->ok = TG_ALLOCFAIL;
+            parse_pool_stop ();
+            return 1;
+        }
+    }
 
-    OBJ_FREE (api_s.from, User_free);
-    OBJ_FREE (api_s.location, Location_free);
+    return 0;
 }
 
-void game_parse (json_t *root, Game_s *api_s, tg_res *res)
+size_t update_parse (json_t *root, Update_s **api_s, tg_res *res)
 {
-    json_t *photo, *text_entities, *animation;
+    size_t limit, used = 0;
     
-    parse_str (root, &api_s->title, "title", res);
-    parse_str (root, &api_s->description, "description", res);
-    parse_str (root, &api_s->text, "text", res);
+    limit = json_array_size (root);
+    if (!limit)
+    {
+        *api_s = NULL;
+        return 0;
+    }
 
-    OBJ_ARR_PARSE (root, photo, "photo", api_s->photo, PhotoSize_s, photosize_parse, api_s->photo_len);
-    OBJ_ARR_PARSE (root, text_entities, "text_entities", api_s->text_entities, MessageEntity_s, messageentity_parse, api_s->text_entities_len);
+    /* The array counts against the batch like the objects in it */
+    budget_begin (&used);
+    if (budget_take (sizeof (Update_s) * limit, res) || alloc_obj (sizeof (Update_s) * limit, api_s, res))
+    {
+        budget_end ();
+        *api_s = NULL;
+        return 0;
+    }
+    budget_end ();
 
-    OBJ_PARSE (root, animation, "animation", api_s->animation, Animation_s, animation_parse);
+    if (pool_parse (root, *api_s, limit, used, res))
+    {
+        dedup_begin ();
+        budget_begin (&used);
+        for (size_t i = 0; i < limit; i++)
+            update_parse_index (root, *api_s, i, res);
+        budget_end ();
+        dedup_end ();
+    }
+    
+    return limit;
 }
 
-void Game_free (Game_s api_s)
+size_t update_parse_raw (const tg_slice *updates, size_t count, Update_s **api_s, tg_res *res)
 {
-    free (api_s.title);
-    free (api_s.description);
-    free (api_s.text);
-    
-    OBJ_ARR_FREE (api_s.photo, api_s.photo_len, PhotoSize_free);
-    OBJ_ARR_FREE (api_s.text_entities, api_s.text_entities_len, MessageEntity_free);
+    json_t *root, *update;
+    size_t used = 0;
 
-    OBJ_FREE (api_s.animation, Animation_free);
-}
+    *api_s = NULL;
+    if (!count)
+        return 0;
 
-void animation_parse (json_t *root, Animation_s *api_s, tg_res *res)
-{
-    json_t *thumb;
+    /* Lazy and shared objects keep jansson values */
+    if (tg_lazy || tg_dedup)
+    {
+        root = json_array();
+        for (size_t i = 0; i < count; i++)
+        {
+            update = json_loadb (updates[i].ptr, updates[i].len, 0, &res->json_err);
+            if (json_array_append_new (root, update))
+            {
+                json_decref (root);
+                res->ok = TG_JSONFAIL;
+                return 0;
+            }
+        }
 
-    parse_str (root, &api_s->file_id, "file_id", res);
-    parse_str (root, &api_s->file_name, "file_name", res);
-    parse_str (root, &api_s->mime_type, "mime_type", res);
-    parse_int (root, &api_s->file_size, "file_size", res);
+        count = update_parse (root, api_s, res);
+        json_decref (root);
+        return count;
+    }
 
-    OBJ_PARSE (root, thumb, "thumb", api_s->thumb, PhotoSize_s, photosize_parse);
+    budget_begin (&used);
+    if (budget_take (sizeof (Update_s) * count, res) || alloc_obj (sizeof (Update_s) * count, api_s, res))
+    {
+        budget_end ();
+        *api_s = NULL;
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        schema_parse_raw (&Update_schema, updates[i], &(*api_s)[i], res);
+    budget_end ();
+
+    return count;
 }
 
-void Animation_free (Animation_s api_s)
+void Update_free (Update_s *api_s, size_t arr_length)
 {
-    free (api_s.file_id);
-    free (api_s.file_name);
-    free (api_s.mime_type);
-    free (api_s.file_size);
+    for (size_t i = 0; i < arr_length; i++)
+        schema_free (&Update_schema, &api_s[i]);
 
-    OBJ_FREE (api_s.thumb, PhotoSize_free);
+    release_obj (sizeof (Update_s) * arr_length, api_s);
 }
 
+/*
+ * Returns a nested member of a message, parsing it from the retained json
+ * first if the message was parsed lazily.
+ */
+
+void *lazy_get (Message_s *api_s, const char *name, tg_res *res)
+{
+    const tg_field *field = schema_field (&Message_schema, name);
+    void *base = field_base (&Message_schema, field, api_s, 0, res);
+    json_t *value;
+    size_t depth;
+
+    if (base && *(void **)((char *) base + field->offset))
+        return *(void **)((char *) base + field->offset);
+
+    if (!api_s->raw || !(value = json_object_get (api_s->raw, name)))
+        return NULL;
+
+    base = field_base (&Message_schema, field, api_s, 1, res);
+    if (!base)
+        return NULL;
+
+    /* Members nest as deep as they would have when parsed eagerly */
+    depth = depth_set (api_s->raw_depth);
+    schema_parse_value (field, value, base, res);
+    depth_set (depth);
+    return *(void **)((char *) base + field->offset);
+}
+
+LAZY_GET (message_from, from, User_s)
+LAZY_GET (message_chat, chat, Chat_s)
+LAZY_GET (message_forward_from, forward_from, User_s)
+LAZY_GET (message_forward_from_chat, forward_from_chat, Chat_s)
+LAZY_GET (message_reply_to_message, reply_to_message, Message_s)
+LAZY_GET (message_audio, audio, Audio_s)
+LAZY_GET (message_document, document, Document_s)
+LAZY_GET (message_game, game, Game_s)
+LAZY_GET (message_sticker, sticker, Sticker_s)
+LAZY_GET (message_video, video, Video_s)
+LAZY_GET (message_voice, voice, Voice_s)
+LAZY_GET (message_contact, contact, Contact_s)
+LAZY_GET (message_location, location, Location_s)
+LAZY_GET (message_venue, venue, Venue_s)
+LAZY_GET (message_new_chat_member, new_chat_member, User_s)
+LAZY_GET (message_left_chat_member, left_chat_member, User_s)
+LAZY_GET (message_pinned_message, pinned_message, Message_s)
+LAZY_GET (message_entities, entities, MessageEntity_s)
+LAZY_GET (message_photo, photo, PhotoSize_s)
+LAZY_GET (message_new_chat_photo, new_chat_photo, PhotoSize_s)
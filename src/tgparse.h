@@ -1,3 +1,5 @@
+#include <stdint.h>
+#include <stdio.h>
 #include <jansson.h>
 
 /**
@@ -17,6 +19,309 @@
 typedef struct tg_res tg_res;
 #endif
 
+//! Parse messages lazily. Set through tg_set_lazy.
+extern _Bool tg_lazy;
+
+//! Share identical users and chats within a batch. Set through tg_set_dedup.
+extern _Bool tg_dedup;
+
+//! Turns a field index into its bit in a tg_mask.
+#define TG_BIT(field) (UINT64_C(1) << (field))
+
+//! Mask with every update type or field set.
+#define TG_MASK_ALL (~UINT64_C(0))
+
+/**
+ * @brief Update types, used for tg_mask.updates and allowed_updates.
+ * @see Update_s
+ */
+typedef enum tgupdate
+{
+    //! Update_s.message
+    TG_UPDATE_MESSAGE,
+    //! Update_s.edited_message
+    TG_UPDATE_EDITED_MESSAGE,
+    //! Update_s.channel_post
+    TG_UPDATE_CHANNEL_POST,
+    //! Update_s.edited_channel_post
+    TG_UPDATE_EDITED_CHANNEL_POST,
+    //! Update_s.inline_query
+    TG_UPDATE_INLINE_QUERY,
+    //! Update_s.chosen_inline_result
+    TG_UPDATE_CHOSEN_INLINE_RESULT,
+    //! Update_s.callback_query
+    TG_UPDATE_CALLBACK_QUERY,
+    //! Number of update types
+    TG_UPDATE_COUNT
+} tgupdate;
+
+/**
+ * @brief Message_s fields, used for tg_mask.message.
+ *
+ * Named after the member they control.
+ */
+typedef enum tgmessagefield
+{
+    TG_MESSAGE_MESSAGE_ID,
+    TG_MESSAGE_FROM,
+    TG_MESSAGE_DATE,
+    TG_MESSAGE_CHAT,
+    TG_MESSAGE_FORWARD_FROM,
+    TG_MESSAGE_FORWARD_FROM_CHAT,
+    TG_MESSAGE_FORWARD_FROM_MESSAGE_ID,
+    TG_MESSAGE_FORWARD_DATE,
+    TG_MESSAGE_REPLY_TO_MESSAGE,
+    TG_MESSAGE_EDIT_DATE,
+    TG_MESSAGE_TEXT,
+    TG_MESSAGE_ENTITIES,
+    TG_MESSAGE_AUDIO,
+    TG_MESSAGE_DOCUMENT,
+    TG_MESSAGE_GAME,
+    TG_MESSAGE_PHOTO,
+    TG_MESSAGE_STICKER,
+    TG_MESSAGE_VIDEO,
+    TG_MESSAGE_VOICE,
+    TG_MESSAGE_CAPTION,
+    TG_MESSAGE_CONTACT,
+    TG_MESSAGE_LOCATION,
+    TG_MESSAGE_VENUE,
+    TG_MESSAGE_NEW_CHAT_MEMBER,
+    TG_MESSAGE_LEFT_CHAT_MEMBER,
+    TG_MESSAGE_NEW_CHAT_TITLE,
+    TG_MESSAGE_NEW_CHAT_PHOTO,
+    TG_MESSAGE_DELETE_CHAT_PHOTO,
+    TG_MESSAGE_GROUP_CHAT_CREATED,
+    TG_MESSAGE_SUPERGROUP_CHAT_CREATED,
+    TG_MESSAGE_CHANNEL_CHAT_CREATED,
+    TG_MESSAGE_MIGRATE_TO_CHAT_ID,
+    TG_MESSAGE_MIGRATE_FROM_CHAT_ID,
+    TG_MESSAGE_PINNED_MESSAGE
+} tgmessagefield;
+
+/**
+ * @brief User_s fields, used for tg_mask.user.
+ */
+typedef enum tguserfield
+{
+    TG_USER_ID,
+    TG_USER_FIRST_NAME,
+    TG_USER_LAST_NAME,
+    TG_USER_USERNAME
+} tguserfield;
+
+/**
+ * @brief Chat_s fields, used for tg_mask.chat.
+ */
+typedef enum tgchatfield
+{
+    TG_CHAT_ID,
+    TG_CHAT_TYPE,
+    TG_CHAT_TITLE,
+    TG_CHAT_USERNAME,
+    TG_CHAT_FIRST_NAME,
+    TG_CHAT_LAST_NAME,
+    TG_CHAT_ALL_MEMBERS_ARE_ADMINISTRATORS
+} tgchatfield;
+
+/**
+ * @brief Selects the updates and fields the library parses.
+ * @see tg_set_mask
+ *
+ * Every member is a set of TG_BIT() values. Fields outside the mask are left
+ * NULL. A command bot only interested in the text, chat and sender could use:
+ *
+ *     tg_mask mask = { TG_BIT (TG_UPDATE_MESSAGE),
+ *         TG_BIT (TG_MESSAGE_TEXT) | TG_BIT (TG_MESSAGE_CHAT) | TG_BIT (TG_MESSAGE_FROM),
+ *         TG_BIT (TG_USER_ID), TG_BIT (TG_CHAT_ID) };
+ */
+typedef struct tg_mask
+{
+    //! tgupdate types to request and parse
+    uint64_t updates;
+    //! tgmessagefield fields to parse
+    uint64_t message;
+    //! tguserfield fields to parse
+    uint64_t user;
+    //! tgchatfield fields to parse
+    uint64_t chat;
+} tg_mask;
+
+//! Active parse mask. Set through tg_set_mask.
+extern tg_mask tg_parse_mask;
+
+/**
+ * @brief Bounds on what a response may make the library allocate.
+ * @see tg_set_limits
+ *
+ * A limit of 0 disables it. Exceeding any of them sets tg_res.ok to
+ * TG_LIMITFAIL.
+ */
+typedef struct tg_limits
+{
+    //! Largest response body accepted, in bytes
+    size_t response_size;
+    //! Deepest nesting of objects and arrays parsed below an update or result
+    size_t depth;
+    //! Most elements parsed per array, e.g. entities or photo sizes
+    size_t array_len;
+    //! Bytes a batch of updates may allocate while parsing
+    size_t batch_bytes;
+} tg_limits;
+
+//! Active limits. Set through tg_set_limits.
+extern tg_limits tg_parse_limits;
+
+/*
+ * Strings interned by the parser. X (tgstr value, string)
+ */
+
+#define TG_STRINGS(X)\
+    X (TG_STR_PRIVATE, "private")\
+    X (TG_STR_GROUP, "group")\
+    X (TG_STR_SUPERGROUP, "supergroup")\
+    X (TG_STR_CHANNEL, "channel")\
+    X (TG_STR_MENTION, "mention")\
+    X (TG_STR_HASHTAG, "hashtag")\
+    X (TG_STR_BOT_COMMAND, "bot_command")\
+    X (TG_STR_URL, "url")\
+    X (TG_STR_EMAIL, "email")\
+    X (TG_STR_BOLD, "bold")\
+    X (TG_STR_ITALIC, "italic")\
+    X (TG_STR_CODE, "code")\
+    X (TG_STR_PRE, "pre")\
+    X (TG_STR_TEXT_LINK, "text_link")\
+    X (TG_STR_TEXT_MENTION, "text_mention")\
+    X (TG_STR_AUDIO_MPEG, "audio/mpeg")\
+    X (TG_STR_AUDIO_OGG, "audio/ogg")\
+    X (TG_STR_VIDEO_MP4, "video/mp4")\
+    X (TG_STR_IMAGE_GIF, "image/gif")\
+    X (TG_STR_IMAGE_JPEG, "image/jpeg")\
+    X (TG_STR_APPLICATION_PDF, "application/pdf")\
+    X (TG_STR_APPLICATION_ZIP, "application/zip")
+
+#define TG_STRING_ENUM(id, str) id,
+
+/**
+ * @brief Well known values of interned fields.
+ * @see tg_strings tg_str_id
+ *
+ * Chat_s.type, MessageEntity_s.type and the mime_type members point at
+ * shared, immutable strings instead of private copies. Their well known
+ * values can be compared by pointer against tg_strings, e.g.
+ * `chat->type == tg_strings[TG_STR_PRIVATE]`, or switched on through
+ * tg_str_id. Other values of these fields are interned as they are seen,
+ * up to a fixed table size.
+ */
+typedef enum tgstr
+{
+    TG_STRINGS (TG_STRING_ENUM)
+    //! Not a well known string
+    TG_STR_COUNT
+} tgstr;
+
+//! Interned well known strings, indexed by tgstr.
+extern const char *const tg_strings[TG_STR_COUNT];
+
+/**
+ * @brief Returns the tgstr value of a string.
+ *
+ * @param str String to look up. May be NULL.
+ *
+ * @returns The matching tgstr or TG_STR_COUNT if \p str isn't well known.
+ */
+tgstr tg_str_id (const char *str);
+
+/**
+ * @brief Memory allocation hooks.
+ * @see tg_set_allocator
+ *
+ * Every function receives the calling thread's context, see
+ * tg_set_thread_alloc_ctx, or tg_allocator.ctx if the thread has none.
+ *
+ * free_fn and realloc_fn get the context of the thread freeing, not of the
+ * one that allocated. Memory regularly changes threads: the parse pool's
+ * workers allocate updates the polling thread frees, and the object pool
+ * hands freed objects out again on the thread that freed them. The hooks
+ * must therefore accept memory allocated under any context, as jemalloc's
+ * arenas do, and find its owner from the pointer if it matters.
+ */
+typedef struct tg_allocator
+{
+    //! Allocates \p size bytes, like malloc.
+    void *(*alloc_fn) (size_t size, void *ctx);
+    //! Optional. Resizes an allocation, like realloc.
+    void *(*realloc_fn) (void *ptr, size_t size, void *ctx);
+    //! Frees an allocation, like free.
+    void (*free_fn) (void *ptr, void *ctx);
+    //! Default context
+    void *ctx;
+} tg_allocator;
+
+//! Active allocator. Set through tg_set_allocator.
+extern tg_allocator tg_active_allocator;
+//! Allocator context of the current thread, NULL to use tg_allocator.ctx.
+extern __thread void *tg_thread_alloc_ctx;
+
+/**
+ * @brief Allocates memory through the active allocator.
+ *
+ * @param size Bytes to allocate.
+ *
+ * @returns The allocation or NULL.
+ */
+void *tg_malloc (size_t size);
+
+/**
+ * @brief Resizes memory allocated through the active allocator.
+ *
+ * Falls back to allocating, copying and freeing if the allocator has no
+ * realloc_fn.
+ *
+ * @param ptr Allocation to resize. May be NULL.
+ * @param old_size Current size of the allocation.
+ * @param size New size.
+ *
+ * @returns The resized allocation or NULL, in which case \p ptr is untouched.
+ */
+void *tg_realloc (void *ptr, size_t old_size, size_t size);
+
+/**
+ * @brief Frees memory allocated through the active allocator.
+ *
+ * @param ptr Allocation to free. May be NULL.
+ */
+void tg_free (void *ptr);
+
+//! malloc based tg_allocator.alloc_fn
+void *tg_libc_alloc (size_t size, void *ctx);
+//! realloc based tg_allocator.realloc_fn
+void *tg_libc_realloc (void *ptr, size_t size, void *ctx);
+//! free based tg_allocator.free_fn
+void tg_libc_free (void *ptr, void *ctx);
+
+/**
+ * @brief Object pool statistics of a thread.
+ * @see tg_get_pool_stats
+ */
+typedef struct tg_pool_stats
+{
+    //! Allocations served from the pool
+    size_t hits;
+    //! Allocations that went to malloc
+    size_t misses;
+    //! Objects put back into the pool
+    size_t released;
+    //! Objects freed because the pool was full or disabled
+    size_t dropped;
+    //! Objects currently held by the pool
+    size_t retained;
+} tg_pool_stats;
+
+//! Objects retained per size class and thread. Set through tg_set_pool_retain.
+extern size_t pool_retain;
+//! Pool statistics of the current thread.
+extern __thread tg_pool_stats pool_stats;
+
 /**
  * @brief Copies a string from a json object to a target.
  * @see parse_int parse_bool parse_double
@@ -63,13 +368,66 @@ void parse_double (json_t *root, double **target, char *field, tg_res *res);
 
 /**
  * @brief Allocated memory for an object.
- * 
+ * @see release_obj
+ *
+ * Reuses an object of the same size class from the thread's pool if there
+ * is one. Objects up to 512 bytes are pooled.
+ *
  * @param obj_size Size of allocation. `sizeof (obj)`
  * @param target Allocation target.
  * @param res Error object.
  */
 _Bool alloc_obj (size_t obj_size, void *target, tg_res *res);
 
+/**
+ * @brief Releases an object allocated by alloc_obj.
+ * @see alloc_obj
+ *
+ * Keeps the object in the thread's pool for reuse, or frees it once the
+ * pool holds tg_set_pool_retain objects of its size class, or if it is too
+ * large to be pooled.
+ *
+ * @param obj_size Size the object was allocated with.
+ * @param obj Object to release. May be NULL.
+ */
+void release_obj (size_t obj_size, void *obj);
+
+/**
+ * @brief Frees every object held by the current thread's pool.
+ *
+ * Done automatically when a thread exits.
+ */
+void pool_drain (void);
+
+/**
+ * @brief Sums the pool statistics of every thread.
+ *
+ * Threads that exited are included, with nothing retained.
+ *
+ * @param stats Filled in with the totals.
+ */
+void pool_totals (tg_pool_stats *stats);
+
+/**
+ * @brief Starts the worker pool used to parse large update batches.
+ * @see tg_set_parse_threads
+ *
+ * Stops any previously started pool first.
+ *
+ * @param threads Number of worker threads. 0 only stops the pool.
+ * @param min_batch Smallest batch that is parsed in parallel.
+ * @param res Error object.
+ *
+ * @returns 0 on success and 1 on error.
+ */
+_Bool parse_pool_start (size_t threads, size_t min_batch, tg_res *res);
+
+/**
+ * @brief Stops and joins the parse worker pool.
+ * @see parse_pool_start
+ */
+void parse_pool_stop (void);
+
 /**
  * @brief Parses an array of Updates.
  * @see Update_s
@@ -282,6 +640,667 @@ void animation_parse (json_t *root, Animation_s *api_s, tg_res *res);
 
 /**@}*/
 
+/**
+ * @defgroup group9 Message accessors
+ * @brief Functions to retrieve the nested objects of a message.
+ * @see tg_set_lazy
+ *
+ * If the message was parsed lazily the nested object is parsed on first
+ * access and stored in the message, otherwise the already parsed member
+ * is returned. Accessors are not safe to call on the same message from
+ * different threads at once.
+ *
+ * Each accessor takes the message and an error object and returns the
+ * member of the same name, or NULL if the message doesn't contain it. The
+ * array accessors also fill in the matching `_len` member.
+ *
+ * Rarely set members live in Message_s.extras. Accessors find them there,
+ * scalar members are read with MESSAGE_EXTRA.
+ * @{
+ */
+
+/**
+ * @brief Reads a member of Message_extras_s.
+ *
+ * Evaluates to the member, or 0 if the message has no extras, e.g.
+ * `MESSAGE_EXTRA (msg, migrate_to_chat_id)` or
+ * `MESSAGE_EXTRA (msg, new_chat_photo_len)`.
+ */
+#define MESSAGE_EXTRA(msg, member) ((msg)->extras ? (msg)->extras->member : 0)
+
+//! Returns Message_s.from
+User_s *message_from (Message_s *api_s, tg_res *res);
+//! Returns Message_s.chat
+Chat_s *message_chat (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.forward_from
+User_s *message_forward_from (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.forward_from_chat
+Chat_s *message_forward_from_chat (Message_s *api_s, tg_res *res);
+//! Returns Message_s.reply_to_message
+Message_s *message_reply_to_message (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.audio
+Audio_s *message_audio (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.document
+Document_s *message_document (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.game
+Game_s *message_game (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.sticker
+Sticker_s *message_sticker (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.video
+Video_s *message_video (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.voice
+Voice_s *message_voice (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.contact
+Contact_s *message_contact (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.location
+Location_s *message_location (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.venue
+Venue_s *message_venue (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.new_chat_member
+User_s *message_new_chat_member (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.left_chat_member
+User_s *message_left_chat_member (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.pinned_message
+Message_s *message_pinned_message (Message_s *api_s, tg_res *res);
+//! Returns Message_s.entities, length in Message_s.entities_len
+MessageEntity_s *message_entities (Message_s *api_s, tg_res *res);
+//! Returns Message_s.photo, length in Message_s.photo_len
+PhotoSize_s *message_photo (Message_s *api_s, tg_res *res);
+//! Returns Message_extras_s.new_chat_photo, length in Message_extras_s.new_chat_photo_len
+PhotoSize_s *message_new_chat_photo (Message_s *api_s, tg_res *res);
+
+/**@}*/
+
+/**
+ * @defgroup group13 Entity slices
+ * @brief Conversion between UTF-16 entity offsets and UTF-8 text.
+ *
+ * Telegram counts MessageEntity_s.offset and MessageEntity_s.length in
+ * UTF-16 code units while the text is stored as UTF-8. These functions map
+ * all the entities of a text in a single pass over it, skipping runs of
+ * ASCII with the vectorized scanners of the parser.
+ * @{
+ */
+
+/**
+ * @brief A zero-copy range of a UTF-8 string.
+ */
+typedef struct tg_slice
+{
+    //! Start of the range, points into the text
+    const char *ptr;
+    //! Length of the range in bytes
+    size_t len;
+} tg_slice;
+
+/**
+ * @brief Parses updates from their json text.
+ * @see update_parse schema_parse_raw
+ *
+ * Reads the text directly and decodes strings straight into the updates,
+ * without building jansson values. Falls back to update_parse when lazy
+ * parsing or sharing is enabled, as both keep jansson values around.
+ *
+ * @param updates Json text of each update, e.g. from getUpdatesRaw.
+ * @param count Number of updates.
+ * @param api_s Target for the array of updates.
+ * @param res Error object.
+ *
+ * @returns The number of updates in \p api_s.
+ */
+size_t update_parse_raw (const tg_slice *updates, size_t count, Update_s **api_s, tg_res *res);
+
+/**
+ * @brief Maps entities to the byte ranges of their text.
+ *
+ * Entities may be given in any order and may nest.
+ *
+ * @param text UTF-8 text the entities refer to.
+ * @param length Length of \p text in bytes.
+ * @param entities Entities with offset and length set.
+ * @param count Number of entities.
+ * @param slices Receives the range of each entity, \p count elements.
+ * @param res Error object, TG_RANGEFAIL if an entity lies outside of the
+ * text or splits a character.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_entity_slices (const char *text, size_t length, const MessageEntity_s *entities,
+        size_t count, tg_slice *slices, tg_res *res);
+
+/**
+ * @brief Maps the entities of a message to the byte ranges of its text.
+ * @see tg_entity_slices
+ *
+ * Works on lazily parsed messages as well.
+ *
+ * @param api_s Message with text and entities.
+ * @param slices Receives the range of each entity, Message_s.entities_len
+ * elements.
+ * @param res Error object.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool message_entity_slices (Message_s *api_s, tg_slice *slices, tg_res *res);
+
+/**
+ * @brief Maps byte ranges of a text to UTF-16 entity offsets.
+ *
+ * The reverse of tg_entity_slices, for building the entities of outbound
+ * messages. Slices may be given in any order and may nest.
+ *
+ * @param text UTF-8 text the slices point into.
+ * @param length Length of \p text in bytes.
+ * @param slices Ranges of \p text.
+ * @param count Number of slices.
+ * @param offsets Receives the UTF-16 offset of each slice.
+ * @param lengths Receives the UTF-16 length of each slice.
+ * @param res Error object, TG_RANGEFAIL if a slice lies outside of the text
+ * or splits a character.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_slice_offsets (const char *text, size_t length, const tg_slice *slices, size_t count,
+        json_int_t *offsets, json_int_t *lengths, tg_res *res);
+
+/**@}*/
+
+/**
+ * @defgroup group11 Type copiers
+ * @brief Functions to deep copy Telegram types.
+ *
+ * Each copier takes the object to copy, the target object and an error
+ * object. The copy owns all of its members and is freed with the type's
+ * freer like a parsed object.
+ * @{
+ */
+
+//! Copies an Update type. @see Update_free
+void update_copy (const Update_s *src, Update_s *api_s, tg_res *res);
+
+//! Copies an User type. @see User_free
+void user_copy (const User_s *src, User_s *api_s, tg_res *res);
+
+//! Copies a Chat type. @see Chat_free
+void chat_copy (const Chat_s *src, Chat_s *api_s, tg_res *res);
+
+//! Copies a Message type. @see Message_free
+void message_copy (const Message_s *src, Message_s *api_s, tg_res *res);
+
+//! Copies a MessageEntity type. @see MessageEntity_free
+void messageentity_copy (const MessageEntity_s *src, MessageEntity_s *api_s, tg_res *res);
+
+//! Copies a PhotoSize type. @see PhotoSize_free
+void photosize_copy (const PhotoSize_s *src, PhotoSize_s *api_s, tg_res *res);
+
+//! Copies an Audio type. @see Audio_free
+void audio_copy (const Audio_s *src, Audio_s *api_s, tg_res *res);
+
+//! Copies a Document type. @see Document_free
+void document_copy (const Document_s *src, Document_s *api_s, tg_res *res);
+
+//! Copies a Sticker type. @see Sticker_free
+void sticker_copy (const Sticker_s *src, Sticker_s *api_s, tg_res *res);
+
+//! Copies a Video type. @see Video_free
+void video_copy (const Video_s *src, Video_s *api_s, tg_res *res);
+
+//! Copies a Voice type. @see Voice_free
+void voice_copy (const Voice_s *src, Voice_s *api_s, tg_res *res);
+
+//! Copies a Contact type. @see Contact_free
+void contact_copy (const Contact_s *src, Contact_s *api_s, tg_res *res);
+
+//! Copies a Location type. @see Location_free
+void location_copy (const Location_s *src, Location_s *api_s, tg_res *res);
+
+//! Copies a Venue type. @see Venue_free
+void venue_copy (const Venue_s *src, Venue_s *api_s, tg_res *res);
+
+//! Copies an UserProfilePhotos type. @see UserProfilePhotos_free
+void userprofilephotos_copy (const UserProfilePhotos_s *src, UserProfilePhotos_s *api_s, tg_res *res);
+
+//! Copies a File type. @see File_free
+void file_copy (const File_s *src, File_s *api_s, tg_res *res);
+
+//! Copies a CallbackQuery type. @see CallbackQuery_free
+void callbackquery_copy (const CallbackQuery_s *src, CallbackQuery_s *api_s, tg_res *res);
+
+//! Copies an InlineQuery type. @see InlineQuery_free
+void inlinequery_copy (const InlineQuery_s *src, InlineQuery_s *api_s, tg_res *res);
+
+//! Copies a ChosenInlineResult type. @see ChosenInlineResult_free
+void choseninlineresult_copy (const ChosenInlineResult_s *src, ChosenInlineResult_s *api_s, tg_res *res);
+
+//! Copies a Game type. @see Game_free
+void game_copy (const Game_s *src, Game_s *api_s, tg_res *res);
+
+//! Copies an Animation type. @see Animation_free
+void animation_copy (const Animation_s *src, Animation_s *api_s, tg_res *res);
+
+/**@}*/
+
+/**
+ * @defgroup group15 Type writers
+ * @brief Functions to serialize Telegram types to json.
+ *
+ * Each writer appends the compact json of an object to a growable buffer
+ * without building a json tree. Members that are not set are left out, so
+ * the output parses back into an equal object. Reals that are NaN or
+ * infinite have no json form and are written as null. Lazily parsed
+ * messages write their unparsed members from the retained json.
+ *
+ * Each writer takes the object, the buffer and an error object and
+ * returns 0 on success, 1 on error.
+ * @{
+ */
+
+/**
+ * @brief Growable output buffer of the writers.
+ * @see tg_buffer_free
+ *
+ * Start with a zeroed buffer, or reset size to 0 to reuse one. The data is
+ * kept NUL terminated.
+ */
+typedef struct tg_buffer
+{
+    //! Written bytes
+    char *data;
+    //! Number of written bytes
+    size_t size;
+    //! Allocated bytes
+    size_t capacity;
+} tg_buffer;
+
+/**
+ * @brief Frees the data of a buffer.
+ *
+ * @param buf Buffer to free. It is left empty and may be reused.
+ */
+void tg_buffer_free (tg_buffer *buf);
+
+//! Writes an Update type.
+_Bool update_to_json (const Update_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes an User type.
+_Bool user_to_json (const User_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a Chat type.
+_Bool chat_to_json (const Chat_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a Message type.
+_Bool message_to_json (const Message_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a MessageEntity type.
+_Bool messageentity_to_json (const MessageEntity_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a PhotoSize type.
+_Bool photosize_to_json (const PhotoSize_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes an Audio type.
+_Bool audio_to_json (const Audio_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a Document type.
+_Bool document_to_json (const Document_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a Sticker type.
+_Bool sticker_to_json (const Sticker_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a Video type.
+_Bool video_to_json (const Video_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a Voice type.
+_Bool voice_to_json (const Voice_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a Contact type.
+_Bool contact_to_json (const Contact_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a Location type.
+_Bool location_to_json (const Location_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a Venue type.
+_Bool venue_to_json (const Venue_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes an UserProfilePhotos type.
+_Bool userprofilephotos_to_json (const UserProfilePhotos_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a File type.
+_Bool file_to_json (const File_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a CallbackQuery type.
+_Bool callbackquery_to_json (const CallbackQuery_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes an InlineQuery type.
+_Bool inlinequery_to_json (const InlineQuery_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a ChosenInlineResult type.
+_Bool choseninlineresult_to_json (const ChosenInlineResult_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes a Game type.
+_Bool game_to_json (const Game_s *api_s, tg_buffer *buf, tg_res *res);
+
+//! Writes an Animation type.
+_Bool animation_to_json (const Animation_s *api_s, tg_buffer *buf, tg_res *res);
+/**@}*/
+
+/**
+ * @defgroup group16 Flat encoding
+ * @brief Binary form of update batches that is read in place.
+ *
+ * A batch of updates is encoded into one block of memory that holds only
+ * relative offsets, so it can be written to a file or a shared memory
+ * segment and read back through mmap without being parsed again.
+ *
+ * The block starts with TG_FLAT_MAGIC, the number of updates and the
+ * offset of each update. Every object is a table: a 64 bit mask of the
+ * fields it has, bit i for the i-th member in tgtypes.h order, followed by
+ * one 8 byte slot per present field. Integers, bools and reals are stored
+ * in their slot, strings, objects and arrays as the offset from the slot to
+ * their data. Strings are NUL terminated, so they can be used in place.
+ * Numbers are in the byte order of the encoding host and offsets are 32
+ * bits, which limits a batch to 4 GiB.
+ *
+ * The accessors take the json name of a member, which is also its name in
+ * tgtypes.h, and return 0 or NULL for members that are missing or of a
+ * different kind. Members of the extras of a Message are members of the
+ * Message itself here.
+ * @{
+ */
+
+//! First bytes of an encoded batch
+#define TG_FLAT_MAGIC "TGF1"
+
+/**
+ * @brief An object inside an encoded batch.
+ */
+typedef struct tg_flat
+{
+    //! Table of the object, NULL if the object is missing
+    const unsigned char *table;
+    //! Type of the object
+    const struct tg_schema *schema;
+} tg_flat;
+
+/**
+ * @brief Encodes a batch of updates.
+ *
+ * Members of lazily parsed messages that weren't accessed yet are parsed
+ * into the messages first. If one of them fails to parse the encoding
+ * fails with its error rather than leaving the member out. \p res has to
+ * be TG_OKAY on entry.
+ *
+ * @param api_s Updates to encode.
+ * @param count Number of updates.
+ * @param buf Buffer receiving the encoding, its previous contents are
+ * dropped.
+ * @param res Error object, TG_LIMITFAIL if the batch exceeds 4 GiB.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool update_to_flat (const Update_s *api_s, size_t count, tg_buffer *buf, tg_res *res);
+
+/**
+ * @brief Checks an encoded batch.
+ *
+ * Every table, offset and length of the batch is checked against \p size
+ * and the types of the members, so the accessors never read outside a
+ * batch that passed, even if it didn't come from update_to_flat. This
+ * walks the whole batch once.
+ *
+ * @param data Encoded batch.
+ * @param size Size of \p data in bytes.
+ * @param count Set to the number of updates.
+ * @param res Error object, TG_FORMATFAIL if \p data isn't a batch.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_flat_open (const void *data, size_t size, size_t *count, tg_res *res);
+
+/**
+ * @brief Returns an update of an encoded batch.
+ *
+ * @param data Batch checked by tg_flat_open.
+ * @param index Index of the update, below the count of the batch.
+ */
+tg_flat tg_flat_update (const void *data, size_t index);
+
+/**
+ * @brief Checks whether an object has a member.
+ *
+ * @param obj Object to look in.
+ * @param name Name of the member.
+ */
+_Bool tg_flat_has (tg_flat obj, const char *name);
+
+//! Returns an integer member, 0 if it is missing.
+json_int_t tg_flat_int (tg_flat obj, const char *name);
+
+//! Returns a bool member, 0 if it is missing.
+_Bool tg_flat_bool (tg_flat obj, const char *name);
+
+//! Returns a real member, 0 if it is missing.
+double tg_flat_real (tg_flat obj, const char *name);
+
+/**
+ * @brief Returns a string member.
+ *
+ * @param obj Object to look in.
+ * @param name Name of the member.
+ * @param length Set to the length of the string, may be NULL.
+ *
+ * @returns The NUL terminated string inside the batch, NULL if it is missing.
+ */
+const char *tg_flat_str (tg_flat obj, const char *name, size_t *length);
+
+//! Returns an object member, its table is NULL if it is missing.
+tg_flat tg_flat_obj (tg_flat obj, const char *name);
+
+//! Returns the length of an array member, 0 if it is missing.
+size_t tg_flat_len (tg_flat obj, const char *name);
+
+/**
+ * @brief Returns an element of an array member.
+ *
+ * @param obj Object to look in.
+ * @param name Name of the array.
+ * @param index Index of the element.
+ *
+ * @returns The element, its table is NULL if the array is missing or
+ * \p index is out of range.
+ */
+tg_flat tg_flat_at (tg_flat obj, const char *name, size_t index);
+/**@}*/
+
+/**
+ * @defgroup group17 Columnar batches
+ * @brief Struct of arrays view over a batch of updates.
+ *
+ * update_columns copies the commonly scanned members of a batch into
+ * contiguous columns, so scans and counts over a batch read sequential
+ * memory instead of following pointers per update.
+ *
+ * The message of an update is its message, edited message or channel post,
+ * or the message of its callback query. Missing values are 0.
+ * @{
+ */
+
+/**
+ * @brief Columns of a batch of updates.
+ * @see tg_columns_free
+ *
+ * All columns have one entry per update and live in a single allocation.
+ * Columns read from an archive that weren't selected are NULL.
+ */
+typedef struct tg_columns
+{
+    //! Number of updates
+    size_t count;
+    //! Update_s.update_id
+    json_int_t *update_id;
+    //! tgupdate of each update, TG_UPDATE_COUNT if it has no known object
+    unsigned char *type;
+    //! Message_s.chat id of the message
+    json_int_t *chat_id;
+    //! User_s.id of the sender of the update's object
+    json_int_t *from_id;
+    //! Message_s.message_id of the message
+    json_int_t *message_id;
+    //! Message_s.date of the message
+    json_int_t *date;
+    //! Start of Message_s.text of update i in text, count + 1 entries
+    size_t *text_offset;
+    //! Texts of all messages back to back, not NUL separated
+    char *text;
+    //! tgstr of Chat_s.type of the message, TG_STR_COUNT if unknown
+    unsigned char *chat_type;
+    //! Start of the entities of update i in entity_type, count + 1 entries
+    size_t *entity_offset;
+    //! tgstr of MessageEntity_s.type of all messages back to back
+    unsigned char *entity_type;
+    //! Allocation holding the columns
+    void *block;
+} tg_columns;
+
+/**
+ * @brief Fills the columns of a batch of updates.
+ *
+ * Members of lazily parsed messages are parsed when needed.
+ *
+ * @param api_s Updates of the batch.
+ * @param count Number of updates.
+ * @param cols Columns to fill, previous contents are overwritten. Left
+ * empty on error.
+ * @param res Error object, also set if a lazy member fails to parse.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool update_columns (Update_s *api_s, size_t count, tg_columns *cols, tg_res *res);
+
+/**
+ * @brief Frees the columns of a batch.
+ *
+ * @param cols Columns to free, left empty.
+ */
+void tg_columns_free (tg_columns *cols);
+
+/**
+ * @brief Counts the entries of a column equal to a value.
+ *
+ * Written to be vectorized by the compiler, e.g. counting the updates of a
+ * chat with `tg_column_count (cols.chat_id, cols.count, chat_id)`.
+ *
+ * @param column Column to scan.
+ * @param count Number of entries.
+ * @param value Value to count.
+ */
+size_t tg_column_count (const json_int_t *column, size_t count, json_int_t value);
+/**@}*/
+
+/**
+ * @defgroup group18 Update archives
+ * @brief Column chunked files of received updates.
+ *
+ * An archive is TG_ARCHIVE_MAGIC followed by one row group per appended
+ * batch. A row group holds the row count and one chunk per column of
+ * tg_columns, each tagged with its tgcolumn and byte length, so a reader
+ * skips the columns it doesn't need without decoding them.
+ *
+ * All numbers are LEB128 varints. Ids and dates are stored as zigzag
+ * deltas from the previous row, texts as their lengths followed by the
+ * bytes, and chat and entity types through a dictionary of the strings
+ * used in the chunk, so archives don't depend on the order of tgstr.
+ * @{
+ */
+
+//! First bytes of an archive
+#define TG_ARCHIVE_MAGIC "TGA1"
+
+/**
+ * @brief Columns of an archive, bit i of a projection selects column i.
+ */
+typedef enum tgcolumn
+{
+    //! tg_columns.update_id
+    TG_COLUMN_UPDATE_ID,
+    //! tg_columns.type
+    TG_COLUMN_TYPE,
+    //! tg_columns.chat_id
+    TG_COLUMN_CHAT_ID,
+    //! tg_columns.chat_type
+    TG_COLUMN_CHAT_TYPE,
+    //! tg_columns.from_id
+    TG_COLUMN_FROM_ID,
+    //! tg_columns.message_id
+    TG_COLUMN_MESSAGE_ID,
+    //! tg_columns.date
+    TG_COLUMN_DATE,
+    //! tg_columns.text and text_offset
+    TG_COLUMN_TEXT,
+    //! tg_columns.entity_type and entity_offset
+    TG_COLUMN_ENTITY_TYPE,
+    //! Number of columns
+    TG_COLUMN_COUNT
+} tgcolumn;
+
+/**
+ * @brief An archive open for reading.
+ * @see tg_archive_open
+ */
+typedef struct tg_archive
+{
+    //! The archive file
+    FILE *file;
+} tg_archive;
+
+/**
+ * @brief Appends a batch of updates to an archive.
+ *
+ * Creates the archive if it doesn't exist. Empty batches aren't written.
+ *
+ * @param path Path of the archive.
+ * @param api_s Updates of the batch.
+ * @param count Number of updates.
+ * @param res Error object, TG_NOTOKAY if the file can't be written.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_archive_append (const char *path, Update_s *api_s, size_t count, tg_res *res);
+
+/**
+ * @brief Opens an archive for reading.
+ * @see tg_archive_close
+ *
+ * @param archive Archive to open.
+ * @param path Path of the archive.
+ * @param res Error object, TG_NOTOKAY if the file can't be opened,
+ * TG_FORMATFAIL if it isn't an archive.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_archive_open (tg_archive *archive, const char *path, tg_res *res);
+
+/**
+ * @brief Reads the next row group of an archive.
+ *
+ * @param archive Open archive.
+ * @param columns Projection, a set of TG_BIT() of tgcolumn values. Other
+ * columns are skipped and left NULL.
+ * @param cols Set to the columns of the row group, to be freed with
+ * tg_columns_free. Its count is 0 at the end of the archive.
+ * @param res Error object, TG_FORMATFAIL if the archive is malformed.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool tg_archive_next (tg_archive *archive, uint64_t columns, tg_columns *cols, tg_res *res);
+
+/**
+ * @brief Closes an archive.
+ *
+ * @param archive Archive to close.
+ */
+void tg_archive_close (tg_archive *archive);
+/**@}*/
+
 /**
  * @defgroup group4 Type Freers
  * @brief Methods to clean up Telegram types.
@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tgraw.h"
+
+/**
+ * @file
+ * @brief Scanner locating values in raw json without building a tree.
+ */
+
+/*
+ * Skips whitespace.
+ */
+
+const char *raw_space (const char *pos, const char *end)
+{
+    while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r'))
+        pos++;
+
+    return pos;
+}
+
+/*
+ * Returns the end of the string whose opening quote is at pos, NULL if it
+ * isn't terminated.
+ */
+
+const char *raw_string_end (const char *pos, const char *end)
+{
+    pos++;
+
+    while (pos < end)
+    {
+        pos += text_span (pos, end - pos);
+
+        if (pos == end)
+            break;
+
+        if (*pos == '"')
+            return pos + 1;
+
+        /* Escapes are two characters, the \u digits are plain */
+        pos += *pos == '\\' ? 2 : 1;
+    }
+
+    return NULL;
+}
+
+const char *raw_value_end (const char *pos, const char *end)
+{
+    size_t depth = 0;
+
+    pos = raw_space (pos, end);
+    if (pos == end)
+        return NULL;
+
+    /* Numbers and literals end at the first delimiter */
+    if (*pos != '"' && *pos != '{' && *pos != '[')
+    {
+        while (pos < end && !strchr (",:}] \t\n\r", *pos))
+            pos++;
+
+        return pos;
+    }
+
+    do
+    {
+        switch (*pos)
+        {
+            case '"':
+                pos = raw_string_end (pos, end);
+                if (!pos)
+                    return NULL;
+                continue;
+
+            case '{':
+            case '[':
+                depth++;
+                break;
+
+            case '}':
+            case ']':
+                depth--;
+                break;
+        }
+
+        pos++;
+    } while (depth && pos < end);
+
+    return depth ? NULL : pos;
+}
+
+_Bool raw_object_begin (tg_slice object, raw_iter *iter)
+{
+    iter->end = object.ptr + object.len;
+    iter->pos = raw_space (object.ptr, iter->end);
+
+    if (iter->pos == iter->end || *iter->pos != '{')
+    {
+        iter->pos = NULL;
+        return 1;
+    }
+
+    iter->pos = raw_space (iter->pos + 1, iter->end);
+    return 0;
+}
+
+_Bool raw_object_next (raw_iter *iter, tg_slice *key, tg_slice *value)
+{
+    const char *pos = iter->pos, *end = iter->end, *key_end;
+
+    if (!pos || (pos < end && *pos == '}'))
+        return 0;
+
+    if (pos == end || *pos != '"' || !(key_end = raw_string_end (pos, end)))
+        goto malformed;
+
+    *key = (tg_slice){ pos + 1, key_end - pos - 2 };
+
+    pos = raw_space (key_end, end);
+    if (pos == end || *pos != ':')
+        goto malformed;
+
+    value->ptr = raw_space (pos + 1, end);
+    pos = raw_value_end (value->ptr, end);
+    if (!pos || pos == value->ptr)
+        goto malformed;
+
+    value->len = pos - value->ptr;
+
+    pos = raw_space (pos, end);
+    if (pos < end && *pos == ',')
+        iter->pos = raw_space (pos + 1, end);
+    else if (pos < end && *pos == '}')
+        iter->pos = pos;
+    else
+        goto malformed;
+
+    return 1;
+
+malformed:
+    iter->pos = NULL;
+    return 0;
+}
+
+_Bool raw_member (tg_slice object, const char *key, tg_slice *value)
+{
+    size_t key_len = strlen (key);
+    tg_slice name;
+    raw_iter iter;
+
+    if (raw_object_begin (object, &iter))
+        return 0;
+
+    while (raw_object_next (&iter, &name, value))
+        if (name.len == key_len && !memcmp (name.ptr, key, key_len))
+            return 1;
+
+    return 0;
+}
+
+_Bool raw_array_begin (tg_slice array, raw_iter *iter)
+{
+    iter->end = array.ptr + array.len;
+    iter->pos = raw_space (array.ptr, iter->end);
+
+    if (iter->pos == iter->end || *iter->pos != '[')
+    {
+        iter->pos = NULL;
+        return 1;
+    }
+
+    iter->pos = raw_space (iter->pos + 1, iter->end);
+    return 0;
+}
+
+_Bool raw_array_next (raw_iter *iter, tg_slice *element)
+{
+    const char *value_end;
+
+    if (!iter->pos || iter->pos == iter->end || *iter->pos == ']')
+    {
+        if (iter->pos == iter->end)
+            iter->pos = NULL;
+        return 0;
+    }
+
+    value_end = raw_value_end (iter->pos, iter->end);
+    if (!value_end || value_end == iter->pos)
+    {
+        iter->pos = NULL;
+        return 0;
+    }
+
+    element->ptr = iter->pos;
+    element->len = value_end - iter->pos;
+
+    iter->pos = raw_space (value_end, iter->end);
+    if (iter->pos < iter->end && *iter->pos == ',')
+        iter->pos = raw_space (iter->pos + 1, iter->end);
+    else if (iter->pos == iter->end || *iter->pos != ']')
+        iter->pos = NULL;
+
+    return 1;
+}
+
+_Bool raw_integer (tg_slice value, long long *number)
+{
+    char digits[24];
+    char *digits_end;
+
+    if (!value.len || value.len >= sizeof (digits))
+        return 1;
+
+    memcpy (digits, value.ptr, value.len);
+    digits[value.len] = '\0';
+
+    *number = strtoll (digits, &digits_end, 10);
+    return digits_end != digits + value.len;
+}
+
+/*
+ * Returns the type of an update and its object.
+ */
+
+tgupdate raw_update_object (tg_slice update, tg_slice *object)
+{
+    tg_slice key;
+    raw_iter iter;
+
+    if (raw_object_begin (update, &iter))
+        return TG_UPDATE_COUNT;
+
+    while (raw_object_next (&iter, &key, object))
+        for (int i = 0; i < TG_UPDATE_COUNT; i++)
+            if (key.len == strlen (update_types[i]) && !memcmp (key.ptr, update_types[i], key.len))
+                return i;
+
+    return TG_UPDATE_COUNT;
+}
+
+/*
+ * Returns the message of an update, the message a callback query belongs
+ * to included.
+ */
+
+_Bool raw_update_message (tg_slice update, tg_slice *message)
+{
+    switch (raw_update_object (update, message))
+    {
+        case TG_UPDATE_MESSAGE:
+        case TG_UPDATE_EDITED_MESSAGE:
+        case TG_UPDATE_CHANNEL_POST:
+        case TG_UPDATE_EDITED_CHANNEL_POST:
+            return 0;
+
+        case TG_UPDATE_CALLBACK_QUERY:
+            return !raw_member (*message, "message", message);
+
+        default:
+            return 1;
+    }
+}
+
+tgupdate tg_raw_update_type (tg_slice update)
+{
+    tg_slice object;
+
+    return raw_update_object (update, &object);
+}
+
+_Bool tg_raw_chat_id (tg_slice update, long long *chat_id)
+{
+    tg_slice value;
+
+    return raw_update_message (update, &value) || !raw_member (value, "chat", &value)
+        || !raw_member (value, "id", &value) || raw_integer (value, chat_id);
+}
+
+_Bool tg_raw_from_id (tg_slice update, long long *user_id)
+{
+    tg_slice value;
+
+    return raw_update_object (update, &value) == TG_UPDATE_COUNT
+        || !raw_member (value, "from", &value) || !raw_member (value, "id", &value)
+        || raw_integer (value, user_id);
+}
+
+_Bool tg_raw_is_command (tg_slice update)
+{
+    tg_slice value;
+
+    if (raw_update_object (update, &value) >= TG_UPDATE_INLINE_QUERY)
+        return 0;
+
+    /* Telegram may send the slash escaped */
+    return raw_member (value, "text", &value) && value.len > 2
+        && (value.ptr[1] == '/' || (value.len > 3 && value.ptr[1] == '\\' && value.ptr[2] == '/'));
+}
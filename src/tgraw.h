@@ -0,0 +1,107 @@
+#include <stddef.h>
+#include "tgschema.h"
+
+/**
+ * @file
+ * @brief Scanner locating values in raw json without building a tree.
+ */
+
+/**
+ * @defgroup group14 Raw json scanner
+ * @brief Locates members and elements of raw json text.
+ *
+ * The scanner only finds where values start and end, it neither decodes
+ * nor fully validates them. Object keys are compared byte for byte, which
+ * matches the unescaped keys Telegram sends.
+ * @{
+ */
+
+/**
+ * @brief Position of an iteration over an array.
+ */
+typedef struct raw_iter
+{
+    //! Next character to read, NULL if the array is malformed
+    const char *pos;
+    //! End of the json text
+    const char *end;
+} raw_iter;
+
+/**
+ * @brief Returns the end of the json value starting at \p pos.
+ *
+ * @param pos Start of the value, leading whitespace is skipped.
+ * @param end End of the json text.
+ *
+ * @returns The first character after the value, NULL if it is malformed.
+ */
+const char *raw_value_end (const char *pos, const char *end);
+
+//! allowed_updates names, indexed by tgupdate
+extern const char *update_types[TG_UPDATE_COUNT];
+
+/**
+ * @brief Starts iterating over the members of a json object.
+ *
+ * @param object Json text of the object.
+ * @param iter Iterator to initialize.
+ *
+ * @returns 0 on success, 1 if \p object is not an object.
+ */
+_Bool raw_object_begin (tg_slice object, raw_iter *iter);
+
+/**
+ * @brief Returns the next member of a json object.
+ *
+ * @param iter Iterator from raw_object_begin. Its pos is set to NULL if the
+ * object turns out to be malformed.
+ * @param key Set to the key of the member, without quotes and undecoded.
+ * @param value Set to the json text of the member's value.
+ *
+ * @returns 1 if a member was returned, 0 at the end of the object.
+ */
+_Bool raw_object_next (raw_iter *iter, tg_slice *key, tg_slice *value);
+
+/**
+ * @brief Finds a member of a json object.
+ *
+ * @param object Json text of the object.
+ * @param key Name of the member.
+ * @param value Set to the json text of the member's value.
+ *
+ * @returns 1 if the member was found.
+ */
+_Bool raw_member (tg_slice object, const char *key, tg_slice *value);
+
+/**
+ * @brief Starts iterating over the elements of a json array.
+ *
+ * @param array Json text of the array.
+ * @param iter Iterator to initialize.
+ *
+ * @returns 0 on success, 1 if \p array is not an array.
+ */
+_Bool raw_array_begin (tg_slice array, raw_iter *iter);
+
+/**
+ * @brief Returns the next element of a json array.
+ *
+ * @param iter Iterator from raw_array_begin. Its pos is set to NULL if the
+ * array turns out to be malformed.
+ * @param element Set to the json text of the element.
+ *
+ * @returns 1 if an element was returned, 0 at the end of the array.
+ */
+_Bool raw_array_next (raw_iter *iter, tg_slice *element);
+
+/**
+ * @brief Reads a json integer.
+ *
+ * @param value Json text of the integer.
+ * @param number Set to the integer.
+ *
+ * @returns 0 on success, 1 if \p value is not an integer.
+ */
+_Bool raw_integer (tg_slice value, long long *number);
+
+/**@}*/
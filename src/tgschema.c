@@ -0,0 +1,1058 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <jansson.h>
+#include "tgraw.h"
+
+/**
+ * @file
+ * @brief Generic parser, freer and copier driven by the type schemas.
+ */
+
+//! Marks an empty perfect hash slot
+#define SLOT_EMPTY 0xff
+
+//! Seeds tried per table size when building a perfect hash
+#define HASH_SEEDS 64
+
+//! Address of a member of an object
+#define FIELD_PTR(api_s, offset) ((void *)((char *)(api_s) + (offset)))
+
+//! Pointer stored in a member of an object
+#define FIELD_GET(api_s, field) (*(void **) FIELD_PTR (api_s, (field)->offset))
+
+/*
+ * Expands a field list entry into a tg_field.
+ */
+
+#define LEN_INT(type, member) 0
+#define LEN_STR(type, member) 0
+#define LEN_ISTR(type, member) 0
+#define LEN_BOOL(type, member) 0
+#define LEN_REAL(type, member) 0
+#define LEN_OBJ(type, member) 0
+#define LEN_ARR(type, member) offsetof (type, member##_len)
+
+#define SUB_INT(sub) NULL
+#define SUB_STR(sub) NULL
+#define SUB_ISTR(sub) NULL
+#define SUB_BOOL(sub) NULL
+#define SUB_REAL(sub) NULL
+#define SUB_OBJ(sub) &sub##_schema
+#define SUB_ARR(sub) &sub##_schema
+
+#define SCHEMA_FIELD(type, kind, member, sub)\
+    { #member, FIELD_##kind, offsetof (type, member), LEN_##kind (type, member), SUB_##kind (sub),\
+        __builtin_types_compatible_p (type, Message_extras_s) },
+
+#define SCHEMA_FIELDS(type, fields, prefix)\
+    const tg_field type##_fields[] = { fields (SCHEMA_FIELD) };
+
+#define FIELD_COUNT(type) (sizeof (type##_fields) / sizeof (tg_field))
+
+/*
+ * Defines the public parser, freer and copier of a type.
+ */
+
+#define SCHEMA_FUNCS(type, fields, prefix)\
+    void prefix##_parse (json_t *root, type##_s *api_s, tg_res *res)\
+    {\
+        schema_parse (&type##_schema, root, api_s, res);\
+    }\
+    \
+    void type##_free (type##_s api_s)\
+    {\
+        schema_free (&type##_schema, &api_s);\
+    }\
+    \
+    void prefix##_copy (const type##_s *src, type##_s *api_s, tg_res *res)\
+    {\
+        schema_copy (&type##_schema, src, api_s, res);\
+    }
+
+//! Slots of the intern table, a power of two
+#define INTERN_SLOTS 1024
+
+//! Bytes of the intern arena
+#define INTERN_ARENA 65536
+
+//! Strings of this length or longer aren't interned
+#define INTERN_MAX_LEN 64
+
+//! Slots of a thread's dedup table, a power of two
+#define DEDUP_SLOTS 256
+
+#define KNOWN_MEMBER(id, str) char id[sizeof (str)];
+#define KNOWN_VALUE(id, str) str,
+#define KNOWN_POINTER(id, str) intern_known.id,
+
+//! Guards the perfect hash tables
+pthread_once_t schema_once = PTHREAD_ONCE_INIT;
+
+//! Well known interned strings, stored back to back
+const struct { TG_STRINGS (KNOWN_MEMBER) } intern_known = { TG_STRINGS (KNOWN_VALUE) };
+
+const char *const tg_strings[TG_STR_COUNT] = { TG_STRINGS (KNOWN_POINTER) };
+
+//! Guards the initial fill of intern_slots
+pthread_once_t intern_once = PTHREAD_ONCE_INIT;
+//! Open addressing table of interned strings, filled lock free
+const char *intern_slots[INTERN_SLOTS];
+//! Number of interned strings
+size_t intern_count;
+//! Storage of interned strings that aren't well known
+char intern_arena[INTERN_ARENA];
+//! Bytes of intern_arena handed out
+size_t intern_used;
+
+/*
+ * Instance shared within a batch.
+ */
+
+typedef struct
+{
+    //! Schema of the instance, NULL if the slot is empty
+    tg_schema *schema;
+    //! Id of the instance
+    json_int_t id;
+    //! Json the instance was parsed from
+    json_t *root;
+    //! The instance
+    void *api_s;
+} dedup_entry;
+
+//! Set between dedup_begin and dedup_end
+__thread _Bool dedup_active;
+//! Instances shared by the batch being parsed
+__thread dedup_entry dedup_table[DEDUP_SLOTS];
+//! Used slots of dedup_table
+__thread size_t dedup_count;
+
+//! Bytes allocated by the batch being parsed, NULL outside of a batch
+__thread size_t *parse_budget;
+//! Nesting of the object being parsed
+__thread size_t parse_depth;
+
+SCHEMA_FIELDS (Update, UPDATE_FIELDS, update)
+SCHEMA_TYPES (SCHEMA_FIELDS)
+
+tg_schema Update_schema = { "Update", sizeof (Update_s), Update_fields, FIELD_COUNT (Update),
+    &tg_parse_mask.updates, TG_BIT (FIELD_COUNT (Update) - 1) };
+tg_schema User_schema = { "User", sizeof (User_s), User_fields, FIELD_COUNT (User),
+    &tg_parse_mask.user, 0, 0, 0, 0, 1, offsetof (User_s, refs) };
+tg_schema Chat_schema = { "Chat", sizeof (Chat_s), Chat_fields, FIELD_COUNT (Chat),
+    &tg_parse_mask.chat, 0, 0, 0, 0, 1, offsetof (Chat_s, refs) };
+tg_schema Message_schema = { "Message", sizeof (Message_s), Message_fields, FIELD_COUNT (Message),
+    &tg_parse_mask.message, 0, 1, offsetof (Message_s, raw), offsetof (Message_s, raw_depth), 0, 0,
+    offsetof (Message_s, extras), sizeof (Message_extras_s) };
+tg_schema MessageEntity_schema = { "MessageEntity", sizeof (MessageEntity_s), MessageEntity_fields,
+    FIELD_COUNT (MessageEntity) };
+tg_schema PhotoSize_schema = { "PhotoSize", sizeof (PhotoSize_s), PhotoSize_fields,
+    FIELD_COUNT (PhotoSize) };
+tg_schema Audio_schema = { "Audio", sizeof (Audio_s), Audio_fields, FIELD_COUNT (Audio) };
+tg_schema Document_schema = { "Document", sizeof (Document_s), Document_fields,
+    FIELD_COUNT (Document) };
+tg_schema Sticker_schema = { "Sticker", sizeof (Sticker_s), Sticker_fields, FIELD_COUNT (Sticker) };
+tg_schema Video_schema = { "Video", sizeof (Video_s), Video_fields, FIELD_COUNT (Video) };
+tg_schema Voice_schema = { "Voice", sizeof (Voice_s), Voice_fields, FIELD_COUNT (Voice) };
+tg_schema Contact_schema = { "Contact", sizeof (Contact_s), Contact_fields, FIELD_COUNT (Contact) };
+tg_schema Location_schema = { "Location", sizeof (Location_s), Location_fields,
+    FIELD_COUNT (Location) };
+tg_schema Venue_schema = { "Venue", sizeof (Venue_s), Venue_fields, FIELD_COUNT (Venue) };
+tg_schema UserProfilePhotos_schema = { "UserProfilePhotos", sizeof (UserProfilePhotos_s),
+    UserProfilePhotos_fields, FIELD_COUNT (UserProfilePhotos) };
+tg_schema File_schema = { "File", sizeof (File_s), File_fields, FIELD_COUNT (File) };
+tg_schema CallbackQuery_schema = { "CallbackQuery", sizeof (CallbackQuery_s), CallbackQuery_fields,
+    FIELD_COUNT (CallbackQuery) };
+tg_schema InlineQuery_schema = { "InlineQuery", sizeof (InlineQuery_s), InlineQuery_fields,
+    FIELD_COUNT (InlineQuery) };
+tg_schema ChosenInlineResult_schema = { "ChosenInlineResult", sizeof (ChosenInlineResult_s),
+    ChosenInlineResult_fields, FIELD_COUNT (ChosenInlineResult) };
+tg_schema Game_schema = { "Game", sizeof (Game_s), Game_fields, FIELD_COUNT (Game) };
+tg_schema Animation_schema = { "Animation", sizeof (Animation_s), Animation_fields,
+    FIELD_COUNT (Animation) };
+
+/*
+ * FNV-1a of a member name, mixed with a seed.
+ */
+
+uint32_t field_hash (const char *name, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+
+    while (*name)
+    {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Searches the smallest table and seed that map every field of the schema
+ * to its own slot. Leaves slot_count at 0 if there is none, in which case
+ * schema_field falls back to a linear search.
+ */
+
+void schema_hash (tg_schema *schema)
+{
+    size_t slot;
+
+    for (size_t slots = schema->count; slots <= SCHEMA_SLOTS; slots++)
+    {
+        for (uint32_t seed = 0; seed < HASH_SEEDS; seed++)
+        {
+            memset (schema->slots, SLOT_EMPTY, sizeof (schema->slots));
+
+            for (size_t i = 0; i < schema->count; i++)
+            {
+                slot = field_hash (schema->fields[i].name, seed) % slots;
+                if (schema->slots[slot] != SLOT_EMPTY)
+                    goto collision;
+
+                schema->slots[slot] = i;
+            }
+
+            schema->seed = seed;
+            schema->slot_count = slots;
+            return;
+
+collision:
+            continue;
+        }
+    }
+
+    schema->slot_count = 0;
+}
+
+#define SCHEMA_HASH(type, fields, prefix) schema_hash (&type##_schema);
+
+void schema_init (void)
+{
+    schema_hash (&Update_schema);
+    SCHEMA_TYPES (SCHEMA_HASH)
+}
+
+const tg_field *schema_field (tg_schema *schema, const char *name)
+{
+    const tg_field *field;
+    uint8_t index;
+
+    pthread_once (&schema_once, schema_init);
+
+    if (!schema->slot_count)
+    {
+        for (size_t i = 0; i < schema->count; i++)
+            if (!strcmp (schema->fields[i].name, name))
+                return &schema->fields[i];
+
+        return NULL;
+    }
+
+    index = schema->slots[field_hash (name, schema->seed) % schema->slot_count];
+    if (index == SLOT_EMPTY)
+        return NULL;
+
+    field = &schema->fields[index];
+    return strcmp (field->name, name) ? NULL : field;
+}
+
+uint32_t str_hash (const char *str, size_t length)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char) str[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+void intern_init (void)
+{
+    size_t slot;
+
+    for (int i = 0; i < TG_STR_COUNT; i++)
+    {
+        slot = str_hash (tg_strings[i], strlen (tg_strings[i])) & (INTERN_SLOTS - 1);
+        while (intern_slots[slot])
+            slot = (slot + 1) & (INTERN_SLOTS - 1);
+
+        intern_slots[slot] = tg_strings[i];
+    }
+
+    intern_count = TG_STR_COUNT;
+}
+
+/*
+ * Adds amount to counter unless that exceeds limit, and sets start to the
+ * value before. Returns 1 if it would exceed the limit.
+ */
+
+_Bool intern_reserve (size_t *counter, size_t amount, size_t limit, size_t *start)
+{
+    size_t value = __atomic_load_n (counter, __ATOMIC_RELAXED);
+
+    do
+    {
+        if (value + amount > limit)
+            return 1;
+    }
+    while (!__atomic_compare_exchange_n (counter, &value, value + amount, 1, __ATOMIC_RELAXED,
+                __ATOMIC_RELAXED));
+
+    *start = value;
+    return 0;
+}
+
+const char *intern_str (const char *str, size_t length)
+{
+    const char *entry;
+    char *copy;
+    size_t slot, offset, used;
+
+    if (length >= INTERN_MAX_LEN || memchr (str, '\0', length))
+        return NULL;
+
+    pthread_once (&intern_once, intern_init);
+
+    slot = str_hash (str, length) & (INTERN_SLOTS - 1);
+
+    for (size_t probe = 0; probe < INTERN_SLOTS; probe++)
+    {
+        entry = __atomic_load_n (&intern_slots[slot], __ATOMIC_ACQUIRE);
+
+        if (!entry)
+        {
+            /* Keep the table at most half full so probes stay short */
+            if (intern_reserve (&intern_count, 1, INTERN_SLOTS / 2, &offset))
+                return NULL;
+
+            if (intern_reserve (&intern_used, length + 1, INTERN_ARENA, &offset))
+            {
+                __atomic_sub_fetch (&intern_count, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+
+            copy = intern_arena + offset;
+            memcpy (copy, str, length);
+            copy[length] = '\0';
+
+            if (__atomic_compare_exchange_n (&intern_slots[slot], &entry, copy, 0,
+                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+                return copy;
+
+            /* Give the reservation back, the bytes only if nobody took more since */
+            __atomic_sub_fetch (&intern_count, 1, __ATOMIC_RELAXED);
+            used = offset + length + 1;
+            __atomic_compare_exchange_n (&intern_used, &used, offset, 0, __ATOMIC_RELAXED,
+                    __ATOMIC_RELAXED);
+
+            /* Another thread took the slot, entry now holds its string */
+        }
+
+        if (!strncmp (entry, str, length) && !entry[length])
+            return entry;
+
+        slot = (slot + 1) & (INTERN_SLOTS - 1);
+    }
+
+    return NULL;
+}
+
+_Bool is_interned (const char *str)
+{
+    return (str >= (const char *) &intern_known && str < (const char *) (&intern_known + 1))
+        || (str >= intern_arena && str < intern_arena + INTERN_ARENA);
+}
+
+tgstr tg_str_id (const char *str)
+{
+    if (!str)
+        return TG_STR_COUNT;
+
+    for (int i = 0; i < TG_STR_COUNT; i++)
+        if (str == tg_strings[i] || !strcmp (str, tg_strings[i]))
+            return i;
+
+    return TG_STR_COUNT;
+}
+
+void dedup_begin (void)
+{
+    if (!tg_dedup)
+        return;
+
+    memset (dedup_table, 0, sizeof (dedup_table));
+    dedup_count = 0;
+    dedup_active = 1;
+}
+
+void dedup_end (void)
+{
+    if (!dedup_active)
+        return;
+
+    memset (dedup_table, 0, sizeof (dedup_table));
+    dedup_count = 0;
+    dedup_active = 0;
+}
+
+/*
+ * Returns the slot of an instance in dedup_table, an empty slot if it
+ * wasn't seen yet or NULL if it can't be shared.
+ */
+
+dedup_entry *dedup_find (tg_schema *schema, json_t *root)
+{
+    json_t *id = json_object_get (root, "id");
+    dedup_entry *entry;
+    size_t slot;
+
+    if (!json_is_integer (id))
+        return NULL;
+
+    slot = (size_t) (json_integer_value (id) * 0x9e3779b97f4a7c15ull >> 40) & (DEDUP_SLOTS - 1);
+
+    for (size_t probe = 0; probe < DEDUP_SLOTS; probe++)
+    {
+        entry = &dedup_table[slot];
+
+        if (!entry->schema)
+            return dedup_count < DEDUP_SLOTS / 2 ? entry : NULL;
+
+        if (entry->schema == schema && entry->id == json_integer_value (id)
+                && json_equal (entry->root, root))
+            return entry;
+
+        slot = (slot + 1) & (DEDUP_SLOTS - 1);
+    }
+
+    return NULL;
+}
+
+void budget_begin (size_t *used)
+{
+    parse_budget = used;
+}
+
+void budget_end (void)
+{
+    parse_budget = NULL;
+}
+
+/*
+ * Charges an allocation to the batch. Returns 1 and sets TG_LIMITFAIL if it
+ * exceeds the budget.
+ */
+
+_Bool budget_take (size_t size, tg_res *res)
+{
+    if (!parse_budget || !tg_parse_limits.batch_bytes)
+        return 0;
+
+    if (__atomic_add_fetch (parse_budget, size, __ATOMIC_RELAXED) > tg_parse_limits.batch_bytes)
+    {
+        res->ok = TG_LIMITFAIL;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Checks the nesting limit before descending into a member. Returns 1 and
+ * sets TG_LIMITFAIL if it is reached.
+ */
+
+_Bool depth_reached (tg_res *res)
+{
+    if (tg_parse_limits.depth && parse_depth >= tg_parse_limits.depth)
+    {
+        res->ok = TG_LIMITFAIL;
+        return 1;
+    }
+
+    return 0;
+}
+
+size_t depth_set (size_t depth)
+{
+    size_t previous = parse_depth;
+
+    parse_depth = depth;
+    return previous;
+}
+
+void *field_base (tg_schema *schema, const tg_field *field, void *api_s, _Bool create, tg_res *res)
+{
+    void **extras;
+
+    if (!field->extra)
+        return api_s;
+
+    extras = FIELD_PTR (api_s, schema->extras_offset);
+    if (!*extras && create && !budget_take (schema->extras_size, res)
+            && !alloc_obj (schema->extras_size, extras, res))
+        memset (*extras, 0, schema->extras_size);
+
+    return *extras;
+}
+
+/*
+ * Copies a string of known length into a new allocation.
+ */
+
+char *copy_str (const char *src, size_t length, tg_res *res)
+{
+    char *target = tg_malloc (length + 1);
+
+    if (!target)
+    {
+        res->ok = TG_ALLOCFAIL;
+        return NULL;
+    }
+
+    memcpy (target, src, length);
+    target[length] = '\0';
+    return target;
+}
+
+/*
+ * Allocates a scalar member and copies value into it.
+ */
+
+void *copy_scalar (const void *value, size_t size, tg_res *res)
+{
+    void *target = tg_malloc (size);
+
+    if (!target)
+    {
+        res->ok = TG_ALLOCFAIL;
+        return NULL;
+    }
+
+    memcpy (target, value, size);
+    return target;
+}
+
+void schema_parse_value (const tg_field *field, json_t *value, void *api_s, tg_res *res)
+{
+    void **target = FIELD_PTR (api_s, field->offset);
+    dedup_entry *entry;
+    const char *interned;
+    size_t length;
+    json_int_t int_value;
+    double real_value;
+    _Bool bool_value;
+
+    switch (field->kind)
+    {
+        case FIELD_INT:
+            if (!json_is_integer (value) || budget_take (sizeof (int_value), res))
+                break;
+            int_value = json_integer_value (value);
+            *target = copy_scalar (&int_value, sizeof (int_value), res);
+            break;
+
+        case FIELD_STR:
+            if (!json_is_string (value) || budget_take (json_string_length (value) + 1, res))
+                break;
+            *target = copy_str (json_string_value (value), json_string_length (value), res);
+            break;
+
+        case FIELD_ISTR:
+            if (!json_is_string (value))
+                break;
+            interned = intern_str (json_string_value (value), json_string_length (value));
+            if (interned)
+                *target = (char *) interned;
+            else if (!budget_take (json_string_length (value) + 1, res))
+                *target = copy_str (json_string_value (value), json_string_length (value), res);
+            break;
+
+        case FIELD_BOOL:
+            if (!json_is_boolean (value) || budget_take (sizeof (bool_value), res))
+                break;
+            bool_value = json_is_true (value);
+            *target = copy_scalar (&bool_value, sizeof (bool_value), res);
+            break;
+
+        case FIELD_REAL:
+            if (!json_is_real (value) || budget_take (sizeof (real_value), res))
+                break;
+            real_value = json_real_value (value);
+            *target = copy_scalar (&real_value, sizeof (real_value), res);
+            break;
+
+        case FIELD_OBJ:
+            if (!json_is_object (value) || depth_reached (res))
+                break;
+
+            entry = dedup_active && field->schema->dedup ? dedup_find (field->schema, value) : NULL;
+            if (entry && entry->api_s)
+            {
+                __atomic_add_fetch ((unsigned int *) FIELD_PTR (entry->api_s, field->schema->refs_offset),
+                        1, __ATOMIC_RELAXED);
+                *target = entry->api_s;
+                break;
+            }
+
+            if (budget_take (field->schema->size, res) || alloc_obj (field->schema->size, target, res))
+                break;
+
+            parse_depth++;
+            schema_parse (field->schema, value, *target, res);
+            parse_depth--;
+
+            if (entry)
+            {
+                *entry = (dedup_entry){ field->schema, json_integer_value (json_object_get (value, "id")),
+                    value, *target };
+                dedup_count++;
+            }
+            break;
+
+        case FIELD_ARR:
+            length = json_array_size (value);
+            if (!length || depth_reached (res))
+                break;
+
+            if (tg_parse_limits.array_len && length > tg_parse_limits.array_len)
+            {
+                res->ok = TG_LIMITFAIL;
+                length = tg_parse_limits.array_len;
+            }
+
+            if (budget_take (field->schema->size * length, res)
+                    || alloc_obj (field->schema->size * length, target, res))
+                break;
+
+            parse_depth++;
+            for (size_t i = 0; i < length; i++)
+                schema_parse (field->schema, json_array_get (value, i),
+                        (char *) *target + field->schema->size * i, res);
+            parse_depth--;
+
+            *(size_t *) FIELD_PTR (api_s, field->len_offset) = length;
+            break;
+    }
+}
+
+/*
+ * Returns whether value has the json type of field, and so sets it.
+ */
+
+_Bool field_matches (const tg_field *field, json_t *value)
+{
+    switch (field->kind)
+    {
+        case FIELD_INT:
+            return json_is_integer (value);
+        case FIELD_STR:
+        case FIELD_ISTR:
+            return json_is_string (value);
+        case FIELD_BOOL:
+            return json_is_boolean (value);
+        case FIELD_REAL:
+            return json_is_real (value);
+        case FIELD_OBJ:
+            return json_is_object (value);
+        case FIELD_ARR:
+            return json_array_size (value) != 0;
+    }
+
+    return 0;
+}
+
+void schema_parse (tg_schema *schema, json_t *root, void *api_s, tg_res *res)
+{
+    const tg_field *field;
+    const char *key;
+    json_t *value;
+    void *base;
+    uint64_t mask = schema->mask ? *schema->mask | schema->always : TG_MASK_ALL;
+    _Bool lazy = schema->lazy && tg_lazy;
+
+    memset (api_s, 0, schema->size);
+
+    json_object_foreach (root, key, value)
+    {
+        field = schema_field (schema, key);
+        if (!field || !(mask & TG_BIT (field - schema->fields)))
+            continue;
+
+        if ((lazy && (field->kind == FIELD_OBJ || field->kind == FIELD_ARR))
+                || !field_matches (field, value))
+            continue;
+
+        /* Only members that are set get the extras allocated */
+        base = field_base (schema, field, api_s, 1, res);
+        if (base)
+            schema_parse_value (field, value, base, res);
+    }
+
+    if (lazy)
+    {
+        *(json_t **) FIELD_PTR (api_s, schema->raw_offset) = json_incref (root);
+        *(size_t *) FIELD_PTR (api_s, schema->depth_offset) = parse_depth;
+    }
+}
+
+/*
+ * Returns whether the json text of value has the type of field, like
+ * field_matches. Only the first character is looked at, malformed values
+ * are caught when they are read.
+ */
+
+_Bool raw_field_matches (const tg_field *field, tg_slice value)
+{
+    const char *end = value.ptr + value.len;
+    _Bool number = value.len && (*value.ptr == '-' || (*value.ptr >= '0' && *value.ptr <= '9'));
+    _Bool fraction = 0;
+    raw_iter iter;
+
+    for (const char *pos = value.ptr; number && pos < end; pos++)
+        fraction |= *pos == '.' || *pos == 'e' || *pos == 'E';
+
+    switch (field->kind)
+    {
+        case FIELD_INT:
+            return number && !fraction;
+        case FIELD_STR:
+        case FIELD_ISTR:
+            return value.len >= 2 && *value.ptr == '"';
+        case FIELD_BOOL:
+            return value.len && (*value.ptr == 't' || *value.ptr == 'f');
+        case FIELD_REAL:
+            return fraction;
+        case FIELD_OBJ:
+            return value.len && *value.ptr == '{';
+        case FIELD_ARR:
+            return !raw_array_begin (value, &iter) && iter.pos < iter.end && *iter.pos != ']';
+    }
+
+    return 0;
+}
+
+/*
+ * Reads a json real, like jansson only numbers with a fraction or exponent.
+ */
+
+_Bool raw_real (tg_slice value, double *number)
+{
+    char digits[64];
+    char *digits_end;
+
+    if (!value.len || value.len >= sizeof (digits))
+        return 1;
+
+    memcpy (digits, value.ptr, value.len);
+    digits[value.len] = '\0';
+
+    *number = strtod (digits, &digits_end);
+    return digits_end != digits + value.len;
+}
+
+void schema_parse_raw_value (const tg_field *field, tg_slice value, void *api_s, tg_res *res)
+{
+    void **target = FIELD_PTR (api_s, field->offset);
+    const char *interned;
+    size_t length = 0;
+    long long int_value;
+    json_int_t json_value;
+    double real_value;
+    _Bool bool_value;
+    raw_iter iter;
+    tg_slice element;
+
+    switch (field->kind)
+    {
+        case FIELD_INT:
+            if (raw_integer (value, &int_value))
+            {
+                res->ok = TG_JSONFAIL;
+                break;
+            }
+            if (budget_take (sizeof (json_value), res))
+                break;
+            json_value = int_value;
+            *target = copy_scalar (&json_value, sizeof (json_value), res);
+            break;
+
+        case FIELD_ISTR:
+            /* Well known values are plain, escaped ones aren't worth interning */
+            length = value.len - 2;
+            if (text_span (value.ptr + 1, length) == length
+                    && (interned = intern_str (value.ptr + 1, length)))
+            {
+                *target = (char *) interned;
+                break;
+            }
+            /* fall through */
+
+        case FIELD_STR:
+            /* Unescaped straight into the member, the text never shrinks by less */
+            if (budget_take (value.len - 1, res))
+                break;
+            *target = text_copy (value.ptr + 1, value.len - 2, res);
+            break;
+
+        case FIELD_BOOL:
+            bool_value = value.len == 4 && !memcmp (value.ptr, "true", 4);
+            if (!bool_value && (value.len != 5 || memcmp (value.ptr, "false", 5)))
+            {
+                res->ok = TG_JSONFAIL;
+                break;
+            }
+            if (budget_take (sizeof (bool_value), res))
+                break;
+            *target = copy_scalar (&bool_value, sizeof (bool_value), res);
+            break;
+
+        case FIELD_REAL:
+            if (raw_real (value, &real_value))
+            {
+                res->ok = TG_JSONFAIL;
+                break;
+            }
+            if (budget_take (sizeof (real_value), res))
+                break;
+            *target = copy_scalar (&real_value, sizeof (real_value), res);
+            break;
+
+        case FIELD_OBJ:
+            if (depth_reached (res) || budget_take (field->schema->size, res)
+                    || alloc_obj (field->schema->size, target, res))
+                break;
+
+            parse_depth++;
+            schema_parse_raw (field->schema, value, *target, res);
+            parse_depth--;
+            break;
+
+        case FIELD_ARR:
+            if (depth_reached (res))
+                break;
+
+            raw_array_begin (value, &iter);
+            while (raw_array_next (&iter, &element))
+                length++;
+
+            if (!iter.pos)
+            {
+                res->ok = TG_JSONFAIL;
+                break;
+            }
+
+            if (tg_parse_limits.array_len && length > tg_parse_limits.array_len)
+            {
+                res->ok = TG_LIMITFAIL;
+                length = tg_parse_limits.array_len;
+            }
+
+            if (budget_take (field->schema->size * length, res)
+                    || alloc_obj (field->schema->size * length, target, res))
+                break;
+
+            parse_depth++;
+            raw_array_begin (value, &iter);
+            for (size_t i = 0; i < length && raw_array_next (&iter, &element); i++)
+                schema_parse_raw (field->schema, element, (char *) *target + field->schema->size * i, res);
+            parse_depth--;
+
+            *(size_t *) FIELD_PTR (api_s, field->len_offset) = length;
+            break;
+    }
+}
+
+void schema_parse_raw (tg_schema *schema, tg_slice object, void *api_s, tg_res *res)
+{
+    const tg_field *field;
+    char name[SCHEMA_NAME];
+    tg_slice key, value;
+    raw_iter iter;
+    void *base;
+    uint64_t mask = schema->mask ? *schema->mask | schema->always : TG_MASK_ALL;
+
+    memset (api_s, 0, schema->size);
+
+    if (raw_object_begin (object, &iter))
+        return;
+
+    while (raw_object_next (&iter, &key, &value))
+    {
+        /* Keys are compared undecoded, no member name needs escapes */
+        if (key.len >= sizeof (name))
+            continue;
+
+        memcpy (name, key.ptr, key.len);
+        name[key.len] = '\0';
+
+        field = schema_field (schema, name);
+        if (!field || !(mask & TG_BIT (field - schema->fields)))
+            continue;
+
+        /* A repeated key keeps its last value, as it does in jansson */
+        base = field_base (schema, field, api_s, 0, NULL);
+        if (base && FIELD_GET (base, field))
+            schema_free_member (field, base);
+
+        if (!raw_field_matches (field, value))
+            continue;
+
+        base = field_base (schema, field, api_s, 1, res);
+        if (base)
+            schema_parse_raw_value (field, value, base, res);
+    }
+
+    if (!iter.pos)
+        res->ok = TG_JSONFAIL;
+}
+
+/*
+ * Frees the member of a field and clears it.
+ */
+
+void schema_free_member (const tg_field *field, void *base)
+{
+    void *member = FIELD_GET (base, field);
+    size_t length;
+
+    switch (field->kind)
+    {
+        case FIELD_OBJ:
+            /* Shared instances are freed by their last owner */
+            if (field->schema->dedup && __atomic_fetch_sub ((unsigned int *)
+                        FIELD_PTR (member, field->schema->refs_offset), 1, __ATOMIC_ACQ_REL))
+                break;
+
+            schema_free (field->schema, member);
+            release_obj (field->schema->size, member);
+            break;
+
+        case FIELD_ARR:
+            length = *(size_t *) FIELD_PTR (base, field->len_offset);
+            for (size_t j = 0; j < length; j++)
+                schema_free (field->schema, (char *) member + field->schema->size * j);
+            release_obj (field->schema->size * length, member);
+            *(size_t *) FIELD_PTR (base, field->len_offset) = 0;
+            break;
+
+        case FIELD_ISTR:
+            if (!is_interned (member))
+                tg_free (member);
+            break;
+
+        default:
+            tg_free (member);
+    }
+
+    FIELD_GET (base, field) = NULL;
+}
+
+void schema_free (tg_schema *schema, void *api_s)
+{
+    const tg_field *field;
+    void *base;
+
+    for (size_t i = 0; i < schema->count; i++)
+    {
+        field = &schema->fields[i];
+        base = field_base (schema, field, api_s, 0, NULL);
+
+        if (base && FIELD_GET (base, field))
+            schema_free_member (field, base);
+    }
+
+    if (schema->extras_size)
+        release_obj (schema->extras_size, *(void **) FIELD_PTR (api_s, schema->extras_offset));
+
+    if (schema->lazy)
+        json_decref (*(json_t **) FIELD_PTR (api_s, schema->raw_offset));
+}
+
+void schema_copy (tg_schema *schema, const void *src, void *api_s, tg_res *res)
+{
+    const tg_field *field;
+    void *src_base, *base, *member, **target;
+    size_t length;
+
+    memset (api_s, 0, schema->size);
+
+    for (size_t i = 0; i < schema->count; i++)
+    {
+        field = &schema->fields[i];
+        src_base = field_base (schema, field, (void *) src, 0, NULL);
+
+        if (!src_base || !(member = FIELD_GET (src_base, field)))
+            continue;
+
+        base = field_base (schema, field, api_s, 1, res);
+        if (!base)
+            continue;
+
+        target = FIELD_PTR (base, field->offset);
+
+        switch (field->kind)
+        {
+            case FIELD_INT:
+                *target = copy_scalar (member, sizeof (json_int_t), res);
+                break;
+
+            case FIELD_STR:
+                *target = copy_str (member, strlen (member), res);
+                break;
+
+            case FIELD_ISTR:
+                if (is_interned (member))
+                    *target = member;
+                else
+                    *target = copy_str (member, strlen (member), res);
+                break;
+
+            case FIELD_BOOL:
+                *target = copy_scalar (member, sizeof (_Bool), res);
+                break;
+
+            case FIELD_REAL:
+                *target = copy_scalar (member, sizeof (double), res);
+                break;
+
+            case FIELD_OBJ:
+                if (!alloc_obj (field->schema->size, target, res))
+                    schema_copy (field->schema, member, *target, res);
+                break;
+
+            case FIELD_ARR:
+                length = *(size_t *) FIELD_PTR (src_base, field->len_offset);
+                if (alloc_obj (field->schema->size * length, target, res))
+                    break;
+
+                for (size_t j = 0; j < length; j++)
+                    schema_copy (field->schema, (char *) member + field->schema->size * j,
+                            (char *) *target + field->schema->size * j, res);
+
+                *(size_t *) FIELD_PTR (base, field->len_offset) = length;
+                break;
+        }
+    }
+
+    if (schema->lazy)
+    {
+        *(json_t **) FIELD_PTR (api_s, schema->raw_offset) =
+            json_incref (*(json_t **) FIELD_PTR (src, schema->raw_offset));
+        *(size_t *) FIELD_PTR (api_s, schema->depth_offset) =
+            *(size_t *) FIELD_PTR (src, schema->depth_offset);
+    }
+}
+
+SCHEMA_TYPES (SCHEMA_FUNCS)
+
+void update_copy (const Update_s *src, Update_s *api_s, tg_res *res)
+{
+    schema_copy (&Update_schema, src, api_s, res);
+}
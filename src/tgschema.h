@@ -0,0 +1,522 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <jansson.h>
+#include "tgtext.h"
+
+/**
+ * @file
+ * @brief Schema tables describing the Telegram types.
+ *
+ * Every type in tgtypes.h is described once by a field list below. The lists
+ * drive the generic parser, freer and copier in tgschema.c, so supporting a
+ * new type or member only means extending tgtypes.h and its list here.
+ */
+
+/**
+ * @defgroup group10 Type schemas
+ * @brief Tables driving the generic parse, free and copy routines.
+ * @{
+ */
+
+//! Slots of a schema's perfect hash table
+#define SCHEMA_SLOTS 256
+
+//! Longer json keys can't name a member
+#define SCHEMA_NAME 64
+
+/**
+ * @brief Kind of value stored by a field.
+ */
+typedef enum tgkind
+{
+    //! json_int_t *
+    FIELD_INT,
+    //! char *
+    FIELD_STR,
+    //! char *, interned
+    FIELD_ISTR,
+    //! _Bool *
+    FIELD_BOOL,
+    //! double *
+    FIELD_REAL,
+    //! Pointer to a nested type
+    FIELD_OBJ,
+    //! Array of a nested type with a matching `_len` member
+    FIELD_ARR
+} tgkind;
+
+//! Typedef of tg_schema.
+typedef struct tg_schema tg_schema;
+
+/**
+ * @brief A member of a Telegram type.
+ */
+typedef struct tg_field
+{
+    //! Json and member name
+    const char *name;
+    //! Kind of the member
+    tgkind kind;
+    //! Offset of the member
+    size_t offset;
+    //! Offset of the `_len` member of a FIELD_ARR
+    size_t len_offset;
+    //! Schema of a FIELD_OBJ or FIELD_ARR
+    tg_schema *schema;
+    //! Set if the member lives in the extras of its object
+    _Bool extra;
+} tg_field;
+
+/**
+ * @brief Description of a Telegram type.
+ */
+struct tg_schema
+{
+    //! Name of the type
+    const char *name;
+    //! sizeof the type
+    size_t size;
+    //! Fields of the type
+    const tg_field *fields;
+    //! Number of fields
+    size_t count;
+    //! Optional parse mask, bit i selects fields[i]
+    uint64_t *mask;
+    //! Fields parsed regardless of the mask
+    uint64_t always;
+    //! Set if the type retains its json when parsed lazily
+    _Bool lazy;
+    //! Offset of the retained json of a lazy type
+    size_t raw_offset;
+    //! Offset of the nesting the retained json was found at
+    size_t depth_offset;
+    //! Set if identical instances are shared within a batch
+    _Bool dedup;
+    //! Offset of the reference count of a shared type
+    size_t refs_offset;
+    //! Offset of the extras pointer of a type with extra fields
+    size_t extras_offset;
+    //! sizeof the extras of a type with extra fields
+    size_t extras_size;
+    //! Seed of the perfect hash
+    uint32_t seed;
+    //! Slots used by the perfect hash, 0 if none was found
+    size_t slot_count;
+    //! Field index of each slot, 0xff if empty
+    uint8_t slots[SCHEMA_SLOTS];
+};
+
+/*
+ * Field lists. X (struct, kind, member, nested type) with NONE as the nested
+ * type of scalar members.
+ */
+
+//! Update_s. The update types come first so their index matches tgupdate.
+#define UPDATE_FIELDS(X)\
+    X (Update_s, OBJ, message, Message)\
+    X (Update_s, OBJ, edited_message, Message)\
+    X (Update_s, OBJ, channel_post, Message)\
+    X (Update_s, OBJ, edited_channel_post, Message)\
+    X (Update_s, OBJ, inline_query, InlineQuery)\
+    X (Update_s, OBJ, chosen_inline_result, ChosenInlineResult)\
+    X (Update_s, OBJ, callback_query, CallbackQuery)\
+    X (Update_s, INT, update_id, NONE)
+
+//! User_s, in tguserfield order.
+#define USER_FIELDS(X)\
+    X (User_s, INT, id, NONE)\
+    X (User_s, STR, first_name, NONE)\
+    X (User_s, STR, last_name, NONE)\
+    X (User_s, STR, username, NONE)
+
+//! Chat_s, in tgchatfield order.
+#define CHAT_FIELDS(X)\
+    X (Chat_s, INT, id, NONE)\
+    X (Chat_s, ISTR, type, NONE)\
+    X (Chat_s, STR, title, NONE)\
+    X (Chat_s, STR, username, NONE)\
+    X (Chat_s, STR, first_name, NONE)\
+    X (Chat_s, STR, last_name, NONE)\
+    X (Chat_s, BOOL, all_members_are_administrators, NONE)
+
+//! Message_s, in tgmessagefield order. Members of Message_extras_s live behind Message_s.extras.
+#define MESSAGE_FIELDS(X)\
+    X (Message_s, INT, message_id, NONE)\
+    X (Message_s, OBJ, from, User)\
+    X (Message_s, INT, date, NONE)\
+    X (Message_s, OBJ, chat, Chat)\
+    X (Message_extras_s, OBJ, forward_from, User)\
+    X (Message_extras_s, OBJ, forward_from_chat, Chat)\
+    X (Message_extras_s, INT, forward_from_message_id, NONE)\
+    X (Message_extras_s, INT, forward_date, NONE)\
+    X (Message_s, OBJ, reply_to_message, Message)\
+    X (Message_s, INT, edit_date, NONE)\
+    X (Message_s, STR, text, NONE)\
+    X (Message_s, ARR, entities, MessageEntity)\
+    X (Message_extras_s, OBJ, audio, Audio)\
+    X (Message_extras_s, OBJ, document, Document)\
+    X (Message_extras_s, OBJ, game, Game)\
+    X (Message_s, ARR, photo, PhotoSize)\
+    X (Message_extras_s, OBJ, sticker, Sticker)\
+    X (Message_extras_s, OBJ, video, Video)\
+    X (Message_extras_s, OBJ, voice, Voice)\
+    X (Message_s, STR, caption, NONE)\
+    X (Message_extras_s, OBJ, contact, Contact)\
+    X (Message_extras_s, OBJ, location, Location)\
+    X (Message_extras_s, OBJ, venue, Venue)\
+    X (Message_extras_s, OBJ, new_chat_member, User)\
+    X (Message_extras_s, OBJ, left_chat_member, User)\
+    X (Message_extras_s, STR, new_chat_title, NONE)\
+    X (Message_extras_s, ARR, new_chat_photo, PhotoSize)\
+    X (Message_extras_s, BOOL, delete_chat_photo, NONE)\
+    X (Message_extras_s, BOOL, group_chat_created, NONE)\
+    X (Message_extras_s, BOOL, supergroup_chat_created, NONE)\
+    X (Message_extras_s, BOOL, channel_chat_created, NONE)\
+    X (Message_extras_s, INT, migrate_to_chat_id, NONE)\
+    X (Message_extras_s, INT, migrate_from_chat_id, NONE)\
+    X (Message_extras_s, OBJ, pinned_message, Message)
+
+#define MESSAGEENTITY_FIELDS(X)\
+    X (MessageEntity_s, ISTR, type, NONE)\
+    X (MessageEntity_s, INT, offset, NONE)\
+    X (MessageEntity_s, INT, length, NONE)\
+    X (MessageEntity_s, STR, url, NONE)\
+    X (MessageEntity_s, OBJ, user, User)
+
+#define PHOTOSIZE_FIELDS(X)\
+    X (PhotoSize_s, STR, file_id, NONE)\
+    X (PhotoSize_s, INT, width, NONE)\
+    X (PhotoSize_s, INT, height, NONE)\
+    X (PhotoSize_s, INT, file_size, NONE)
+
+#define AUDIO_FIELDS(X)\
+    X (Audio_s, STR, file_id, NONE)\
+    X (Audio_s, INT, duration, NONE)\
+    X (Audio_s, STR, performer, NONE)\
+    X (Audio_s, STR, title, NONE)\
+    X (Audio_s, ISTR, mime_type, NONE)\
+    X (Audio_s, INT, file_size, NONE)
+
+#define DOCUMENT_FIELDS(X)\
+    X (Document_s, STR, file_id, NONE)\
+    X (Document_s, OBJ, thumb, PhotoSize)\
+    X (Document_s, STR, file_name, NONE)\
+    X (Document_s, ISTR, mime_type, NONE)\
+    X (Document_s, INT, file_size, NONE)
+
+#define STICKER_FIELDS(X)\
+    X (Sticker_s, STR, file_id, NONE)\
+    X (Sticker_s, INT, width, NONE)\
+    X (Sticker_s, INT, height, NONE)\
+    X (Sticker_s, OBJ, thumb, PhotoSize)\
+    X (Sticker_s, STR, emoji, NONE)\
+    X (Sticker_s, INT, file_size, NONE)
+
+#define VIDEO_FIELDS(X)\
+    X (Video_s, STR, file_id, NONE)\
+    X (Video_s, INT, width, NONE)\
+    X (Video_s, INT, height, NONE)\
+    X (Video_s, INT, duration, NONE)\
+    X (Video_s, OBJ, thumb, PhotoSize)\
+    X (Video_s, ISTR, mime_type, NONE)\
+    X (Video_s, INT, file_size, NONE)
+
+#define VOICE_FIELDS(X)\
+    X (Voice_s, STR, file_id, NONE)\
+    X (Voice_s, INT, duration, NONE)\
+    X (Voice_s, ISTR, mime_type, NONE)\
+    X (Voice_s, INT, file_size, NONE)
+
+#define CONTACT_FIELDS(X)\
+    X (Contact_s, STR, phone_number, NONE)\
+    X (Contact_s, STR, first_name, NONE)\
+    X (Contact_s, STR, last_name, NONE)\
+    X (Contact_s, INT, user_id, NONE)
+
+#define LOCATION_FIELDS(X)\
+    X (Location_s, REAL, longitude, NONE)\
+    X (Location_s, REAL, latitude, NONE)
+
+#define VENUE_FIELDS(X)\
+    X (Venue_s, OBJ, location, Location)\
+    X (Venue_s, STR, title, NONE)\
+    X (Venue_s, STR, address, NONE)\
+    X (Venue_s, STR, foursquare_id, NONE)
+
+#define USERPROFILEPHOTOS_FIELDS(X)\
+    X (UserProfilePhotos_s, INT, total_count, NONE)\
+    X (UserProfilePhotos_s, ARR, photos, PhotoSize)
+
+#define FILE_FIELDS(X)\
+    X (File_s, STR, file_id, NONE)\
+    X (File_s, INT, file_size, NONE)\
+    X (File_s, STR, file_path, NONE)
+
+#define CALLBACKQUERY_FIELDS(X)\
+    X (CallbackQuery_s, STR, id, NONE)\
+    X (CallbackQuery_s, OBJ, from, User)\
+    X (CallbackQuery_s, OBJ, message, Message)\
+    X (CallbackQuery_s, STR, inline_message_id, NONE)\
+    X (CallbackQuery_s, STR, chat_instance, NONE)\
+    X (CallbackQuery_s, STR, data, NONE)\
+    X (CallbackQuery_s, STR, game_short_name, NONE)
+
+#define INLINEQUERY_FIELDS(X)\
+    X (InlineQuery_s, STR, id, NONE)\
+    X (InlineQuery_s, OBJ, from, User)\
+    X (InlineQuery_s, OBJ, location, Location)\
+    X (InlineQuery_s, STR, query, NONE)\
+    X (InlineQuery_s, STR, offset, NONE)
+
+#define CHOSENINLINERESULT_FIELDS(X)\
+    X (ChosenInlineResult_s, STR, result_id, NONE)\
+    X (ChosenInlineResult_s, OBJ, from, User)\
+    X (ChosenInlineResult_s, OBJ, location, Location)\
+    X (ChosenInlineResult_s, STR, inline_message_id, NONE)\
+    X (ChosenInlineResult_s, STR, query, NONE)
+
+#define GAME_FIELDS(X)\
+    X (Game_s, STR, title, NONE)\
+    X (Game_s, STR, description, NONE)\
+    X (Game_s, ARR, photo, PhotoSize)\
+    X (Game_s, STR, text, NONE)\
+    X (Game_s, ARR, text_entities, MessageEntity)\
+    X (Game_s, OBJ, animation, Animation)
+
+#define ANIMATION_FIELDS(X)\
+    X (Animation_s, STR, file_id, NONE)\
+    X (Animation_s, OBJ, thumb, PhotoSize)\
+    X (Animation_s, STR, file_name, NONE)\
+    X (Animation_s, ISTR, mime_type, NONE)\
+    X (Animation_s, INT, file_size, NONE)
+
+/*
+ * Every type with a schema. X (type, field list, parser prefix). Update is
+ * listed separately as it is parsed and freed as an array.
+ */
+
+#define SCHEMA_TYPES(X)\
+    X (User, USER_FIELDS, user)\
+    X (Chat, CHAT_FIELDS, chat)\
+    X (Message, MESSAGE_FIELDS, message)\
+    X (MessageEntity, MESSAGEENTITY_FIELDS, messageentity)\
+    X (PhotoSize, PHOTOSIZE_FIELDS, photosize)\
+    X (Audio, AUDIO_FIELDS, audio)\
+    X (Document, DOCUMENT_FIELDS, document)\
+    X (Sticker, STICKER_FIELDS, sticker)\
+    X (Video, VIDEO_FIELDS, video)\
+    X (Voice, VOICE_FIELDS, voice)\
+    X (Contact, CONTACT_FIELDS, contact)\
+    X (Location, LOCATION_FIELDS, location)\
+    X (Venue, VENUE_FIELDS, venue)\
+    X (UserProfilePhotos, USERPROFILEPHOTOS_FIELDS, userprofilephotos)\
+    X (File, FILE_FIELDS, file)\
+    X (CallbackQuery, CALLBACKQUERY_FIELDS, callbackquery)\
+    X (InlineQuery, INLINEQUERY_FIELDS, inlinequery)\
+    X (ChosenInlineResult, CHOSENINLINERESULT_FIELDS, choseninlineresult)\
+    X (Game, GAME_FIELDS, game)\
+    X (Animation, ANIMATION_FIELDS, animation)
+
+//! Declares the schema of a type
+#define SCHEMA_DECLARE(type, fields, prefix) extern tg_schema type##_schema;
+
+extern tg_schema Update_schema;
+SCHEMA_TYPES (SCHEMA_DECLARE)
+
+/**
+ * @brief Appends the json of an object to a buffer.
+ * @see group15
+ *
+ * @param schema Schema of the object.
+ * @param api_s Object to write.
+ * @param buf Buffer to append to.
+ * @param res Error object.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool schema_write (tg_schema *schema, const void *api_s, tg_buffer *buf, tg_res *res);
+
+/**
+ * @brief Makes room in a buffer for more bytes and a terminating NUL.
+ *
+ * @param buf Buffer to grow.
+ * @param length Number of bytes about to be appended.
+ * @param res Error object.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool buffer_reserve (tg_buffer *buf, size_t length, tg_res *res);
+
+/**
+ * @brief Appends bytes to a buffer.
+ *
+ * @param buf Buffer to append to.
+ * @param src Bytes to append.
+ * @param length Number of bytes.
+ * @param res Error object.
+ *
+ * @returns 0 on success, 1 on error.
+ */
+_Bool buffer_put (tg_buffer *buf, const char *src, size_t length, tg_res *res);
+
+/**
+ * @brief Returns the shared copy of a string.
+ * @see tgstr
+ *
+ * @param str String to intern.
+ * @param length Length of \p str.
+ *
+ * @returns The interned string, or NULL if the string is too long or the
+ * table is full.
+ */
+const char *intern_str (const char *str, size_t length);
+
+/**
+ * @brief Checks whether a string was returned by intern_str.
+ *
+ * @param str String to check.
+ *
+ * @returns 1 if the string is interned and must not be freed.
+ */
+_Bool is_interned (const char *str);
+
+/**
+ * @brief Starts sharing identical instances on the calling thread.
+ * @see tg_set_dedup
+ *
+ * Does nothing unless tg_dedup is set. The json parsed until dedup_end
+ * must stay alive, it is used to compare instances.
+ */
+void dedup_begin (void);
+
+/**
+ * @brief Stops sharing instances on the calling thread.
+ */
+void dedup_end (void);
+
+/**
+ * @brief Returns the object holding the member of a field.
+ *
+ * @param schema Schema of the object.
+ * @param field Field of the schema.
+ * @param api_s The object.
+ * @param create Allocate the extras of the object if they are missing.
+ * @param res Response, set on allocation failure.
+ *
+ * @returns \p api_s or its extras, NULL if the extras are missing.
+ */
+void *field_base (tg_schema *schema, const tg_field *field, void *api_s, _Bool create, tg_res *res);
+
+/**
+ * @brief Charges the allocations of the calling thread to a batch.
+ * @see tg_limits
+ *
+ * Until budget_end, the parser adds the bytes it allocates to \p used,
+ * which may be shared by several threads, and stops allocating once it
+ * exceeds tg_limits.batch_bytes.
+ *
+ * @param used Bytes allocated by the batch so far.
+ */
+void budget_begin (size_t *used);
+
+/**
+ * @brief Stops charging allocations of the calling thread.
+ */
+void budget_end (void);
+
+/**
+ * @brief Charges an allocation to the batch of the calling thread.
+ *
+ * @param size Bytes about to be allocated.
+ * @param res Response, set to TG_LIMITFAIL if the budget is exceeded.
+ *
+ * @returns 1 if the budget is exceeded.
+ */
+_Bool budget_take (size_t size, tg_res *res);
+
+/**
+ * @brief Sets the nesting of the object the calling thread parses.
+ *
+ * @param depth Nesting checked against tg_limits.depth.
+ *
+ * @returns The previous nesting.
+ */
+size_t depth_set (size_t depth);
+
+/**
+ * @brief Finds the field of a schema by its json name.
+ *
+ * @param schema Schema to search.
+ * @param name Json member name.
+ *
+ * @returns The field or NULL if the type has no such member.
+ */
+const tg_field *schema_field (tg_schema *schema, const char *name);
+
+/**
+ * @brief Parses a json object into a Telegram type.
+ *
+ * Walks the members of \p root once, dispatching each through the schema's
+ * perfect hash. Members that are unknown, outside the parse mask or of the
+ * wrong json type are left NULL.
+ *
+ * @param schema Schema of the type.
+ * @param root Json object to parse.
+ * @param api_s Target object, overwritten.
+ * @param res Error object.
+ */
+void schema_parse (tg_schema *schema, json_t *root, void *api_s, tg_res *res);
+
+/**
+ * @brief Parses a single json value into a field of an object.
+ *
+ * @param field Field to fill in.
+ * @param value Json value of the field.
+ * @param api_s Object holding the member, see field_base.
+ * @param res Error object.
+ */
+void schema_parse_value (const tg_field *field, json_t *value, void *api_s, tg_res *res);
+
+/**
+ * @brief Parses an object from its json text.
+ * @see schema_parse
+ *
+ * Works on the text like the raw scanner instead of a jansson tree, and
+ * unescapes strings straight into the members. Objects aren't retained for
+ * lazy parsing nor shared, see tg_set_lazy and tg_set_dedup. A repeated key
+ * keeps its last value, so both parsers agree.
+ *
+ * @param schema Schema of the object.
+ * @param object Json text of the object.
+ * @param api_s Object to fill in.
+ * @param res Error object, TG_JSONFAIL if the text is malformed.
+ */
+void schema_parse_raw (tg_schema *schema, tg_slice object, void *api_s, tg_res *res);
+
+/**
+ * @brief Frees the members of a Telegram type.
+ *
+ * @param schema Schema of the type.
+ * @param api_s Object whose members are freed. The object itself isn't.
+ */
+void schema_free (tg_schema *schema, void *api_s);
+
+/**
+ * @brief Frees the member of a field and clears it.
+ *
+ * @param field Field of the member, which has to be set.
+ * @param base Object holding the member, the extras for extra fields.
+ */
+void schema_free_member (const tg_field *field, void *base);
+
+/**
+ * @brief Deep copies a Telegram type.
+ *
+ * @param schema Schema of the type.
+ * @param src Object to copy.
+ * @param api_s Target object, overwritten.
+ * @param res Error object.
+ */
+void schema_copy (tg_schema *schema, const void *src, void *api_s, tg_res *res);
+
+/**@}*/
@@ -0,0 +1,224 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "tgraw.h"
+
+/**
+ * @file
+ * @brief Sliding window deduplication of update identifiers.
+ */
+
+//! First bytes of a saved window
+#define SEEN_MAGIC "TGS1"
+
+//! Largest window a saved file may claim, in words
+#define SEEN_MAX_WORDS (1 << 24)
+
+_Bool tg_seen_init (tg_seen *seen, const size_t window, tg_res *res)
+{
+    *seen = (tg_seen){ NULL };
+    seen->words = window ? (window + 63) / 64 : 1;
+
+    seen->bits = tg_malloc (sizeof (uint64_t) * seen->words);
+    if (!seen->bits)
+    {
+        res->ok = TG_ALLOCFAIL;
+        return 1;
+    }
+
+    memset (seen->bits, 0, sizeof (uint64_t) * seen->words);
+    return 0;
+}
+
+/*
+ * Moves the window up so it ends with the word of update_id, clearing the
+ * words that drop out of it.
+ */
+
+void seen_slide (tg_seen *seen, long long word)
+{
+    long long top = seen->base / 64 + seen->words;
+
+    if (word - top >= (long long) seen->words)
+        memset (seen->bits, 0, sizeof (uint64_t) * seen->words);
+    else
+        for (long long i = top; i <= word; i++)
+            seen->bits[i % seen->words] = 0;
+
+    seen->base = (word - (long long) seen->words + 1) * 64;
+}
+
+/*
+ * Returns whether an identifier lies more than a window behind the window.
+ * Telegram restarts its identifiers at a random value after a week without
+ * updates, so such an identifier starts a new sequence rather than being
+ * an old update.
+ */
+
+_Bool seen_reset (const tg_seen *seen, long long update_id)
+{
+    return update_id < seen->base - (long long) seen->words * 64;
+}
+
+/*
+ * Returns whether an identifier was marked or fell behind the window,
+ * counting it if so. Leaves the window as it is.
+ */
+
+_Bool seen_has (tg_seen *seen, long long update_id)
+{
+    long long word = update_id / 64;
+
+    /* Telegram's identifiers are positive */
+    if (update_id < 0 || !seen->started || seen_reset (seen, update_id))
+        return 0;
+
+    if (update_id < seen->base)
+    {
+        seen->expired++;
+        return 1;
+    }
+
+    if (word >= seen->base / 64 + (long long) seen->words
+            || !(seen->bits[word % seen->words] & UINT64_C (1) << (update_id % 64)))
+        return 0;
+
+    seen->duplicates++;
+    return 1;
+}
+
+void tg_seen_mark (tg_seen *seen, const long long update_id)
+{
+    long long word = update_id / 64;
+
+    if (update_id < 0)
+        return;
+
+    if (!seen->started || seen_reset (seen, update_id))
+    {
+        memset (seen->bits, 0, sizeof (uint64_t) * seen->words);
+        seen->started = 1;
+        seen->base = word >= (long long) seen->words ? (word - (long long) seen->words + 1) * 64 : 0;
+    }
+
+    if (update_id < seen->base)
+        return;
+
+    if (word >= seen->base / 64 + (long long) seen->words)
+        seen_slide (seen, word);
+
+    seen->bits[word % seen->words] |= UINT64_C (1) << (update_id % 64);
+}
+
+_Bool tg_seen_check (tg_seen *seen, const long long update_id)
+{
+    if (seen_has (seen, update_id))
+        return 1;
+
+    tg_seen_mark (seen, update_id);
+    return 0;
+}
+
+_Bool tg_seen_filter (tg_slice update, void *ctx)
+{
+    tg_slice value;
+    long long update_id;
+
+    if (!raw_member (update, "update_id", &value) || raw_integer (value, &update_id))
+        return 1;
+
+    return !seen_has (ctx, update_id);
+}
+
+_Bool tg_seen_save (const tg_seen *seen, const char *path, tg_res *res)
+{
+    char tmp[4096];
+    uint64_t words = seen->words, counters[2] = { seen->duplicates, seen->expired };
+    long long base = seen->started ? seen->base : -1;
+    FILE *file;
+    _Bool failed;
+
+    if ((size_t) snprintf (tmp, sizeof (tmp), "%s.tmp", path) >= sizeof (tmp))
+    {
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    file = fopen (tmp, "wb");
+    if (!file)
+    {
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    failed = fwrite (SEEN_MAGIC, 4, 1, file) != 1 || fwrite (&words, sizeof (words), 1, file) != 1
+        || fwrite (&base, sizeof (base), 1, file) != 1
+        || fwrite (counters, sizeof (counters), 1, file) != 1
+        || fwrite (seen->bits, sizeof (uint64_t), seen->words, file) != seen->words;
+
+    /* The data has to be on disk before the rename can be */
+    failed = failed || fflush (file) || fsync (fileno (file));
+    failed |= fclose (file) != 0;
+
+    /* Replace the old window only once the new one is complete */
+    if (failed || rename (tmp, path))
+    {
+        remove (tmp);
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    return 0;
+}
+
+_Bool tg_seen_load (tg_seen *seen, const char *path, tg_res *res)
+{
+    char magic[4];
+    uint64_t words, counters[2];
+    long long base;
+    FILE *file = fopen (path, "rb");
+
+    if (!file)
+    {
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    if (fread (magic, 4, 1, file) != 1 || memcmp (magic, SEEN_MAGIC, 4)
+            || fread (&words, sizeof (words), 1, file) != 1 || !words || words > SEEN_MAX_WORDS
+            || fread (&base, sizeof (base), 1, file) != 1
+            || fread (counters, sizeof (counters), 1, file) != 1)
+        goto malformed;
+
+    if (tg_seen_init (seen, words * 64, res))
+    {
+        fclose (file);
+        return 1;
+    }
+
+    if (fread (seen->bits, sizeof (uint64_t), words, file) != words || (base >= 0 && base % 64))
+    {
+        tg_seen_free (seen);
+        goto malformed;
+    }
+
+    seen->started = base >= 0;
+    seen->base = seen->started ? base : 0;
+    seen->duplicates = counters[0];
+    seen->expired = counters[1];
+    fclose (file);
+    return 0;
+
+malformed:
+    fclose (file);
+    res->ok = TG_FORMATFAIL;
+    return 1;
+}
+
+void tg_seen_free (tg_seen *seen)
+{
+    tg_free (seen->bits);
+    seen->bits = NULL;
+    seen->words = 0;
+}
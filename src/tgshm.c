@@ -0,0 +1,360 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tgraw.h"
+
+/**
+ * @file
+ * @brief Shared memory rings carrying updates between processes.
+ *
+ * The segment starts with a header line, followed by one ring per
+ * consumer. A ring has its enqueue and dequeue positions on separate cache
+ * lines, the enqueue line also holding the stalled mark, followed by its
+ * slots. Every slot holds a sequence number, the
+ * length of its message and the message, padded to whole cache lines.
+ * The rings are Vyukov's bounded queues: a slot's sequence tells producers
+ * and consumers whose turn it is, so either side claims a slot with one
+ * compare and swap on its position.
+ */
+
+//! First bytes of a segment
+#define SHM_MAGIC "TGR1"
+
+//! Cache line size, the unit of the layout
+#define SHM_LINE 64
+
+//! Bytes in front of the message of a slot
+#define SHM_SLOT_HEADER 16
+
+//! Pause between attempts of tg_shm_push on a full ring, in nanoseconds
+#define SHM_PUSH_PAUSE 50000
+
+//! Longest tg_shm_push waits for a full ring, in nanoseconds
+#define SHM_PUSH_TIMEOUT 1000000000L
+
+//! Largest slot size, message lengths are stored in 32 bits
+#define SHM_MAX_SLOT (UINT32_MAX - 2 * SHM_LINE)
+
+/**
+ * @brief Header of a segment.
+ */
+typedef struct shm_header
+{
+    //! SHM_MAGIC
+    char magic[4];
+    //! Set once the rings are initialized
+    uint32_t ready;
+    //! Number of rings
+    uint64_t consumers;
+    //! Slots per ring
+    uint64_t slots;
+    //! Bytes a slot holds
+    uint64_t slot_size;
+} shm_header;
+
+size_t shm_stride (size_t slot_size)
+{
+    return (SHM_SLOT_HEADER + slot_size + SHM_LINE - 1) / SHM_LINE * SHM_LINE;
+}
+
+size_t shm_ring_size (size_t slots, size_t slot_size)
+{
+    return 2 * SHM_LINE + slots * shm_stride (slot_size);
+}
+
+unsigned char *shm_ring (tg_shm *shm, size_t consumer)
+{
+    return shm->map + SHM_LINE + consumer * shm_ring_size (shm->slots, shm->slot_size);
+}
+
+unsigned char *shm_slot (tg_shm *shm, unsigned char *ring, size_t pos)
+{
+    return ring + 2 * SHM_LINE + (pos & (shm->slots - 1)) * shm_stride (shm->slot_size);
+}
+
+/*
+ * Computes the size of a segment from its layout. Returns 1 if the layout
+ * is invalid or its size overflows.
+ */
+
+_Bool shm_layout (const tg_shm *shm, size_t *size)
+{
+    size_t ring;
+
+    return !shm->consumers || !shm->slots || shm->slots & (shm->slots - 1) || shm->slot_size > SHM_MAX_SLOT
+        || __builtin_mul_overflow (shm->slots, shm_stride (shm->slot_size), &ring)
+        || __builtin_add_overflow (ring, 2 * SHM_LINE, &ring)
+        || __builtin_mul_overflow (shm->consumers, ring, size)
+        || __builtin_add_overflow (*size, SHM_LINE, size);
+}
+
+_Bool tg_shm_create (tg_shm *shm, const char *name, const size_t consumers, const size_t slots,
+        const size_t slot_size, tg_res *res)
+{
+    shm_header *header;
+    unsigned char *ring;
+    int fd;
+
+    *shm = (tg_shm){ NULL, 0, consumers ? consumers : 1, 1, slot_size };
+
+    while (shm->slots < slots && shm->slots <= SIZE_MAX / 2)
+        shm->slots *= 2;
+
+    if (shm->slots < slots || shm_layout (shm, &shm->size))
+    {
+        res->ok = TG_LIMITFAIL;
+        return 1;
+    }
+
+    fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    if (ftruncate (fd, shm->size)
+            || (shm->map = mmap (NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        shm->map = NULL;
+        close (fd);
+        shm_unlink (name);
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    close (fd);
+
+    header = (shm_header *) shm->map;
+    memcpy (header->magic, SHM_MAGIC, 4);
+    header->consumers = shm->consumers;
+    header->slots = shm->slots;
+    header->slot_size = shm->slot_size;
+
+    /* Slot i is free for the producer at position i */
+    for (size_t i = 0; i < shm->consumers; i++)
+    {
+        ring = shm_ring (shm, i);
+        for (size_t j = 0; j < shm->slots; j++)
+            *(size_t *) shm_slot (shm, ring, j) = j;
+    }
+
+    __atomic_store_n (&header->ready, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+_Bool tg_shm_attach (tg_shm *shm, const char *name, tg_res *res)
+{
+    shm_header *header;
+    struct stat info;
+    size_t size;
+    int fd = shm_open (name, O_RDWR, 0600);
+
+    *shm = (tg_shm){ NULL };
+
+    if (fd < 0 || fstat (fd, &info)
+            || (shm->map = mmap (NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        shm->map = NULL;
+        if (fd >= 0)
+            close (fd);
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    close (fd);
+    shm->size = info.st_size;
+    header = (shm_header *) shm->map;
+
+    if (shm->size < SHM_LINE || memcmp (header->magic, SHM_MAGIC, 4)
+            || !__atomic_load_n (&header->ready, __ATOMIC_ACQUIRE))
+        goto malformed;
+
+    shm->consumers = header->consumers;
+    shm->slots = header->slots;
+    shm->slot_size = header->slot_size;
+
+    if (header->consumers > SIZE_MAX || header->slots > SIZE_MAX || header->slot_size > SIZE_MAX
+            || shm_layout (shm, &size) || size != shm->size)
+        goto malformed;
+
+    return 0;
+
+malformed:
+    tg_shm_detach (shm);
+    res->ok = TG_FORMATFAIL;
+    return 1;
+}
+
+/*
+ * Claims the next slot of a ring for writing and fills it. Returns 1 if
+ * the ring is full.
+ */
+
+_Bool shm_enqueue (tg_shm *shm, size_t consumer, const void *data, size_t length)
+{
+    unsigned char *ring = shm_ring (shm, consumer), *slot;
+    size_t *enqueue = (size_t *) ring;
+    size_t pos = __atomic_load_n (enqueue, __ATOMIC_RELAXED), seq;
+    uint32_t size = length;
+
+    while (1)
+    {
+        slot = shm_slot (shm, ring, pos);
+        seq = __atomic_load_n ((size_t *) slot, __ATOMIC_ACQUIRE);
+
+        if (seq == pos)
+        {
+            if (__atomic_compare_exchange_n (enqueue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((ptrdiff_t)(seq - pos) < 0)
+            return 1;
+        else
+            pos = __atomic_load_n (enqueue, __ATOMIC_RELAXED);
+    }
+
+    memcpy (slot + sizeof (size_t), &size, sizeof (size));
+    memcpy (slot + SHM_SLOT_HEADER, data, length);
+
+    /* Publishes the message to consumers */
+    __atomic_store_n ((size_t *) slot, pos + 1, __ATOMIC_RELEASE);
+
+    /* The ring takes messages again */
+    if (__atomic_load_n (enqueue + 1, __ATOMIC_RELAXED))
+        __atomic_store_n (enqueue + 1, 0, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+_Bool tg_shm_push_to (tg_shm *shm, const size_t consumer, const void *data, const size_t length,
+        tg_res *res)
+{
+    if (length > shm->slot_size)
+    {
+        res->ok = TG_LIMITFAIL;
+        return 1;
+    }
+
+    if (consumer >= shm->consumers || shm_enqueue (shm, consumer, data, length))
+    {
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    return 0;
+}
+
+size_t tg_shm_consumer (const tg_shm *shm, tg_slice update)
+{
+    tg_slice value;
+    long long key = 0;
+    uint64_t hash;
+
+    if (tg_raw_chat_id (update, &key) && tg_raw_from_id (update, &key)
+            && (!raw_member (update, "update_id", &value) || raw_integer (value, &key)))
+        key = 0;
+
+    hash = (uint64_t) key * UINT64_C (0x9e3779b97f4a7c15);
+    return (hash >> 32) % shm->consumers;
+}
+
+_Bool tg_shm_push (tg_shm *shm, tg_slice update, tg_res *res)
+{
+    struct timespec wait = { 0, SHM_PUSH_PAUSE }, start, now;
+    size_t consumer, *stalled;
+
+    if (update.len > shm->slot_size)
+    {
+        res->ok = TG_LIMITFAIL;
+        return 1;
+    }
+
+    consumer = tg_shm_consumer (shm, update);
+    stalled = (size_t *) shm_ring (shm, consumer) + 1;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    /* Backpressure: a slow consumer holds up the poller, a dead one only
+     * once, as its ring is marked stalled and later pushes fail at once */
+    while (shm_enqueue (shm, consumer, update.ptr, update.len))
+    {
+        if (__atomic_load_n (stalled, __ATOMIC_RELAXED))
+        {
+            res->ok = TG_NOTOKAY;
+            return 1;
+        }
+
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000000L + now.tv_nsec - start.tv_nsec >= SHM_PUSH_TIMEOUT)
+        {
+            __atomic_store_n (stalled, 1, __ATOMIC_RELAXED);
+            res->ok = TG_NOTOKAY;
+            return 1;
+        }
+
+        nanosleep (&wait, NULL);
+    }
+
+    return 0;
+}
+
+_Bool tg_shm_pop (tg_shm *shm, const size_t consumer, tg_shm_msg *msg)
+{
+    unsigned char *ring = shm_ring (shm, consumer), *slot;
+    size_t *dequeue = (size_t *)(ring + SHM_LINE);
+    size_t pos = __atomic_load_n (dequeue, __ATOMIC_RELAXED), seq;
+    uint32_t length;
+
+    while (1)
+    {
+        slot = shm_slot (shm, ring, pos);
+        seq = __atomic_load_n ((size_t *) slot, __ATOMIC_ACQUIRE);
+
+        if (seq == pos + 1)
+        {
+            if (!__atomic_compare_exchange_n (dequeue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                continue;
+
+            memcpy (&length, slot + sizeof (size_t), sizeof (length));
+            if (length <= shm->slot_size)
+                break;
+
+            /* Only a corrupt segment holds a longer message, drop it and go on */
+            __atomic_store_n ((size_t *) slot, pos + shm->slots, __ATOMIC_RELEASE);
+            pos = __atomic_load_n (dequeue, __ATOMIC_RELAXED);
+        }
+        else if ((ptrdiff_t)(seq - (pos + 1)) < 0)
+            return 0;
+        else
+            pos = __atomic_load_n (dequeue, __ATOMIC_RELAXED);
+    }
+
+    *msg = (tg_shm_msg){ { (const char *) slot + SHM_SLOT_HEADER, length }, slot, pos };
+    return 1;
+}
+
+void tg_shm_release (tg_shm *shm, tg_shm_msg *msg)
+{
+    /* The slot is free for the producer one lap later */
+    __atomic_store_n ((size_t *) msg->slot, msg->pos + shm->slots, __ATOMIC_RELEASE);
+    msg->slot = NULL;
+}
+
+void tg_shm_detach (tg_shm *shm)
+{
+    if (shm->map)
+        munmap (shm->map, shm->size);
+
+    shm->map = NULL;
+}
+
+void tg_shm_unlink (const char *name)
+{
+    shm_unlink (name);
+}
@@ -0,0 +1,615 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tgtext.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXT_X86 1
+#else
+#define TEXT_X86 0
+#endif
+
+/**
+ * @file
+ * @brief Vectorized UTF-8 validation and json string decoding.
+ */
+
+//! Entity boundaries mapped without allocating
+#define TEXT_POINTS 32
+
+/*
+ * A scanner returns the offset of the first byte at which the fast path
+ * must stop, or length if there is none.
+ */
+
+typedef size_t (*text_scanner) (const char *src, size_t length);
+
+size_t scan_init_plain (const char *src, size_t length);
+size_t scan_init_ascii (const char *src, size_t length);
+
+//! Finds the first escape, quote, control or non ASCII byte
+text_scanner scan_plain = scan_init_plain;
+//! Finds the first non ASCII byte
+text_scanner scan_ascii = scan_init_ascii;
+
+/*
+ * Byte loop fallbacks.
+ */
+
+size_t scan_plain_scalar (const char *src, size_t length)
+{
+    unsigned char c;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        c = src[i];
+        if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\')
+            return i;
+    }
+
+    return length;
+}
+
+size_t scan_ascii_scalar (const char *src, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        if ((unsigned char) src[i] >= 0x80)
+            return i;
+
+    return length;
+}
+
+#if TEXT_X86
+
+size_t scan_plain_sse2 (const char *src, size_t length)
+{
+    const __m128i quote = _mm_set1_epi8 ('"');
+    const __m128i slash = _mm_set1_epi8 ('\\');
+    const __m128i space = _mm_set1_epi8 (0x20);
+    __m128i chunk, stop;
+    size_t i = 0;
+    int bits;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        chunk = _mm_loadu_si128 ((const __m128i *)(src + i));
+
+        /* Signed compare, bytes from 0x80 up count as below 0x20 */
+        stop = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (chunk, quote),
+                    _mm_cmpeq_epi8 (chunk, slash)), _mm_cmplt_epi8 (chunk, space));
+
+        bits = _mm_movemask_epi8 (stop);
+        if (bits)
+            return i + __builtin_ctz (bits);
+    }
+
+    return i + scan_plain_scalar (src + i, length - i);
+}
+
+size_t scan_ascii_sse2 (const char *src, size_t length)
+{
+    size_t i = 0;
+    int bits;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        bits = _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)(src + i)));
+        if (bits)
+            return i + __builtin_ctz (bits);
+    }
+
+    return i + scan_ascii_scalar (src + i, length - i);
+}
+
+__attribute__ ((target ("avx2")))
+size_t scan_plain_avx2 (const char *src, size_t length)
+{
+    const __m256i quote = _mm256_set1_epi8 ('"');
+    const __m256i slash = _mm256_set1_epi8 ('\\');
+    const __m256i space = _mm256_set1_epi8 (0x20);
+    __m256i chunk, stop;
+    size_t i = 0;
+    unsigned int bits;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        chunk = _mm256_loadu_si256 ((const __m256i *)(src + i));
+
+        stop = _mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (chunk, quote),
+                    _mm256_cmpeq_epi8 (chunk, slash)), _mm256_cmpgt_epi8 (space, chunk));
+
+        bits = _mm256_movemask_epi8 (stop);
+        if (bits)
+            return i + __builtin_ctz (bits);
+    }
+
+    return i + scan_plain_sse2 (src + i, length - i);
+}
+
+__attribute__ ((target ("avx2")))
+size_t scan_ascii_avx2 (const char *src, size_t length)
+{
+    size_t i = 0;
+    unsigned int bits;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        bits = _mm256_movemask_epi8 (_mm256_loadu_si256 ((const __m256i *)(src + i)));
+        if (bits)
+            return i + __builtin_ctz (bits);
+    }
+
+    return i + scan_ascii_sse2 (src + i, length - i);
+}
+
+#endif
+
+/*
+ * Picks the scanners for the running CPU. Racing threads pick the same ones.
+ */
+
+void scan_select (void)
+{
+    text_scanner plain = scan_plain_scalar, ascii = scan_ascii_scalar;
+
+#if TEXT_X86
+    __builtin_cpu_init ();
+
+    if (__builtin_cpu_supports ("avx2"))
+    {
+        plain = scan_plain_avx2;
+        ascii = scan_ascii_avx2;
+    }
+    else if (__builtin_cpu_supports ("sse2"))
+    {
+        plain = scan_plain_sse2;
+        ascii = scan_ascii_sse2;
+    }
+#endif
+
+    __atomic_store_n (&scan_plain, plain, __ATOMIC_RELAXED);
+    __atomic_store_n (&scan_ascii, ascii, __ATOMIC_RELAXED);
+}
+
+size_t scan_init_plain (const char *src, size_t length)
+{
+    scan_select ();
+    return scan_plain (src, length);
+}
+
+size_t scan_init_ascii (const char *src, size_t length)
+{
+    scan_select ();
+    return scan_ascii (src, length);
+}
+
+/*
+ * Returns the length of the UTF-8 character at src, 0 if it is malformed.
+ */
+
+size_t utf8_char (const unsigned char *src, size_t length)
+{
+    unsigned char c = src[0];
+
+    if (c < 0x80)
+        return 1;
+
+    if (c >= 0xc2 && c <= 0xdf)
+        return length >= 2 && (src[1] & 0xc0) == 0x80 ? 2 : 0;
+
+    if (c >= 0xe0 && c <= 0xef)
+    {
+        if (length < 3 || (src[1] & 0xc0) != 0x80 || (src[2] & 0xc0) != 0x80)
+            return 0;
+
+        /* Overlong forms and surrogates */
+        if ((c == 0xe0 && src[1] < 0xa0) || (c == 0xed && src[1] > 0x9f))
+            return 0;
+
+        return 3;
+    }
+
+    if (c >= 0xf0 && c <= 0xf4)
+    {
+        if (length < 4 || (src[1] & 0xc0) != 0x80 || (src[2] & 0xc0) != 0x80
+                || (src[3] & 0xc0) != 0x80)
+            return 0;
+
+        /* Overlong forms and code points above U+10FFFF */
+        if ((c == 0xf0 && src[1] < 0x90) || (c == 0xf4 && src[1] > 0x8f))
+            return 0;
+
+        return 4;
+    }
+
+    return 0;
+}
+
+/*
+ * Encodes a code point as UTF-8, returns the number of bytes written.
+ */
+
+size_t utf8_put (uint32_t code, char *dst)
+{
+    if (code < 0x80)
+    {
+        dst[0] = code;
+        return 1;
+    }
+
+    if (code < 0x800)
+    {
+        dst[0] = 0xc0 | code >> 6;
+        dst[1] = 0x80 | (code & 0x3f);
+        return 2;
+    }
+
+    if (code < 0x10000)
+    {
+        dst[0] = 0xe0 | code >> 12;
+        dst[1] = 0x80 | (code >> 6 & 0x3f);
+        dst[2] = 0x80 | (code & 0x3f);
+        return 3;
+    }
+
+    dst[0] = 0xf0 | code >> 18;
+    dst[1] = 0x80 | (code >> 12 & 0x3f);
+    dst[2] = 0x80 | (code >> 6 & 0x3f);
+    dst[3] = 0x80 | (code & 0x3f);
+    return 4;
+}
+
+/*
+ * Reads the four hex digits of a \u escape. Returns 1 if they are malformed.
+ */
+
+_Bool read_hex4 (const char *src, size_t length, uint32_t *code)
+{
+    char c;
+
+    if (length < 4)
+        return 1;
+
+    *code = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        c = src[i];
+        *code <<= 4;
+
+        if (c >= '0' && c <= '9')
+            *code |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            *code |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            *code |= c - 'A' + 10;
+        else
+            return 1;
+    }
+
+    return 0;
+}
+
+size_t text_span (const char *src, size_t length)
+{
+    return scan_plain (src, length);
+}
+
+_Bool text_valid (const char *src, size_t length)
+{
+    size_t i = 0, used;
+
+    while (i < length)
+    {
+        i += scan_ascii (src + i, length - i);
+        if (i == length)
+            break;
+
+        used = utf8_char ((const unsigned char *) src + i, length - i);
+        if (!used)
+            return 0;
+
+        i += used;
+    }
+
+    return 1;
+}
+
+size_t text_decode (const char *src, size_t length, char *dst)
+{
+    size_t in = 0, out = 0, run;
+    uint32_t code, low;
+
+    while (in < length)
+    {
+        run = scan_plain (src + in, length - in);
+        memcpy (dst + out, src + in, run);
+        in += run;
+        out += run;
+
+        if (in == length)
+            break;
+
+        if ((unsigned char) src[in] >= 0x80)
+        {
+            run = utf8_char ((const unsigned char *) src + in, length - in);
+            if (!run)
+                return TEXT_INVALID;
+
+            memcpy (dst + out, src + in, run);
+            in += run;
+            out += run;
+            continue;
+        }
+
+        /* Control characters and quotes must be escaped */
+        if (src[in] != '\\' || in + 1 == length)
+            return TEXT_INVALID;
+
+        in += 2;
+
+        switch (src[in - 1])
+        {
+            case '"': dst[out++] = '"'; break;
+            case '\\': dst[out++] = '\\'; break;
+            case '/': dst[out++] = '/'; break;
+            case 'b': dst[out++] = '\b'; break;
+            case 'f': dst[out++] = '\f'; break;
+            case 'n': dst[out++] = '\n'; break;
+            case 'r': dst[out++] = '\r'; break;
+            case 't': dst[out++] = '\t'; break;
+
+            case 'u':
+                if (read_hex4 (src + in, length - in, &code))
+                    return TEXT_INVALID;
+                in += 4;
+
+                if (code >= 0xd800 && code <= 0xdbff)
+                {
+                    if (in + 6 > length || src[in] != '\\' || src[in + 1] != 'u'
+                            || read_hex4 (src + in + 2, 4, &low) || low < 0xdc00 || low > 0xdfff)
+                        return TEXT_INVALID;
+
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    in += 6;
+                }
+                else if ((code >= 0xdc00 && code <= 0xdfff) || !code)
+                    return TEXT_INVALID;
+
+                out += utf8_put (code, dst + out);
+                break;
+
+            default:
+                return TEXT_INVALID;
+        }
+    }
+
+    return out;
+}
+
+char *text_copy (const char *src, size_t length, tg_res *res)
+{
+    char *target = tg_malloc (length + 1);
+    size_t decoded;
+
+    if (!target)
+    {
+        res->ok = TG_ALLOCFAIL;
+        return NULL;
+    }
+
+    decoded = text_decode (src, length, target);
+    if (decoded == TEXT_INVALID)
+    {
+        tg_free (target);
+        res->ok = TG_JSONFAIL;
+        return NULL;
+    }
+
+    target[decoded] = '\0';
+    return target;
+}
+
+/*
+ * A position of a text being converted between units.
+ */
+
+typedef struct
+{
+    //! Position in the units converted from
+    size_t from;
+    //! Index of the result in the caller's order
+    size_t index;
+} text_point;
+
+int point_compare (const void *a, const void *b)
+{
+    const text_point *x = a, *y = b;
+
+    return (x->from > y->from) - (x->from < y->from);
+}
+
+/*
+ * Converts positions between UTF-16 units and UTF-8 bytes in a single pass
+ * over the text. Returns 1 if a position lies outside of the text or splits
+ * a character.
+ */
+
+_Bool text_map (const char *text, size_t length, text_point *points, size_t count,
+        _Bool to_bytes, size_t *mapped)
+{
+    size_t byte = 0, unit = 0, run, used, units, target;
+    size_t *pos = to_bytes ? &unit : &byte;
+
+    for (size_t i = 1; i < count; i++)
+    {
+        if (points[i].from < points[i - 1].from)
+        {
+            qsort (points, count, sizeof (text_point), point_compare);
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        target = points[i].from;
+
+        while (*pos < target)
+        {
+            if (byte == length)
+                return 1;
+
+            /* Bytes and units advance together over ASCII */
+            run = scan_ascii (text + byte, length - byte < target - *pos ? length - byte : target - *pos);
+            byte += run;
+            unit += run;
+
+            if (*pos == target || byte == length)
+                continue;
+
+            used = utf8_char ((const unsigned char *) text + byte, length - byte);
+            units = used == 4 ? 2 : 1;
+
+            if (!used || *pos + (to_bytes ? units : used) > target)
+                return 1;
+
+            byte += used;
+            unit += units;
+        }
+
+        mapped[points[i].index] = to_bytes ? byte : unit;
+    }
+
+    return 0;
+}
+
+/*
+ * Runs text_map over count start and end pairs, with the points on the
+ * stack when they fit.
+ */
+
+_Bool text_map_pairs (const char *text, size_t length, const size_t *from, size_t count,
+        _Bool to_bytes, size_t *mapped, tg_res *res)
+{
+    text_point stack[TEXT_POINTS], *points = stack;
+    _Bool failed;
+
+    if (count * 2 > TEXT_POINTS && !(points = tg_malloc (sizeof (text_point) * count * 2)))
+    {
+        res->ok = TG_ALLOCFAIL;
+        return 1;
+    }
+
+    for (size_t i = 0; i < count * 2; i++)
+        points[i] = (text_point){ from[i], i };
+
+    failed = text_map (text, length, points, count * 2, to_bytes, mapped);
+
+    if (points != stack)
+        tg_free (points);
+
+    if (failed)
+        res->ok = TG_RANGEFAIL;
+
+    return failed;
+}
+
+_Bool tg_entity_slices (const char *text, size_t length, const MessageEntity_s *entities,
+        size_t count, tg_slice *slices, tg_res *res)
+{
+    size_t stack[TEXT_POINTS * 2], *bounds = stack, *mapped;
+    _Bool failed = 0;
+
+    if (count * 2 > TEXT_POINTS && !(bounds = tg_malloc (sizeof (size_t) * count * 4)))
+    {
+        res->ok = TG_ALLOCFAIL;
+        return 1;
+    }
+
+    mapped = bounds + count * 2;
+
+    for (size_t i = 0; i < count && !failed; i++)
+    {
+        if (!entities[i].offset || !entities[i].length || *entities[i].offset < 0
+                || *entities[i].length < 0)
+            failed = 1;
+        else
+        {
+            bounds[i * 2] = *entities[i].offset;
+            bounds[i * 2 + 1] = *entities[i].offset + *entities[i].length;
+        }
+    }
+
+    if (failed)
+        res->ok = TG_RANGEFAIL;
+    else
+        failed = text_map_pairs (text, length, bounds, count, 1, mapped, res);
+
+    for (size_t i = 0; i < count && !failed; i++)
+        slices[i] = (tg_slice){ text + mapped[i * 2], mapped[i * 2 + 1] - mapped[i * 2] };
+
+    if (bounds != stack)
+        tg_free (bounds);
+
+    return failed;
+}
+
+_Bool message_entity_slices (Message_s *api_s, tg_slice *slices, tg_res *res)
+{
+    MessageEntity_s *entities = message_entities (api_s, res);
+
+    if (!entities)
+        return 0;
+
+    if (!api_s->text)
+    {
+        res->ok = TG_RANGEFAIL;
+        return 1;
+    }
+
+    return tg_entity_slices (api_s->text, strlen (api_s->text), entities, api_s->entities_len,
+            slices, res);
+}
+
+_Bool tg_slice_offsets (const char *text, size_t length, const tg_slice *slices, size_t count,
+        json_int_t *offsets, json_int_t *lengths, tg_res *res)
+{
+    size_t stack[TEXT_POINTS * 2], *bounds = stack, *mapped;
+    _Bool failed = 0;
+
+    if (count * 2 > TEXT_POINTS && !(bounds = tg_malloc (sizeof (size_t) * count * 4)))
+    {
+        res->ok = TG_ALLOCFAIL;
+        return 1;
+    }
+
+    mapped = bounds + count * 2;
+
+    for (size_t i = 0; i < count && !failed; i++)
+    {
+        if (slices[i].ptr < text || slices[i].ptr + slices[i].len > text + length)
+            failed = 1;
+        else
+        {
+            bounds[i * 2] = slices[i].ptr - text;
+            bounds[i * 2 + 1] = slices[i].ptr - text + slices[i].len;
+        }
+    }
+
+    if (failed)
+        res->ok = TG_RANGEFAIL;
+    else
+        failed = text_map_pairs (text, length, bounds, count, 0, mapped, res);
+
+    for (size_t i = 0; i < count && !failed; i++)
+    {
+        offsets[i] = mapped[i * 2];
+        lengths[i] = mapped[i * 2 + 1] - mapped[i * 2];
+    }
+
+    if (bounds != stack)
+        tg_free (bounds);
+
+    return failed;
+}
@@ -0,0 +1,77 @@
+#include <stddef.h>
+#include "tgapi.h"
+
+/**
+ * @file
+ * @brief UTF-8 validation and json string decoding.
+ *
+ * The scanners skip over plain ASCII 16 or 32 bytes at a time with SSE2 or
+ * AVX2, picked on first use from the features of the running CPU, and fall
+ * back to a byte loop elsewhere. Only escapes and multibyte characters are
+ * handled one at a time.
+ */
+
+/**
+ * @defgroup group12 Text decoding
+ * @brief Validation and unescaping of string values.
+ * @{
+ */
+
+//! Returned by text_decode for malformed input
+#define TEXT_INVALID ((size_t) -1)
+
+/**
+ * @brief Checks that a string is well formed UTF-8.
+ *
+ * Rejects overlong forms, surrogates and code points above U+10FFFF.
+ *
+ * @param src String to check.
+ * @param length Length of \p src in bytes.
+ *
+ * @returns 1 if the string is valid.
+ */
+_Bool text_valid (const char *src, size_t length);
+
+/**
+ * @brief Returns the length of the leading run of a json string that needs
+ * no decoding.
+ *
+ * The run ends at the first quote, backslash, control character or non
+ * ASCII byte.
+ *
+ * @param src String to scan.
+ * @param length Length of \p src in bytes.
+ *
+ * @returns Length of the run, \p length if the whole string is plain.
+ */
+size_t text_span (const char *src, size_t length);
+
+/**
+ * @brief Decodes the contents of a json string.
+ *
+ * Resolves escapes, including `\uXXXX` surrogate pairs, and validates the
+ * UTF-8 in between. The decoded string is never longer than its escaped
+ * form, so \p dst needs at most \p length bytes. It is not terminated.
+ *
+ * @param src Escaped string, without the surrounding quotes.
+ * @param length Length of \p src in bytes.
+ * @param dst Target of the decoded string.
+ *
+ * @returns The decoded length, or TEXT_INVALID if \p src is malformed.
+ */
+size_t text_decode (const char *src, size_t length, char *dst);
+
+/**
+ * @brief Decodes the contents of a json string into a new string.
+ * @see text_decode
+ *
+ * @param src Escaped string, without the surrounding quotes.
+ * @param length Length of \p src in bytes.
+ * @param res Error object, TG_JSONFAIL if \p src is malformed.
+ *
+ * @returns The NUL terminated string, to be released with tg_free, or NULL
+ * on error.
+ */
+char *text_copy (const char *src, size_t length, tg_res *res);
+
+/**@}*/
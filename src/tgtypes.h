@@ -23,6 +23,8 @@ typedef struct Update_s Update_s;
 typedef struct User_s User_s;
 //! Typedef of Message type
 typedef struct Message_s Message_s;
+//! Typedef of the rarely set members of Message type
+typedef struct Message_extras_s Message_extras_s;
 //! Typedef of Chat type
 typedef struct Chat_s Chat_s;
 //! Typedef of MessageEntity type
@@ -114,6 +116,8 @@ struct User_s
     char *last_name;
     //! Optional. User‘s or bot’s username
     char *username;
+    //! Extra owners of an instance shared within a batch, see tg_set_dedup
+    unsigned int refs;
 };
 
 /**
@@ -126,7 +130,7 @@ struct Chat_s
 {
     //! Unique identifier for this chat
     json_int_t *id;
-    //! Type of chat, can be either “private”, “group”, “supergroup” or “channel”
+    //! Type of chat, can be either “private”, “group”, “supergroup” or “channel”. Interned, see tgstr
     char *type;
     //! Optional. Title, for supergroups, channels and group chats
     char *title;
@@ -138,6 +142,8 @@ struct Chat_s
     char *last_name;
     //! Optional. True if a group has ‘All Members Are Admins’ enabled
     _Bool *all_members_are_administrators;
+    //! Extra owners of an instance shared within a batch, see tg_set_dedup
+    unsigned int refs;
 };
 
 /**
@@ -156,14 +162,6 @@ struct Message_s
     json_int_t *date;
     //! Conversation the message belongs to
     Chat_s *chat;
-    //! Optional. For forwarded messages, sender of the original message
-    User_s *forward_from;
-    //! Optional. For messages forwarded from a channel, information about the original channel
-    Chat_s *forward_from_chat;
-    //! Optional. For forwarded channel posts, identifier of the original message in the channel
-    json_int_t *forward_from_message_id;
-    //! Optional. For forwarded messages, date the original message was sent in Unix time
-    json_int_t *forward_date;
     //! Optional. For replies, the original message. 
     Message_s *reply_to_message;
     //! Optional. Date the message was last edited in Unix time
@@ -174,24 +172,51 @@ struct Message_s
     MessageEntity_s *entities;
     //! Length of the MessageEntity_s array
     size_t entities_len;
+    //! Optional. Message is a photo, available sizes of the photo
+    PhotoSize_s *photo;
+    //! Length of the PhotoSize_s array
+    size_t photo_len;
+    //! Optional. Caption for the document, photo or video, 0-200 characters
+    char *caption;
+    //! Rarely set members, NULL if none of them is present
+    Message_extras_s *extras;
+    //! Retained json object of a lazily parsed message, NULL otherwise.
+    /*! Nested objects are parsed on first access through the message accessors. */
+    json_t *raw;
+    //! Nesting of a lazily parsed message, limits the members parsed from raw
+    size_t raw_depth;
+};
+
+/**
+ * @brief Rarely set members of a message
+ * @see MESSAGE_EXTRA
+ *
+ * Forwarding information, media other than photos and service members live
+ * behind Message_s.extras so the members every handler reads stay compact.
+ * The extras are only allocated when one of their members is present.
+ */
+struct Message_extras_s
+{
+    //! Optional. For forwarded messages, sender of the original message
+    User_s *forward_from;
+    //! Optional. For messages forwarded from a channel, information about the original channel
+    Chat_s *forward_from_chat;
+    //! Optional. For forwarded channel posts, identifier of the original message in the channel
+    json_int_t *forward_from_message_id;
+    //! Optional. For forwarded messages, date the original message was sent in Unix time
+    json_int_t *forward_date;
     //! Optional. Message is an audio file, information about the file
     Audio_s *audio;
     //! Optional. Message is a general file, information about the file
     Document_s *document;
     //! Optional. Message is a game, information about the game.
     Game_s *game;
-    //! Optional. Message is a photo, available sizes of the photo
-    PhotoSize_s *photo;
-    //! Length of the PhotoSize_s array
-    size_t photo_len;
     //! Optional. Message is a sticker, information about the sticker
     Sticker_s *sticker;
     //! Optional. Message is a video, information about the video
     Video_s *video;
     //! Optional. Message is a voice message, information about the file
     Voice_s *voice;
-    //! Optional. Caption for the document, photo or video, 0-200 characters
-    char *caption;
     //! Optional. Message is a shared contact, information about the contact
     Contact_s *contact;
     //! Optional. Message is a shared location, information about the location
@@ -232,7 +257,7 @@ struct Message_s
  */
 struct MessageEntity_s
 {
-    //! Type of the entity
+    //! Type of the entity. Interned, see tgstr
     char *type;
     //! Offset in UTF-16 code units to the start of the entity
     json_int_t *offset;
@@ -278,7 +303,7 @@ struct Audio_s
     char *performer;
     //! Optional. Title of the audio as defined by sender or by audio tags
     char *title;
-    //! Optional. MIME type of the file as defined by sender
+    //! Optional. MIME type of the file as defined by sender. Interned, see tgstr
     char *mime_type;
     //! Optional. File size
     json_int_t *file_size;
@@ -298,7 +323,7 @@ struct Document_s
     PhotoSize_s *thumb;
     //! Optional. Original filename as defined by sender
     char *file_name;
-    //! Optional. MIME type of the file as defined by sender
+    //! Optional. MIME type of the file as defined by sender. Interned, see tgstr
     char *mime_type;
     //! Optional. File size
     json_int_t *file_size;
@@ -344,7 +369,7 @@ struct Video_s
     json_int_t *duration;
     //! Optional. Video thumbnail
     PhotoSize_s *thumb;
-    //! Optional. Mime type of a file as defined by sender
+    //! Optional. Mime type of a file as defined by sender. Interned, see tgstr
     char *mime_type;
     //! Optional. File size
     json_int_t *file_size;
@@ -362,7 +387,7 @@ struct Voice_s
     char *file_id;
     //! Duration of the audio in seconds as defined by sender
     json_int_t *duration;
-    //! Optional. MIME type of the file as defined by sender
+    //! Optional. MIME type of the file as defined by sender. Interned, see tgstr
     char *mime_type;
     //! Optional. File size
     json_int_t *file_size;
@@ -573,7 +598,7 @@ struct Animation_s
     PhotoSize_s *thumb;
     //! Optional. Original animation filename as defined by sender
     char *file_name;
-    //! Optional. MIME type of the file as defined by sender
+    //! Optional. MIME type of the file as defined by sender. Interned, see tgstr
     char *mime_type;
     //! Optional. File size
     json_int_t *file_size;
@@ -0,0 +1,730 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "tgraw.h"
+
+/**
+ * @file
+ * @brief Embedded HTTP/1.1 server receiving webhook updates.
+ */
+
+//! Events taken per epoll_wait
+#define WEBHOOK_EVENTS 64
+
+//! Bytes read from a connection at once
+#define WEBHOOK_READ 16384
+
+//! Largest request line and headers
+#define WEBHOOK_MAX_HEADER 8192
+
+//! Largest request body
+#define WEBHOOK_MAX_BODY (1 << 20)
+
+//! Largest secret token Telegram accepts
+#define WEBHOOK_SECRET 256
+
+//! Seconds an idle connection is kept open
+#define WEBHOOK_IDLE 60
+
+//! Pending connections of a listening socket
+#define WEBHOOK_BACKLOG 128
+
+//! Most connections a thread keeps open
+#define WEBHOOK_CONNS 1024
+
+#define WEBHOOK_OK "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n"
+#define WEBHOOK_CONTINUE "HTTP/1.1 100 Continue\r\n\r\n"
+#define WEBHOOK_BAD "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n"
+#define WEBHOOK_FORBIDDEN "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define WEBHOOK_METHOD "HTTP/1.1 405 Method Not Allowed\r\nAllow: POST\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define WEBHOOK_LENGTH "HTTP/1.1 411 Length Required\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define WEBHOOK_TOO_LARGE "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define WEBHOOK_MALFORMED "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define WEBHOOK_ERROR "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n"
+#define WEBHOOK_CHUNKED "HTTP/1.1 501 Not Implemented\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+/**
+ * @brief A client connection.
+ */
+typedef struct webhook_conn
+{
+    //! The socket
+    int fd;
+    //! Received bytes not consumed yet
+    char *buf;
+    //! Bytes in buf
+    size_t len;
+    //! Size of buf
+    size_t size;
+    //! Rest of the answer being sent
+    const char *reply;
+    //! Bytes of reply left to send
+    size_t reply_len;
+    //! Set to close the connection once the answer is sent
+    _Bool close;
+    //! Set once 100 Continue was sent for the current request
+    _Bool continued;
+    //! Set while waiting for the socket to take the answer
+    _Bool writing;
+    //! Time of the last read
+    time_t last;
+    //! Neighbors in the connections of the thread
+    struct webhook_conn *prev, *next;
+} webhook_conn;
+
+/**
+ * @brief A server thread.
+ */
+typedef struct webhook_thread
+{
+    //! The thread
+    pthread_t thread;
+    //! Socket listening on the shared port
+    int listener;
+    //! epoll instance of the thread
+    int poll;
+    //! Open connections
+    webhook_conn *conns;
+    //! Number of open connections
+    size_t count;
+    //! Set while the listener is left out of the epoll instance
+    _Bool paused;
+} webhook_thread;
+
+/**
+ * @brief State of the server.
+ */
+struct webhook
+{
+    //! Guards starting and stopping
+    pthread_mutex_t lock;
+    //! Set while the server runs
+    _Bool running;
+    //! eventfd made readable to stop the threads
+    int stop;
+    //! The threads
+    webhook_thread *threads;
+    //! Number of threads
+    size_t count;
+    //! Number of threads started
+    size_t started;
+    //! Expected secret token
+    char secret[WEBHOOK_SECRET];
+    //! Length of secret, 0 to accept every request
+    size_t secret_len;
+    //! Update handler
+    tg_handler handler;
+    //! Context of the handler
+    void *ctx;
+} webhook = { PTHREAD_MUTEX_INITIALIZER, .stop = -1 };
+
+//! Set on the server threads
+__thread _Bool webhook_serving;
+
+time_t webhook_now (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+void webhook_reply (webhook_conn *conn, const char *reply, const _Bool close)
+{
+    conn->reply = reply;
+    conn->reply_len = strlen (reply);
+    conn->close = close;
+}
+
+/*
+ * Sends as much of the answer as the socket takes. Returns 1 if the
+ * connection is to be closed.
+ */
+
+_Bool webhook_send (webhook_conn *conn)
+{
+    ssize_t sent;
+
+    while (conn->reply_len)
+    {
+        sent = send (conn->fd, conn->reply, conn->reply_len, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return errno != EAGAIN && errno != EWOULDBLOCK;
+        }
+
+        conn->reply += sent;
+        conn->reply_len -= sent;
+    }
+
+    return conn->close;
+}
+
+/*
+ * Matches a header line against a name, and sets value to the value
+ * without surrounding whitespace.
+ */
+
+_Bool webhook_header (const char *line, const char *end, const char *name, tg_slice *value)
+{
+    size_t length = strlen (name);
+
+    if ((size_t)(end - line) <= length || line[length] != ':' || strncasecmp (line, name, length))
+        return 0;
+
+    line += length + 1;
+    while (line < end && (*line == ' ' || *line == '\t'))
+        line++;
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    *value = (tg_slice){ line, end - line };
+    return 1;
+}
+
+_Bool webhook_value (tg_slice value, const char *expected)
+{
+    return value.len == strlen (expected) && !strncasecmp (value.ptr, expected, value.len);
+}
+
+/*
+ * Returns the value of Content-Length, -1 if it isn't a number. Values
+ * beyond WEBHOOK_MAX_BODY aren't exact.
+ */
+
+long long webhook_length (tg_slice value)
+{
+    long long length = 0;
+
+    if (!value.len)
+        return -1;
+
+    for (size_t i = 0; i < value.len; i++)
+    {
+        if (value.ptr[i] < '0' || value.ptr[i] > '9')
+            return -1;
+
+        if (length <= WEBHOOK_MAX_BODY)
+            length = length * 10 + value.ptr[i] - '0';
+    }
+
+    return length;
+}
+
+/*
+ * Compares the token in constant time, so its bytes can't be guessed one
+ * by one.
+ */
+
+_Bool webhook_authorized (tg_slice token)
+{
+    unsigned char diff = token.len != webhook.secret_len;
+
+    for (size_t i = 0; i < webhook.secret_len; i++)
+        diff |= webhook.secret[i] ^ (i < token.len ? token.ptr[i] : 0);
+
+    return !diff;
+}
+
+/*
+ * Parses a posted update and hands it to the handler. Returns the answer.
+ */
+
+const char *webhook_deliver (const char *body, size_t length)
+{
+    tg_res res = { 0 };
+    tg_slice update = { body, length };
+    Update_s *updates;
+    size_t count;
+    raw_iter iter;
+
+    if (raw_object_begin (update, &iter))
+        return WEBHOOK_BAD;
+
+    /* Parsed in place from the receive buffer */
+    count = update_parse_raw (&update, 1, &updates, &res);
+
+    /* Telegram sends the update again if it isn't answered with 200, which
+     * only helps if the failure was transient */
+    if (res.ok == TG_ALLOCFAIL)
+    {
+        Update_free (updates, count);
+        return WEBHOOK_ERROR;
+    }
+
+    /* An update over the limits fails the same way every time, drop it */
+    if (res.ok == TG_LIMITFAIL)
+    {
+        Update_free (updates, count);
+        return WEBHOOK_OK;
+    }
+
+    if (!count || res.ok != TG_OKAY)
+    {
+        Update_free (updates, count);
+        return WEBHOOK_BAD;
+    }
+
+    webhook.handler (updates, webhook.ctx);
+    Update_free (updates, count);
+    return WEBHOOK_OK;
+}
+
+/*
+ * Serves the request at the start of the buffer and sets the answer.
+ * Returns the number of bytes it takes up, 0 if it isn't complete yet.
+ */
+
+size_t webhook_request (webhook_conn *conn)
+{
+    const char *buf = conn->buf, *line, *end;
+    size_t header = 0;
+    long long length = -1;
+    _Bool close = 0, expect = 0, chunked = 0;
+    tg_slice value, token = { NULL, 0 };
+
+    for (size_t i = 3; i < conn->len && !header; i++)
+        if (!memcmp (buf + i - 3, "\r\n\r\n", 4))
+            header = i + 1;
+
+    if (!header)
+    {
+        if (conn->len <= WEBHOOK_MAX_HEADER)
+            return 0;
+
+        webhook_reply (conn, WEBHOOK_MALFORMED, 1);
+        return conn->len;
+    }
+
+    for (end = buf; end[0] != '\r' || end[1] != '\n'; end++);
+
+    if (end - buf < 5 || memcmp (buf, "POST ", 5))
+    {
+        webhook_reply (conn, WEBHOOK_METHOD, 1);
+        return conn->len;
+    }
+
+    /* HTTP/1.0 clients don't expect the connection to be kept alive */
+    if (end - buf < 8 || memcmp (end - 8, "HTTP/1.1", 8))
+        close = 1;
+
+    for (line = end + 2; line < buf + header - 2; line = end + 2)
+    {
+        for (end = line; end[0] != '\r' || end[1] != '\n'; end++);
+
+        if (webhook_header (line, end, "Content-Length", &value))
+            length = webhook_length (value);
+        else if (webhook_header (line, end, "X-Telegram-Bot-Api-Secret-Token", &value))
+            token = value;
+        else if (webhook_header (line, end, "Connection", &value))
+            close |= webhook_value (value, "close");
+        else if (webhook_header (line, end, "Transfer-Encoding", &value))
+            chunked = 1;
+        else if (webhook_header (line, end, "Expect", &value))
+            expect = webhook_value (value, "100-continue");
+    }
+
+    if (chunked)
+        webhook_reply (conn, WEBHOOK_CHUNKED, 1);
+    else if (length < 0)
+        webhook_reply (conn, WEBHOOK_LENGTH, 1);
+    else if (!webhook_authorized (token))
+        webhook_reply (conn, WEBHOOK_FORBIDDEN, 1);
+    else if (length > WEBHOOK_MAX_BODY)
+        webhook_reply (conn, WEBHOOK_TOO_LARGE, 1);
+    else if (conn->len - header < (size_t) length)
+    {
+        /* Clients sending Expect wait for this before sending the body */
+        if (expect && !conn->continued)
+        {
+            conn->continued = 1;
+            webhook_reply (conn, WEBHOOK_CONTINUE, 0);
+        }
+
+        return 0;
+    }
+    else
+    {
+        conn->continued = 0;
+        webhook_reply (conn, webhook_deliver (buf + header, length), close);
+        return header + length;
+    }
+
+    return conn->len;
+}
+
+/*
+ * Serves the complete requests in the buffer. Returns 1 if the connection
+ * is to be closed.
+ */
+
+_Bool webhook_process (webhook_conn *conn)
+{
+    size_t used;
+
+    /* Pipelined requests are served once the answer before them is sent */
+    while (!conn->reply_len && (used = webhook_request (conn)))
+    {
+        memmove (conn->buf, conn->buf + used, conn->len - used);
+        conn->len -= used;
+
+        if (webhook_send (conn))
+            return 1;
+    }
+
+    /* Don't hold on to the buffer of a large body */
+    if (!conn->len && conn->size > WEBHOOK_READ)
+    {
+        tg_free (conn->buf);
+        conn->buf = NULL;
+        conn->size = 0;
+    }
+
+    return webhook_send (conn);
+}
+
+/*
+ * Reads from a connection and serves the complete requests. Returns 1 if
+ * the connection is to be closed.
+ */
+
+_Bool webhook_read (webhook_conn *conn)
+{
+    size_t size;
+    ssize_t got;
+    char *buf;
+
+    if (conn->size - conn->len < WEBHOOK_READ)
+    {
+        for (size = conn->size ? conn->size * 2 : WEBHOOK_READ; size - conn->len < WEBHOOK_READ; size *= 2);
+
+        buf = tg_realloc (conn->buf, conn->size, size);
+        if (!buf)
+            return 1;
+
+        conn->buf = buf;
+        conn->size = size;
+    }
+
+    got = recv (conn->fd, conn->buf + conn->len, conn->size - conn->len, 0);
+    if (got <= 0)
+        return !got || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK);
+
+    conn->len += got;
+    conn->last = webhook_now ();
+    return webhook_process (conn);
+}
+
+void webhook_close (webhook_thread *thread, webhook_conn *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        thread->conns = conn->next;
+
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    close (conn->fd);
+    tg_free (conn->buf);
+    tg_free (conn);
+    thread->count--;
+}
+
+/*
+ * Takes the listener of a thread out of its epoll instance or puts it back.
+ * A listener that can't be accepted from stays readable and would wake the
+ * thread over and over.
+ */
+
+void webhook_pause (webhook_thread *thread, const _Bool pause)
+{
+    struct epoll_event event = { EPOLLIN, { .ptr = thread } };
+
+    if (thread->paused != pause
+            && !epoll_ctl (thread->poll, pause ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, thread->listener, &event))
+        thread->paused = pause;
+}
+
+void webhook_accept (webhook_thread *thread)
+{
+    struct epoll_event event = { EPOLLIN };
+    webhook_conn *conn;
+    int fd, one = 1;
+
+    while (1)
+    {
+        /* New connections wait in the backlog until the sweep resumes the listener */
+        if (thread->count >= WEBHOOK_CONNS)
+        {
+            webhook_pause (thread, 1);
+            return;
+        }
+
+        fd = accept (thread->listener, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            /* Out of descriptors or memory, until connections are closed */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                webhook_pause (thread, 1);
+
+            return;
+        }
+
+        conn = tg_malloc (sizeof (webhook_conn));
+        if (!conn || fcntl (fd, F_SETFL, O_NONBLOCK))
+        {
+            tg_free (conn);
+            close (fd);
+            continue;
+        }
+
+        /* Answers are small, send them right away */
+        setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+        *conn = (webhook_conn){ fd, .last = webhook_now (), .next = thread->conns };
+        event.data.ptr = conn;
+
+        if (epoll_ctl (thread->poll, EPOLL_CTL_ADD, fd, &event))
+        {
+            close (fd);
+            tg_free (conn);
+            continue;
+        }
+
+        if (thread->conns)
+            thread->conns->prev = conn;
+        thread->conns = conn;
+        thread->count++;
+    }
+}
+
+void *webhook_serve (void *arg)
+{
+    webhook_thread *thread = arg;
+    struct epoll_event events[WEBHOOK_EVENTS], event;
+    webhook_conn *conn, *next;
+    time_t swept = webhook_now (), now;
+    int count;
+
+    webhook_serving = 1;
+
+    while (1)
+    {
+        count = epoll_wait (thread->poll, events, WEBHOOK_EVENTS, 1000);
+
+        for (int i = 0; i < count; i++)
+        {
+            /* The stop eventfd is the only event without data */
+            if (!events[i].data.ptr)
+                goto done;
+
+            if (events[i].data.ptr == thread)
+            {
+                webhook_accept (thread);
+                continue;
+            }
+
+            conn = events[i].data.ptr;
+
+            /* Once an answer is sent the requests after it are served */
+            if (conn->writing ? webhook_send (conn) || webhook_process (conn) : webhook_read (conn))
+            {
+                webhook_close (thread, conn);
+                continue;
+            }
+
+            /* Wait for room in the socket while an answer is left */
+            if (conn->writing != (conn->reply_len != 0))
+            {
+                conn->writing = conn->reply_len != 0;
+                event = (struct epoll_event){ conn->writing ? EPOLLOUT : EPOLLIN, { .ptr = conn } };
+
+                if (epoll_ctl (thread->poll, EPOLL_CTL_MOD, conn->fd, &event))
+                    webhook_close (thread, conn);
+            }
+        }
+
+        now = webhook_now ();
+        if (now == swept)
+            continue;
+
+        swept = now;
+        for (conn = thread->conns; conn; conn = next)
+        {
+            next = conn->next;
+            if (now - conn->last > WEBHOOK_IDLE)
+                webhook_close (thread, conn);
+        }
+
+        if (thread->paused && thread->count < WEBHOOK_CONNS)
+            webhook_pause (thread, 0);
+    }
+
+done:
+    while (thread->conns)
+        webhook_close (thread, thread->conns);
+
+    return NULL;
+}
+
+/*
+ * Stops the threads started so far and releases everything.
+ */
+
+void webhook_shutdown (void)
+{
+    if (webhook.stop >= 0)
+        eventfd_write (webhook.stop, 1);
+
+    for (size_t i = 0; i < webhook.started; i++)
+        pthread_join (webhook.threads[i].thread, NULL);
+
+    for (size_t i = 0; i < webhook.count; i++)
+    {
+        if (webhook.threads[i].listener >= 0)
+            close (webhook.threads[i].listener);
+        if (webhook.threads[i].poll >= 0)
+            close (webhook.threads[i].poll);
+    }
+
+    if (webhook.stop >= 0)
+        close (webhook.stop);
+
+    tg_free (webhook.threads);
+    webhook.threads = NULL;
+    webhook.count = 0;
+    webhook.started = 0;
+    webhook.stop = -1;
+    webhook.running = 0;
+}
+
+/*
+ * Opens the listening socket and epoll instance of a thread.
+ */
+
+_Bool webhook_listen (webhook_thread *thread, const struct sockaddr_in *address)
+{
+    struct epoll_event event = { EPOLLIN, { .ptr = thread } }, stop = { EPOLLIN, { .ptr = NULL } };
+    int one = 1;
+
+    thread->listener = socket (AF_INET, SOCK_STREAM, 0);
+    if (thread->listener < 0)
+        return 1;
+
+    /* Every thread binds the port, the kernel balances the connections */
+    if (setsockopt (thread->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one))
+            || setsockopt (thread->listener, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one))
+            || bind (thread->listener, (const struct sockaddr *) address, sizeof (*address))
+            || listen (thread->listener, WEBHOOK_BACKLOG)
+            || fcntl (thread->listener, F_SETFL, O_NONBLOCK))
+        return 1;
+
+    thread->poll = epoll_create1 (0);
+
+    return thread->poll < 0 || epoll_ctl (thread->poll, EPOLL_CTL_ADD, thread->listener, &event)
+        || epoll_ctl (thread->poll, EPOLL_CTL_ADD, webhook.stop, &stop);
+}
+
+_Bool tg_webhook_start (const char *address, const unsigned short port, const char *secret,
+        const size_t threads, tg_handler handler, void *ctx, tg_res *res)
+{
+    struct sockaddr_in bind_address = { 0 };
+    size_t secret_len = secret ? strlen (secret) : 0;
+
+    bind_address.sin_family = AF_INET;
+    bind_address.sin_port = htons (port);
+    bind_address.sin_addr.s_addr = htonl (INADDR_ANY);
+
+    if (secret_len > WEBHOOK_SECRET)
+    {
+        res->ok = TG_LIMITFAIL;
+        return 1;
+    }
+
+    pthread_mutex_lock (&webhook.lock);
+
+    if (webhook.running || !threads || (address && inet_pton (AF_INET, address, &bind_address.sin_addr) != 1))
+    {
+        pthread_mutex_unlock (&webhook.lock);
+        res->ok = TG_NOTOKAY;
+        return 1;
+    }
+
+    webhook.threads = tg_malloc (sizeof (webhook_thread) * threads);
+    if (!webhook.threads)
+    {
+        pthread_mutex_unlock (&webhook.lock);
+        res->ok = TG_ALLOCFAIL;
+        return 1;
+    }
+
+    webhook.running = 1;
+    webhook.count = threads;
+    webhook.started = 0;
+    memcpy (webhook.secret, secret ? secret : "", secret_len);
+    webhook.secret_len = secret_len;
+    webhook.handler = handler;
+    webhook.ctx = ctx;
+
+    for (size_t i = 0; i < threads; i++)
+        webhook.threads[i] = (webhook_thread){ .listener = -1, .poll = -1 };
+
+    webhook.stop = eventfd (0, 0);
+    if (webhook.stop < 0)
+        goto fail;
+
+    for (size_t i = 0; i < threads; i++)
+        if (webhook_listen (&webhook.threads[i], &bind_address))
+            goto fail;
+
+    for (; webhook.started < threads; webhook.started++)
+        if (pthread_create (&webhook.threads[webhook.started].thread, NULL, webhook_serve,
+                &webhook.threads[webhook.started]))
+        {
+            webhook_shutdown ();
+            pthread_mutex_unlock (&webhook.lock);
+            res->ok = TG_ALLOCFAIL;
+            return 1;
+        }
+
+    pthread_mutex_unlock (&webhook.lock);
+    return 0;
+
+fail:
+    webhook_shutdown ();
+    pthread_mutex_unlock (&webhook.lock);
+    res->ok = TG_NOTOKAY;
+    return 1;
+}
+
+void tg_webhook_stop (void)
+{
+    /* A server thread would wait for itself */
+    if (webhook_serving)
+        return;
+
+    pthread_mutex_lock (&webhook.lock);
+
+    if (webhook.running)
+        webhook_shutdown ();
+
+    pthread_mutex_unlock (&webhook.lock);
+}
@@ -0,0 +1,284 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <jansson.h>
+#include "tgschema.h"
+
+/**
+ * @file
+ * @brief Schema driven json writers.
+ */
+
+//! Smallest allocation of a buffer
+#define BUFFER_MIN 256
+
+//! Address of a member of an object
+#define MEMBER_PTR(api_s, offset) ((const void *)((const char *)(api_s) + (offset)))
+
+/*
+ * Defines the public writer of a type.
+ */
+
+#define SCHEMA_WRITER(type, fields, prefix)\
+    _Bool prefix##_to_json (const type##_s *api_s, tg_buffer *buf, tg_res *res)\
+    {\
+        return schema_write (&type##_schema, api_s, buf, res);\
+    }
+
+void tg_buffer_free (tg_buffer *buf)
+{
+    tg_free (buf->data);
+    *buf = (tg_buffer){ NULL };
+}
+
+/*
+ * Makes room for length more bytes and the terminating NUL.
+ */
+
+_Bool buffer_reserve (tg_buffer *buf, size_t length, tg_res *res)
+{
+    size_t capacity = buf->capacity ? buf->capacity : BUFFER_MIN;
+    char *data;
+
+    if (buf->size + length < buf->capacity)
+        return 0;
+
+    while (capacity <= buf->size + length)
+        capacity *= 2;
+
+    data = tg_realloc (buf->data, buf->capacity, capacity);
+    if (!data)
+    {
+        res->ok = TG_ALLOCFAIL;
+        return 1;
+    }
+
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+_Bool buffer_put (tg_buffer *buf, const char *src, size_t length, tg_res *res)
+{
+    if (buffer_reserve (buf, length, res))
+        return 1;
+
+    memcpy (buf->data + buf->size, src, length);
+    buf->size += length;
+    buf->data[buf->size] = '\0';
+    return 0;
+}
+
+/*
+ * Writes an integer without going through printf.
+ */
+
+_Bool buffer_int (tg_buffer *buf, json_int_t value, tg_res *res)
+{
+    char digits[24], *pos = digits + sizeof (digits);
+    unsigned long long magnitude = value < 0 ? -(unsigned long long) value : (unsigned long long) value;
+
+    do
+    {
+        *--pos = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+
+    if (value < 0)
+        *--pos = '-';
+
+    return buffer_put (buf, pos, digits + sizeof (digits) - pos, res);
+}
+
+/*
+ * Writes a quoted json string. Plain runs are copied whole, only quotes,
+ * backslashes and control characters are escaped.
+ */
+
+_Bool buffer_string (tg_buffer *buf, const char *str, tg_res *res)
+{
+    size_t length = strlen (str), run;
+    char escape[7];
+    unsigned char c;
+
+    /* The worst case is every byte escaped as \u00XX */
+    if (buffer_reserve (buf, length * 6 + 2, res))
+        return 1;
+
+    buf->data[buf->size++] = '"';
+
+    while (length)
+    {
+        run = text_span (str, length);
+        memcpy (buf->data + buf->size, str, run);
+        buf->size += run;
+        str += run;
+        length -= run;
+
+        if (!length)
+            break;
+
+        c = *str++;
+        length--;
+
+        if (c >= 0x80)
+        {
+            buf->data[buf->size++] = c;
+            continue;
+        }
+
+        switch (c)
+        {
+            case '"': memcpy (escape, "\\\"", 3); break;
+            case '\\': memcpy (escape, "\\\\", 3); break;
+            case '\n': memcpy (escape, "\\n", 3); break;
+            case '\r': memcpy (escape, "\\r", 3); break;
+            case '\t': memcpy (escape, "\\t", 3); break;
+            default: snprintf (escape, sizeof (escape), "\\u%04x", c);
+        }
+
+        run = strlen (escape);
+        memcpy (buf->data + buf->size, escape, run);
+        buf->size += run;
+    }
+
+    buf->data[buf->size++] = '"';
+    buf->data[buf->size] = '\0';
+    return 0;
+}
+
+/*
+ * Writes a json value of a lazily parsed message.
+ */
+
+_Bool buffer_json (tg_buffer *buf, json_t *value, tg_res *res)
+{
+    char *dump = json_dumps (value, JSON_COMPACT);
+    _Bool failed;
+
+    if (!dump)
+    {
+        res->ok = TG_JSONFAIL;
+        return 1;
+    }
+
+    failed = buffer_put (buf, dump, strlen (dump), res);
+    tg_free (dump);
+    return failed;
+}
+
+_Bool schema_write (tg_schema *schema, const void *api_s, tg_buffer *buf, tg_res *res)
+{
+    const tg_field *field;
+    const void *base, *member;
+    json_t *raw = schema->lazy ? *(json_t **) MEMBER_PTR (api_s, schema->raw_offset) : NULL;
+    json_t *value = NULL;
+    char number[32];
+    size_t length;
+    _Bool first = 1;
+
+    if (buffer_put (buf, "{", 1, res))
+        return 1;
+
+    for (size_t i = 0; i < schema->count; i++)
+    {
+        field = &schema->fields[i];
+        base = field_base (schema, field, (void *) api_s, 0, NULL);
+        member = base ? *(void * const *) MEMBER_PTR (base, field->offset) : NULL;
+
+        /* Members of a lazy message that weren't accessed are still json */
+        if (!member && raw && (field->kind == FIELD_OBJ || field->kind == FIELD_ARR))
+            value = json_object_get (raw, field->name);
+        else
+            value = NULL;
+
+        if (!member && !value)
+            continue;
+
+        if ((!first && buffer_put (buf, ",", 1, res)) || buffer_put (buf, "\"", 1, res)
+                || buffer_put (buf, field->name, strlen (field->name), res)
+                || buffer_put (buf, "\":", 2, res))
+            return 1;
+
+        first = 0;
+
+        if (value)
+        {
+            if (buffer_json (buf, value, res))
+                return 1;
+            continue;
+        }
+
+        switch (field->kind)
+        {
+            case FIELD_INT:
+                if (buffer_int (buf, *(const json_int_t *) member, res))
+                    return 1;
+                break;
+
+            case FIELD_STR:
+            case FIELD_ISTR:
+                if (buffer_string (buf, member, res))
+                    return 1;
+                break;
+
+            case FIELD_BOOL:
+                if (*(const _Bool *) member ? buffer_put (buf, "true", 4, res)
+                        : buffer_put (buf, "false", 5, res))
+                    return 1;
+                break;
+
+            case FIELD_REAL:
+                /* Json has no NaN or infinity */
+                if (!isfinite (*(const double *) member))
+                {
+                    if (buffer_put (buf, "null", 4, res))
+                        return 1;
+                    break;
+                }
+
+                length = snprintf (number, sizeof (number), "%.17g", *(const double *) member);
+                /* Keep reals real when they parse back */
+                if (!strpbrk (number, ".eE"))
+                {
+                    memcpy (number + length, ".0", 2);
+                    length += 2;
+                }
+                if (buffer_put (buf, number, length, res))
+                    return 1;
+                break;
+
+            case FIELD_OBJ:
+                if (schema_write (field->schema, member, buf, res))
+                    return 1;
+                break;
+
+            case FIELD_ARR:
+                length = *(const size_t *) MEMBER_PTR (base, field->len_offset);
+
+                if (buffer_put (buf, "[", 1, res))
+                    return 1;
+
+                for (size_t j = 0; j < length; j++)
+                {
+                    if ((j && buffer_put (buf, ",", 1, res))
+                            || schema_write (field->schema,
+                                (const char *) member + field->schema->size * j, buf, res))
+                        return 1;
+                }
+
+                if (buffer_put (buf, "]", 1, res))
+                    return 1;
+                break;
+        }
+    }
+
+    return buffer_put (buf, "}", 1, res);
+}
+
+_Bool update_to_json (const Update_s *api_s, tg_buffer *buf, tg_res *res)
+{
+    return schema_write (&Update_schema, api_s, buf, res);
+}
+
+SCHEMA_TYPES (SCHEMA_WRITER)